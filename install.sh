@@ -45,7 +45,7 @@ echo
 echo
 
 echo "Installing packages we need for the LCD and its tools..."
-apt -y install build-essential libsdl2-dev libdbus-1-dev libevdev-dev libxml-libxml-perl </dev/null
+apt -y install build-essential libsdl2-dev libdbus-1-dev libevdev-dev libxml-libxml-perl systemtap-sdt-dev </dev/null
 
 echo "building latest version. This takes 15-30 seconds on a Raspberry Pi 3..."
 ./build.sh || exit 1
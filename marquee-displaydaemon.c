@@ -6,23 +6,96 @@
  *  This file written by Ryan C. Gordon.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE 1  // for SCHED_IDLE and CPU affinity.
+#endif
+
 #include <stdio.h>
 #include "SDL.h"
 
 #ifdef __linux__
 #define USE_DBUS 1
 #define USE_LIBEVDEV 1
+#define USE_POSIX 1
 #else
 #define USE_DBUS 0
 #define USE_LIBEVDEV 0
+#define USE_POSIX 0
+#endif
+
+#if USE_POSIX
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <errno.h>
 #endif
 
 #if USE_DBUS
 #include <dbus/dbus.h>
+#include <poll.h>
+#include <errno.h>
 #endif
 
 #if USE_LIBEVDEV
 #include <libevdev/libevdev-uinput.h>
+#include <poll.h>
+#include <errno.h>
+#endif
+
+// USDT probes, so bpftrace/perf/systemtap can watch a running cabinet. Each
+//  one is a single nop until something attaches to it, and they compile away
+//  entirely if sys/sdt.h (Debian's systemtap-sdt-dev) isn't installed.
+//  "readelf -n marquee-displaydaemon" lists them; marquee-latency.bt uses them.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USE_SDT 1
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifndef USE_SDT
+#define USE_SDT 0
+#endif
+
+#if USE_SDT
+#define PROBE0(name) DTRACE_PROBE(marquee, name)
+#define PROBE1(name, a) DTRACE_PROBE1(marquee, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(marquee, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(marquee, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(marquee, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(marquee, name, a, b, c, d, e)
+#else  // sizeof doesn't evaluate anything, but keeps the compiler from warning about unused variables.
+#define PROBE0(name) do {} while (0)
+#define PROBE1(name, a) do { (void) sizeof (a); } while (0)
+#define PROBE2(name, a, b) do { (void) sizeof (a); (void) sizeof (b); } while (0)
+#define PROBE3(name, a, b, c) do { (void) sizeof (a); (void) sizeof (b); (void) sizeof (c); } while (0)
+#define PROBE4(name, a, b, c, d) do { (void) sizeof (a); (void) sizeof (b); (void) sizeof (c); (void) sizeof (d); } while (0)
+#define PROBE5(name, a, b, c, d, e) do { (void) sizeof (a); (void) sizeof (b); (void) sizeof (c); (void) sizeof (d); (void) sizeof (e); } while (0)
+#endif
+
+// crossfade kernels for the software compositor; picked at runtime.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define USE_SSE2_CROSSFADE 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2_CROSSFADE 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON)
+#define USE_NEON_CROSSFADE 1
+#include <arm_neon.h>
 #endif
 
 
@@ -35,9 +108,12 @@
 //#define STB_IMAGE_STATIC
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_ASSERT(x) SDL_assert(x)
-#define STBI_MALLOC(x) SDL_malloc(x)
-#define STBI_REALLOC(x,y) SDL_realloc(x, y)
-#define STBI_FREE(x) SDL_free(x)
+#define STBI_MALLOC(x) stbi_malloc_hook(x)
+#define STBI_REALLOC(x,y) stbi_realloc_hook(x, y)
+#define STBI_FREE(x) stbi_free_hook(x)
+static void *stbi_malloc_hook(size_t len);
+static void *stbi_realloc_hook(void *ptr, size_t len);
+static void stbi_free_hook(void *ptr);
 #include "stb_image.h"
 
 #define NANOSVG_IMPLEMENTATION
@@ -46,51 +122,353 @@
 #include "nanosvgrast.h"
 
 
+// Images bigger than the GPU's max texture size are split into a grid of
+//  tiles that are drawn together as one logical image.
+#define MAX_IMAGE_TILES_PER_AXIS 4
+typedef struct
+{
+    SDL_Texture *texture;
+    SDL_Rect rect;  // where this tile goes, in the image's logical size.
+} imagetile;
+
+// Animations decode a few frames ahead on worker threads into a ring of
+//  buffers; the main thread uploads them to a matching ring of streaming
+//  textures and flips between them as each frame's delay passes. GIF and APNG
+//  frames build on the previous frame, so they get one worker. Motion-JPEG
+//  video frames stand alone, so a pool of workers decodes them out of order
+//  and the ring puts them back in order for presentation.
+#define ANIM_RING_SIZE 4
+#define VIDEO_RING_SIZE 8
+#define MAX_VIDEO_WORKERS 4
+typedef enum
+{
+    ANIMFRAME_FREE,      // a worker can claim this slot.
+    ANIMFRAME_DECODING,  // a worker is decoding into this slot.
+    ANIMFRAME_DECODED,   // pixels are ready, main thread needs to upload them.
+    ANIMFRAME_UPLOADED   // texture is ready to show (or being shown).
+} animframestate;
+
+typedef struct
+{
+    animframestate state;
+    Uint32 sequence;  // position in the stream, keeps counting up when it loops.
+    SDL_bool failed;  // couldn't decode this one, skip it.
+    Uint8 *pixels;
+    SDL_Texture *texture;
+    Uint32 delayms;
+    Uint32 ready_ticks;  // when decoding finished, for video stats.
+} animframe;
+
+typedef enum
+{
+    ANIMSOURCE_GIF,
+    ANIMSOURCE_APNG,
+    ANIMSOURCE_MJPEG
+} animsource;
+
+typedef struct
+{
+    size_t offset;  // into filedata, for AVI/MOV containers.
+    size_t len;
+    char *fname;    // for a directory of numbered JPEGs.
+    Uint32 delayms;
+} videoframe;
+
+typedef struct
+{
+    Uint32 shown;
+    Uint32 dropped;  // decoded, but skipped to catch up to the clock.
+    Uint32 late;     // wasn't decoded yet when it was due.
+    Uint32 failed;
+    Uint64 total_lead_ms;  // how long frames sat decoded before being shown.
+    Uint32 min_lead_ms;
+    Uint32 start_ticks;
+} videostats;
+
+typedef struct
+{
+    char *fname;
+    Uint8 *filedata;
+    size_t filelen;
+    SDL_bool filemapped;
+    animsource source;
+    int w;
+    int h;
+    size_t framelen;
+
+    // GIF decoder state (owned by the worker once it starts).
+    stbi__context gifctx;
+    stbi__gif gif;
+    Uint8 *gif_history[2];
+    int gif_frames_decoded;
+
+    // APNG decoder state (owned by the worker once it starts).
+    Uint8 *apng_header;  // IHDR, PLTE, tRNS chunks, ready to paste into each frame.
+    size_t apng_headerlen;
+    size_t apng_pos;
+    Uint8 *apng_canvas;
+    Uint8 *apng_saved;
+    Uint8 apng_prev_dispose;
+    SDL_Rect apng_prev_rect;
+
+    // MJPEG frame table (read-only once the workers start).
+    videoframe *video_frames;
+    Uint32 video_numframes;
+    videostats stats;
+    SDL_bool stalled;
+
+    animframe frames[VIDEO_RING_SIZE];  // state and sequence fields are protected by lock.
+    int ringsize;
+    Uint32 next_sequence;  // next frame a worker should claim, protected by lock.
+    int display_slot;  // the last frame we got to, shown or skipped.
+    int shown_slot;  // the frame actually on screen; its texture isn't touched until it's replaced.
+    Uint32 next_frame_ticks;
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    SDL_atomic_t quit;
+    int numthreads;
+    SDL_Thread *threads[MAX_VIDEO_WORKERS];
+} marqueeanim;
+
+// Big JPEGs and SVGs load a quick low-resolution preview first, so the fade
+//  can start right away, while a worker thread decodes the full image. The
+//  main thread swaps the full-resolution tiles in when it's ready; the
+//  logical size doesn't change, so nothing moves on screen.
+typedef enum
+{
+    REFINE_RUNNING,
+    REFINE_DONE,
+    REFINE_ABANDONED  // the image went away; the thread cleans up after itself.
+} refinestate;
+
+typedef struct
+{
+    char *fname;
+    NSVGimage *svg;  // NULL for JPEGs.
+    float svgscale;
+    SDL_Thread *thread;
+    SDL_atomic_t state;
+    Uint8 *pixels;  // the thread's result, w*4 pitch.
+    int w;
+    int h;
+} imagerefine;
+
+typedef struct
+{
+    int w;
+    int h;
+    int numtiles;
+    imagetile tiles[MAX_IMAGE_TILES_PER_AXIS * MAX_IMAGE_TILES_PER_AXIS];
+    marqueeanim *anim;  // NULL for still images; if set, tiles[0] is the current frame.
+    imagerefine *refine;  // non-NULL while this is a preview and the full image is still decoding.
+    SDL_bool preview;  // tiles are linear-filtered, so they can't go back in the texture pool.
+} marqueeimage;
+
 static SDL_Window *window = NULL;
 static SDL_Renderer *renderer = NULL;
-static SDL_Texture *texture = NULL;
-static int texturew = 0;
-static int textureh = 0;
+static marqueeimage *current_image = NULL;
+static int max_texture_w = 0;
+static int max_texture_h = 0;
+static int panelw = 0;
+static int panelh = 0;
 static int screenw = 0;
 static int screenh = 0;
 static Uint32 fadems = 500;
+static SDL_bool use_streaming_textures = SDL_FALSE;
+static SDL_bool prescale_images = SDL_TRUE;
+static Uint32 anim_budget_mb = 32;
+static int video_threads = 0;  // 0 means "one less than the number of CPU cores"
+static Uint32 video_fps = 30;  // for directories of JPEGs, or containers that don't say.
+static SDL_bool force_software = SDL_FALSE;
+
+// Decodes happen right when an emulator is starting up, so decode threads
+//  get out of its way: SCHED_IDLE (or a nice level), optionally pinned to
+//  cores the emulator isn't using, and they pause between chunks of work
+//  while the CPU is contended.
+#define DECODE_NICE_IDLE 100  // not a real nice level; means SCHED_IDLE.
+#define CPU_PRESSURE_SAMPLE_MS 50
+#define DECODE_BACKOFF_STEP_MS 25
+#define MAX_DECODE_BACKOFF_MS 500  // per chunk, so a busy system still gets its marquee eventually.
+static int decode_nice = DECODE_NICE_IDLE;
+static int decode_pressure_limit = 20;  // percent of time something waited for a CPU; 0 to never back off.
+#if USE_POSIX
+static cpu_set_t decode_cpus;  // empty to run anywhere.
+#endif
+static SDL_SpinLock cpu_pressure_lock = 0;
+static SDL_bool cpu_pressure_unavailable = SDL_FALSE;
+static Uint32 cpu_pressure_ticks = 0;
+static Uint64 cpu_pressure_total = 0;  // microseconds, from the "some" line.
+static SDL_atomic_t cpu_pressure;  // percent, over the last sample.
+static SDL_atomic_t cpu_pressure_avg10;  // percent, the kernel's 10 second average.
+static const char *cpu_pressure_path = "/proc/pressure/cpu";
+
+// When the Pi gets hot or busy, do less: fade at half the frame rate, then
+//  cut instead of fading, and decode smaller. Full quality comes back (and
+//  the marquee is reloaded at full resolution) once things cool off.
+typedef enum
+{
+    QUALITY_FULL,
+    QUALITY_REDUCED,
+    QUALITY_MINIMAL
+} qualitylevel;
+#define QUALITY_CHECK_MS 1000
+#define THERMAL_REDUCED_MC 70000  // millidegrees C; the Pi starts throttling at 80.
+#define THERMAL_MINIMAL_MC 78000
+#define THERMAL_HYSTERESIS_MC 5000
+#define PRESSURE_REDUCED 40  // percent, 10 second average.
+#define PRESSURE_MINIMAL 70
+#define PRESSURE_HYSTERESIS 15
+static const char *thermal_path = "/sys/class/thermal/thermal_zone0/temp";
+static qualitylevel quality = QUALITY_FULL;
+static Uint32 quality_ticks = 0;
+static SDL_bool loaded_degraded = SDL_FALSE;  // the last load_image() cut corners.
+static SDL_bool current_image_degraded = SDL_FALSE;
+static char *current_image_fname = NULL;
+
+// Textures we're done with, kept around to be reused by the next image with
+//  the same access and dimensions instead of being destroyed and recreated,
+//  since that churns the GPU's memory on every switch. They're all
+//  SDL_PIXELFORMAT_ABGR8888, so that's not part of the key.
+#define TEXTURE_POOL_SIZE 8
+#define TEXTURE_POOL_MAX_BYTES (16 * 1024 * 1024)
+typedef struct
+{
+    SDL_Texture *texture;
+    int access;
+    int w;
+    int h;
+} pooledtexture;
+static pooledtexture texture_pool[TEXTURE_POOL_SIZE];
+static Uint32 texture_pool_reused = 0;
+static Uint32 texture_pool_created = 0;
+
+// Everything big we hold, by who's holding it, so we can see where the
+//  memory goes and keep it under --membudget. All of SDL_malloc (which
+//  stb_image uses, too) goes through mem_malloc() and friends, with a small
+//  header on each block saying how big it is and whose it is. Textures are
+//  counted at w*h*4 when they're made and destroyed; on the Pi, the GPU's
+//  memory comes out of the same 1GB.
+typedef enum
+{
+    MEM_OTHER,  // SDL's own allocations and everything small.
+    MEM_DECODE,  // stb_image, PNG pipeline, preview and refine buffers.
+    MEM_ANIM,  // decoded animation frames.
+    MEM_COMPOSITOR,  // software fade buffers.
+    MEM_KEYBOARD,  // keyboard layers, in RAM and in textures.
+    MEM_TEXTURES,  // marquee image textures.
+    MEM_TEXTURE_POOL,  // idle streaming textures waiting to be reused.
+    MEM_NUM_OWNERS
+} memowner;
+
+typedef struct
+{
+    size_t len;
+    memowner owner;
+} memheader;
+
+#define MEM_HEADER_LEN 16  // sizeof (memheader), padded to keep malloc's alignment.
+#define MEM_BUDGET_REDUCED 85  // percent of --membudget.
+#define MEM_BUDGET_MINIMAL 100
+#define MEM_BUDGET_HYSTERESIS 15
+#define MEM_PRESSURE_REDUCED 10  // percent of time something stalled on memory, 10 second average.
+#define MEM_PRESSURE_MINIMAL 25
+#define MEM_PRESSURE_HYSTERESIS 5
+#define MEM_PRESSURE_TRIGGER "some 150000 2000000"  // 150ms of stalls in a 2 second window.
+static SDL_malloc_func real_malloc = NULL;
+static SDL_calloc_func real_calloc = NULL;
+static SDL_realloc_func real_realloc = NULL;
+static SDL_free_func real_free = NULL;
+static SDL_atomic_t mem_used[MEM_NUM_OWNERS];  // bytes; an int is plenty on a Pi.
+static SDL_atomic_t mem_total;
+static SDL_atomic_t mem_peak;
+static Uint32 mem_budget_mb = 0;  // 0 to just keep count.
+static const char *memory_pressure_path = "/proc/pressure/memory";
+static SDL_Thread *memory_pressure_watcher = NULL;
+static int memory_pressure_quitpipe[2] = { -1, -1 };
+static SDL_atomic_t memory_pressure_event;  // the kernel's PSI trigger went off.
+static SDL_atomic_t memory_report_requested;  // SIGUSR2.
+
+// When decoding straight into a locked texture, this is the memory we'll
+//  hand to stb_image for its final output buffer, so it writes the pixels
+//  where they need to end up instead of somewhere we'd have to copy from.
+static void *stbi_target_pixels = NULL;
+static size_t stbi_target_len = 0;
+static SDL_bool stbi_target_taken = SDL_FALSE;
+static SDL_threadID main_thread_id = 0;
+static Uint64 boot_ticks = 0;  // when main() started, for the boot timings.
+static SDL_bool marquee_snapshot_pending = SDL_FALSE;  // current_image changed since the last snapshot.
+static SDL_Thread *marquee_snapshot_writer = NULL;
+static SDL_atomic_t marquee_snapshot_done;
 
 #if USE_DBUS
 static DBusConnection *dbus = NULL;
 #endif
 
 
-static int fingers_down = 0;
+static SDL_atomic_t fingers_down;  // the touch thread counts these; the main thread checks them for idle.
 
 // virtual mouse state
 static SDL_bool motion_finger_down = SDL_FALSE;
 static SDL_FingerID motion_finger = 0;
 static SDL_bool button_finger_down = SDL_FALSE;
 static SDL_FingerID button_finger = 0;
+static float mouse_motion_x = 0.0f;  // pixels moved but not sent yet, fractions included.
+static float mouse_motion_y = 0.0f;
 #if USE_LIBEVDEV
 static struct libevdev *evdev_mouse = NULL;
 static struct libevdev_uinput *uidev_mouse = NULL;
 #endif
 
 // virtual keyboard state
+#define MAX_KEYBOARD_LAYERS 8
+#define MAX_LAYER_KEYS 128
 typedef struct
 {
     unsigned int scancode;
-    SDL_Rect rect;
+    int layer;  // the layer this key switches to, or -1 if it types.
+    SDL_Rect rect;  // in the layer's image.
+    SDL_Rect screenrect;  // where it lands on the screen once the keyboard is all the way in.
 } virtkey;
 typedef struct
+{
+    char name[32];
+    char *image;
+    virtkey keys[MAX_LAYER_KEYS];
+    int numkeys;
+    SDL_Texture *texture;  // already scaled to the screen; drawn 1:1.
+    Uint8 *pixels;  // the scaled image, until the main thread uploads it to texture.
+    int h;
+    Uint8 *hitgrid;  // keys index + 1 per cell, 0 for no key.
+    int hitgrid_h;
+} keyboardlayer;
+typedef struct
 {
     SDL_bool pressed;
     SDL_FingerID finger;
     int keyindex;
+    unsigned int scancode;  // the layer might change before this is released.
+    SDL_Rect screenrect;
 } keypress;
 static SDL_bool keyboard_slide_cooldown = SDL_FALSE;
 static float keyboard_slide_percent = 0.0f;
-static int keyboardw = 0;
-static int keyboardh = 0;
+static const char *keyboard_layout_path = "/home/pi/arcade1up-lcd-marquee/keyboard-en.txt";
+static keyboardlayer keyboard_layers[MAX_KEYBOARD_LAYERS];
+static int num_keyboard_layers = 0;
+// these point into the current layer, so switching layers is just swapping them.
 static SDL_Texture *keyboard_texture = NULL;
-static virtkey keyinfo[64];
+static const virtkey *keyinfo = NULL;
+static const Uint8 *keyboard_hitgrid = NULL;
+static int keyboardh = 0;
+static int keyboard_hitgrid_w = 0;
+static int keyboard_hitgrid_h = 0;
 static keypress pressed_keys[10];
+static Sint8 key_pressed_slot[MAX_LAYER_KEYS];  // index into pressed_keys, -1 if not pressed.
+static SDL_Texture *keyboard_overlay = NULL;  // keyboard plus highlights, composited when they change.
+static int keyboard_overlay_h = 0;
+static SDL_atomic_t keyboard_serial;  // bumped whenever the layer or pressed keys change.
+static SDL_Thread *keyboard_loader = NULL;  // parses and decodes the keyboard in the background.
+static SDL_atomic_t keyboard_loader_done;
+static int keyboard_overlay_serial = -1;  // what keyboard_overlay currently shows.
 static Uint32 keyboard_slide_ms = 500;
 #if USE_LIBEVDEV
 static struct libevdev *evdev_keyboard = NULL;
@@ -101,325 +479,4516 @@ static void (*handle_fingerdown)(const SDL_TouchFingerEvent *e) = NULL;
 static void (*handle_fingerup)(const SDL_TouchFingerEvent *e) = NULL;
 static void (*handle_fingermotion)(const SDL_TouchFingerEvent *e) = NULL;
 static void (*handle_redraw)(void) = NULL;
+static SDL_bool redraw_pending = SDL_FALSE;  // main thread only; see request_redraw().
+
+// Input handlers might run on the touch thread, so they don't draw or
+//  animate; they ask the main thread to, and wake it up if it's waiting.
+enum { KEYBOARD_SLIDE_NONE, KEYBOARD_SLIDE_IN, KEYBOARD_SLIDE_OUT };
+static SDL_atomic_t keyboard_slide_request;
+static SDL_atomic_t redraw_request;
+static SDL_mutex *input_lock = NULL;  // only exists while the touch thread runs.
+static Uint32 input_wake_event = 0;
+#if USE_LIBEVDEV
+static const char *touch_device_path = NULL;  // --touchdevice; NULL to let SDL handle touches.
+static struct libevdev *evdev_touch = NULL;
+static SDL_Thread *touch_thread = NULL;
+static SDL_atomic_t touch_thread_quit;
+#endif
 
-static void redraw_window(void)
+// Idle mode: after --idledim seconds without a new image or a touch, stop
+//  drawing and dim the backlight; after --idleblank seconds, switch it off.
+//  A ShowImage or a touch wakes everything back up by the next frame.
+typedef enum { IDLE_AWAKE, IDLE_DIMMED, IDLE_BLANKED } idlestate;
+#define IDLE_DIM_PERCENT 20
+static const char *backlight_path = "/sys/class/backlight/rpi_backlight";
+static Uint32 idle_dim_ms = 0;  // 0 to never dim.
+static Uint32 idle_blank_ms = 0;  // 0 to never blank.
+static SDL_atomic_t idle_state;  // the touch thread checks this to know if it has to wake us.
+static SDL_atomic_t activity_serial;  // bumped on every new image or touch.
+static SDL_atomic_t last_activity_ticks;
+static int idle_activity_serial = 0;  // activity_serial when we went idle.
+static int backlight_brightness = -1;  // what to go back to after dimming; -1 if we aren't dimmed.
+
+// A cheap, always-on trace of what the daemon is up to, for finding where the
+//  time goes when a marquee change feels slow. Each thread appends spans to
+//  its own ring (no locks; only that thread writes to it), and SIGUSR1 or a
+//  DumpTrace D-Bus signal writes them all out as Chrome trace-event JSON,
+//  which ui.perfetto.dev or chrome://tracing can open.
+#define TRACE_RING_SIZE 4096  // spans per thread; must be a power of two.
+#define MAX_TRACE_RINGS 64
+typedef struct
 {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-    SDL_RenderClear(renderer);
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-    if (texture) {  // fading in
-        SDL_RenderSetLogicalSize(renderer, texturew, textureh);
-        SDL_SetTextureAlphaMod(texture, 255);
-        SDL_RenderCopy(renderer, texture, NULL, NULL);
-    }
-    SDL_RenderSetLogicalSize(renderer, screenw, screenh);
-
-    if (handle_redraw) {
-        handle_redraw();
-    }
+    const char *name;  // always a string literal.
+    Uint64 start;  // performance counter ticks.
+    Uint64 duration;
+} tracespan;
 
-    SDL_RenderPresent(renderer);
+typedef struct
+{
+    tracespan spans[TRACE_RING_SIZE];
+    SDL_atomic_t count;  // spans ever written; the next one goes in spans[count % TRACE_RING_SIZE].
+    SDL_atomic_t retired;  // its thread is gone; the next new thread takes it over.
+    unsigned long tid;
+    char threadname[16];
+} tracering;
+
+static SDL_bool tracing = SDL_TRUE;
+static const char *trace_path = "/tmp/marquee-trace.json";
+static SDL_TLSID trace_tls = 0;
+static SDL_SpinLock trace_rings_lock = 0;
+static tracering *trace_rings[MAX_TRACE_RINGS];
+static int num_trace_rings = 0;  // protected by trace_rings_lock.
+static SDL_atomic_t trace_dump_requested;  // the SIGUSR1 handler sets this.
+
+static void draw_image(const marqueeimage *img, const Uint8 alpha);
+
+static void SDLCALL retire_trace_ring(void *data)
+{
+    SDL_AtomicSet(&((tracering *) data)->retired, 1);  // keep the spans around for the next dump.
 }
 
-
-static void handle_fingerdown_keyboard(const SDL_TouchFingerEvent *e);
-static void handle_fingerup_keyboard(const SDL_TouchFingerEvent *e);
-static void handle_fingermotion_keyboard(const SDL_TouchFingerEvent *e);
-static void handle_redraw_keyboard(void);
-static void handle_fingerdown_mouse(const SDL_TouchFingerEvent *e);
-static void handle_fingerup_mouse(const SDL_TouchFingerEvent *e);
-static void handle_fingermotion_mouse(const SDL_TouchFingerEvent *e);
-
-
-static SDL_Texture *load_image(const char *fname, int *_w, int *_h)
+static tracering *claim_trace_ring(void)
 {
-    SDL_Texture *newtex = NULL;
-
-    if (fname) {
-        const char *ext = SDL_strrchr(fname, '.');
-        if (ext && (SDL_strcasecmp(ext, ".svg") == 0)) {
-            NSVGimage *image = image = nsvgParseFromFile(fname, "px", 96.0f);
-            if (!image) {
-                fprintf(stderr, "WARNING: couldn't load SVG image \"%s\"\n", fname);
-            } else {
-                NSVGrasterizer *rast = nsvgCreateRasterizer();
-                if (!rast) {
-                    fprintf(stderr, "WARNING: couldn't create SVG rasterizer for \"%s\"\n", fname);
-                } else {
-                    const int w = (int) image->width;
-                    const int h = (int) image->height;
-                    *_w = w;
-                    *_h = h;
-                    unsigned char *img = SDL_malloc(w * h * 4);
-                    if (!img) {
-                        fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
-                    } else {
-                        nsvgRasterize(rast, image, 0, 0, 1, img, w, h, w * 4);
-                        newtex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888,
-                                                   SDL_TEXTUREACCESS_STATIC, w, h);
-                        if (!newtex) {
-                            fprintf(stderr, "WARNING: couldn't create texture for \"%s\"\n", fname);
-                        } else {
-                            SDL_UpdateTexture(newtex, NULL, img, w * 4);
-                            SDL_SetTextureBlendMode(newtex, SDL_BLENDMODE_BLEND);
-                        }
-                        SDL_free(img);
-                    }
-                    nsvgDeleteRasterizer(rast);
-                }
-	            nsvgDelete(image);
-            }
-        } else {
-            int n;
-            stbi_uc *img = stbi_load(fname, _w, _h, &n, 4);
-            if (!img) {
-                fprintf(stderr, "WARNING: couldn't load image \"%s\"\n", fname);
-            } else {
-                newtex = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888,
-                                           SDL_TEXTUREACCESS_STATIC, *_w, *_h);
-                if (!newtex) {
-                    fprintf(stderr, "WARNING: couldn't create texture for \"%s\"\n", fname);
-                } else {
-                    SDL_UpdateTexture(newtex, NULL, img, *_w * 4);
-                    SDL_SetTextureBlendMode(newtex, SDL_BLENDMODE_BLEND);
-                }
-                stbi_image_free(img);
-            }
+    tracering *retval = NULL;
+    SDL_AtomicLock(&trace_rings_lock);
+    for (int i = 0; i < num_trace_rings; i++) {
+        if (SDL_AtomicGet(&trace_rings[i]->retired)) {
+            retval = trace_rings[i];  // a finished thread's ring; its spans are the oldest we have.
+            break;
+        }
+    }
+    if (!retval && (num_trace_rings < MAX_TRACE_RINGS)) {
+        retval = (tracering *) SDL_malloc(sizeof (tracering));
+        if (retval) {
+            trace_rings[num_trace_rings++] = retval;
+        }
+    }
+    if (retval) {
+        SDL_AtomicSet(&retval->count, 0);
+        SDL_AtomicSet(&retval->retired, 0);
+        retval->tid = SDL_ThreadID();
+        SDL_strlcpy(retval->threadname, "thread", sizeof (retval->threadname));
+        if (retval->tid == main_thread_id) {
+            SDL_strlcpy(retval->threadname, "main", sizeof (retval->threadname));
+        }
+        #if USE_POSIX
+        else {
+            pthread_getname_np(pthread_self(), retval->threadname, sizeof (retval->threadname));  // SDL_CreateThread's name.
         }
+        #endif
     }
-    return newtex;
+    SDL_AtomicUnlock(&trace_rings_lock);
+    return retval;
 }
 
-
-static void set_new_image(const char *fname)
+// returns 0 if we aren't tracing, which makes trace_end() a no-op.
+static Uint64 trace_begin(void)
 {
-    int w = 0;
-    int h = 0;
-
-    printf("Setting new image \"%s\"\n", fname);
-
-    SDL_Texture *newtex = load_image(fname, &w, &h);
-    const Uint32 startms = SDL_GetTicks();
-    const Uint32 timeout = startms + fadems;
-    for (Uint32 now = startms; !SDL_TICKS_PASSED(now, timeout); now = SDL_GetTicks()) {
-        const float unclamped_percent = ((float) (now - startms)) / ((float) fadems);
-        const float percent = SDL_max(0.0f, SDL_min(unclamped_percent, 1.0f));
+    return tracing ? SDL_GetPerformanceCounter() : 0;
+}
 
-        SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
-        SDL_RenderClear(renderer);
-        SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+static void trace_end(const char *name, const Uint64 start)
+{
+    if (!start) {
+        return;
+    }
 
-        if (texture) {  // fading out
-            SDL_RenderSetLogicalSize(renderer, texturew, textureh);
-            SDL_SetTextureAlphaMod(texture, (Uint8) (255.0f * (1.0f - percent)));
-            SDL_RenderCopy(renderer, texture, NULL, NULL);
+    const Uint64 now = SDL_GetPerformanceCounter();
+    tracering *ring = (tracering *) SDL_TLSGet(trace_tls);
+    if (!ring) {
+        ring = claim_trace_ring();
+        if (!ring) {
+            return;  // out of rings; this thread goes untraced.
         }
+        SDL_TLSSet(trace_tls, ring, retire_trace_ring);
+    }
 
-        if (newtex) {  // fading in
-            SDL_RenderSetLogicalSize(renderer, w, h);
-            SDL_SetTextureAlphaMod(newtex, (Uint8) (255.0f * percent));
-            SDL_RenderCopy(renderer, newtex, NULL, NULL);
-        }
+    const int count = SDL_AtomicGet(&ring->count);
+    tracespan *span = &ring->spans[count & (TRACE_RING_SIZE - 1)];
+    span->name = name;
+    span->start = start;
+    span->duration = now - start;
+    SDL_AtomicSet(&ring->count, count + 1);  // publishes the span; SDL's atomics are full barriers.
+}
 
-        // !!! FIXME: move this loop to state variables and make it part of
-        // !!! FIXME:  redraw_window() instead of shoving a handle_redraw
-        // !!! FIXME:  call in here.
-        if (handle_redraw) {
-            handle_redraw();
-        }
+#if USE_POSIX
+static void trace_signal_handler(int sig)
+{
+    SDL_AtomicSet(&trace_dump_requested, 1);  // the main thread does the actual work.
+}
+#endif
+
+// Main thread. Copies each ring and throws out anything the owning thread
+//  might have been overwriting while we copied, so it never has to wait on us.
+static void dump_trace(const char *path)
+{
+    FILE *io = fopen(path, "w");
+    if (!io) {
+        fprintf(stderr, "WARNING: Couldn't write trace to \"%s\"\n", path);
+        return;
+    }
 
-        SDL_RenderPresent(renderer);
-        SDL_Delay(10);
+    tracering *copy = (tracering *) SDL_malloc(sizeof (tracering));
+    if (!copy) {
+        fclose(io);
+        return;
     }
 
-    SDL_Texture *destroyme = texture;
-    texture = newtex;
-    texturew = w;
-    textureh = h;
+    #if USE_POSIX
+    const int pid = (int) getpid();
+    #else
+    const int pid = 1;
+    #endif
 
-    // one last time, with no fade at all.
-    redraw_window();
+    const double usecs_per_tick = 1000000.0 / ((double) SDL_GetPerformanceFrequency());
+    unsigned int total = 0;
+    fprintf(io, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(io, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"marquee-displaydaemon\"}}", pid);
+
+    SDL_AtomicLock(&trace_rings_lock);
+    const int numrings = num_trace_rings;
+    SDL_AtomicUnlock(&trace_rings_lock);
+
+    for (int i = 0; i < numrings; i++) {
+        SDL_AtomicLock(&trace_rings_lock);  // so nobody claims it while we copy.
+        tracering *ring = trace_rings[i];
+        const int before = SDL_AtomicGet(&ring->count);
+        SDL_memcpy(copy, ring, sizeof (tracering));
+        const int after = SDL_AtomicGet(&ring->count);
+        SDL_AtomicUnlock(&trace_rings_lock);
+
+        // spans from before-1 down to after-TRACE_RING_SIZE+1 can't have changed under us.
+        const int first = SDL_max(0, (after - TRACE_RING_SIZE) + 1);
+        fprintf(io, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}", pid, copy->tid, copy->threadname);
+        for (int j = first; j < before; j++) {
+            const tracespan *span = &copy->spans[j & (TRACE_RING_SIZE - 1)];
+            const double ts = ((double) (Sint64) (span->start - boot_ticks)) * usecs_per_tick;
+            fprintf(io, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%lu}", span->name, ts, ((double) span->duration) * usecs_per_tick, pid, copy->tid);
+            total++;
+        }
+    }
 
-    if (destroyme) {
-        SDL_DestroyTexture(destroyme);
+    fprintf(io, "\n]}\n");
+    const SDL_bool okay = (fclose(io) == 0) ? SDL_TRUE : SDL_FALSE;
+    SDL_free(copy);
+    if (okay) {
+        printf("Wrote %u trace spans from %d threads to \"%s\"\n", total, numrings, path);
+    } else {
+        fprintf(stderr, "WARNING: Couldn't write trace to \"%s\"\n", path);
     }
 }
 
-static void slide_in_keyboard(void)
+// Every animation (fades, keyboard slides, animated images) presents through
+//  present_frame(). If the renderer really waits for vsync, that does the
+//  pacing for us; if it doesn't (the vsync renderer failed to create, or the
+//  driver ignores the flag), we sleep until the next frame is due so we
+//  don't spin the CPU drawing frames nobody will see.
+#define FRAME_PACER_PROBE_FRAMES 8
+#define FRAME_STATS_INTERVAL_MS 10000
+#define MIN_VSYNC_INTERVAL_MS 4.0   // anything faster than 250Hz means present isn't blocking.
+#define MAX_FRAME_GAP_MS 250.0  // longer than this is an idle gap, not a slow frame.
+
+typedef struct
 {
-    if (!keyboard_texture) {
-        return;  // no keyboard for you.
-    }
+    SDL_bool vsync;
+    Uint64 interval;  // in performance counter ticks.
+    Uint64 last_present;  // when the frame was scheduled, for timer pacing.
+    Uint64 last_flip;  // when it actually went out, for stats.
+    Uint64 frames;
+    Uint64 late_frames;
+    Uint64 total_ticks;
+    Uint64 min_ticks;
+    Uint64 max_ticks;
+    Uint32 stats_start;
+} framepacer;
+
+static framepacer pacer;
+static int target_fps = 0;  // 0 means "the display's refresh rate."
+static SDL_bool show_frame_stats = SDL_FALSE;
+
+static double ticks_to_ms(const Uint64 ticks)
+{
+    return (((double) ticks) * 1000.0) / ((double) SDL_GetPerformanceFrequency());
+}
 
-    //printf("Sliding in keyboard!\n");
+static void reset_frame_stats(void)
+{
+    pacer.frames = pacer.late_frames = pacer.total_ticks = pacer.max_ticks = 0;
+    pacer.min_ticks = ~((Uint64) 0);
+    pacer.stats_start = SDL_GetTicks();
+}
 
-    // Send keyup events for anything that fingers are still touching.
-    #if USE_LIBEVDEV
-    if (button_finger_down && uidev_mouse) {
-        libevdev_uinput_write_event(uidev_mouse, EV_KEY, BTN_LEFT, 0);
-        libevdev_uinput_write_event(uidev_mouse, EV_SYN, SYN_REPORT, 0);
+static void report_frame_stats(void)
+{
+    if (pacer.frames > 0) {
+        printf("Frame stats: %u frames, avg %.2fms, min %.2fms, max %.2fms, %u late (target %.2fms, %s)\n",
+               (unsigned int) pacer.frames, ticks_to_ms(pacer.total_ticks / pacer.frames),
+               ticks_to_ms(pacer.min_ticks), ticks_to_ms(pacer.max_ticks),
+               (unsigned int) pacer.late_frames, ticks_to_ms(pacer.interval),
+               pacer.vsync ? "vsync" : "timer");
     }
-    #endif
-    motion_finger_down = SDL_FALSE;
-    motion_finger = 0;
-    button_finger_down = SDL_FALSE;
-    button_finger = 0;
+    reset_frame_stats();
+}
 
-    keyboard_slide_cooldown = SDL_TRUE;
-    handle_fingerup = handle_fingerup_keyboard;
-    handle_fingerdown = handle_fingerdown_keyboard;
-    handle_fingermotion = handle_fingermotion_keyboard;
-    handle_redraw = handle_redraw_keyboard;
-    keyboard_slide_percent = 0.0f;
+// display refreshes per frame we draw; when the Pi is hot or busy, every
+//  animation drops to half rate to save some CPU and GPU.
+static int frame_multiple(void)
+{
+    return (quality >= QUALITY_REDUCED) ? 2 : 1;
+}
 
-    const Uint32 startms = SDL_GetTicks();
-    const Uint32 timeout = startms + keyboard_slide_ms;
-    for (Uint32 now = startms; !SDL_TICKS_PASSED(now, timeout); now = SDL_GetTicks()) {
-        const float unclamped_percent = ((float) (now - startms)) / ((float) keyboard_slide_ms);
-        keyboard_slide_percent = SDL_max(0.0f, SDL_min(unclamped_percent, 1.0f));
-        redraw_window();
+// when the next frame can go out without waiting on anything.
+static Uint64 next_frame_due(void)
+{
+    const int multiple = frame_multiple();
+    if (pacer.vsync && (multiple > 1)) {
+        // sleep into the last refresh we're skipping; the present waits out the rest.
+        return pacer.last_present + (pacer.interval * (multiple - 1)) + (pacer.interval / 2);
     }
-
-    keyboard_slide_percent = 1.0f;
-    redraw_window();
+    return pacer.last_present + (pacer.interval * multiple);
 }
 
-static void slide_out_keyboard(void)
+static void present_frame(void)
 {
-    //printf("Sliding out keyboard!\n");
-
-    // Send keyup events for anything that fingers are still touching.
-    for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
-        if (pressed_keys[i].pressed) {
-            //printf("Released virtual keyboard key %u\n", keyinfo[pressed_keys[i].keyindex].scancode);
-            pressed_keys[i].pressed = SDL_FALSE;
-
-            #if USE_LIBEVDEV
-            if (uidev_keyboard) {
-                libevdev_uinput_write_event(uidev_keyboard, EV_KEY, keyinfo[pressed_keys[i].keyindex].scancode, 0);
-                libevdev_uinput_write_event(uidev_keyboard, EV_SYN, SYN_REPORT, 0);
-            }
-            #endif
+    Uint64 scheduled = SDL_GetPerformanceCounter();
+    if ((!pacer.vsync || (frame_multiple() > 1)) && pacer.interval) {
+        const Uint64 due = next_frame_due();
+        if (scheduled < due) {
+            const Uint64 trace_start = trace_begin();
+            SDL_Delay((Uint32) ticks_to_ms(due - scheduled));
+            trace_end("pace_frame", trace_start);
+            scheduled = due;  // keep to the schedule so SDL_Delay's rounding doesn't drift.
         }
     }
 
-    keyboard_slide_cooldown = SDL_TRUE;
-    handle_fingerup = handle_fingerup_mouse;
-    handle_fingerdown = handle_fingerdown_mouse;
-    handle_fingermotion = handle_fingermotion_mouse;
-    handle_redraw = handle_redraw_keyboard;
-    keyboard_slide_percent = 0.0f;
-
-    const Uint32 startms = SDL_GetTicks();
-    const Uint32 timeout = startms + keyboard_slide_ms;
-    for (Uint32 now = startms; !SDL_TICKS_PASSED(now, timeout); now = SDL_GetTicks()) {
-        const float unclamped_percent = ((float) (now - startms)) / ((float) keyboard_slide_ms);
-        keyboard_slide_percent = 1.0f - SDL_max(0.0f, SDL_min(unclamped_percent, 1.0f));
-        redraw_window();
+    const Uint64 present_start = SDL_GetPerformanceCounter();
+    SDL_RenderPresent(renderer);
+    trace_end("SDL_RenderPresent", tracing ? present_start : 0);
+
+    const Uint64 now = SDL_GetPerformanceCounter();
+    const Uint64 elapsed = now - pacer.last_flip;
+    PROBE2(present, (Uint32) (ticks_to_ms(now - present_start) * 1000.0), pacer.last_flip ? (Uint32) (ticks_to_ms(elapsed) * 1000.0) : 0);  // microseconds.
+    if (pacer.last_flip && (ticks_to_ms(elapsed) < MAX_FRAME_GAP_MS)) {
+        pacer.frames++;
+        pacer.total_ticks += elapsed;
+        pacer.min_ticks = SDL_min(pacer.min_ticks, elapsed);
+        pacer.max_ticks = SDL_max(pacer.max_ticks, elapsed);
+        if (elapsed > ((pacer.interval * frame_multiple()) + (pacer.interval / 2))) {
+            pacer.late_frames++;
+        }
     }
+    pacer.last_present = pacer.vsync ? now : scheduled;
+    pacer.last_flip = now;
 
-    keyboard_slide_percent = 0.0f;
-    redraw_window();
-    handle_redraw = NULL;
+    if (show_frame_stats && SDL_TICKS_PASSED(SDL_GetTicks(), pacer.stats_start + FRAME_STATS_INTERVAL_MS)) {
+        report_frame_stats();
+    }
 }
 
+// milliseconds until the next frame should go out, so callers can keep
+//  handling input instead of blocking in a present that can't flip yet.
+static Uint32 frame_wait_ms(void)
+{
+    const Uint64 due = next_frame_due();
+    const Uint64 now = SDL_GetPerformanceCounter();
+    return (now >= due) ? 0 : (Uint32) ticks_to_ms(due - now);
+}
 
-static void handle_fingerdown_mouse(const SDL_TouchFingerEvent *e)
+// Until probe_frame_pacer() can check, trust the renderer if it says it
+//  waits for vsync, and assume the display's refresh rate either way.
+static void init_frame_pacer(const SDL_RendererInfo *info)
 {
-    if (fingers_down == 4) {
-        slide_in_keyboard();
-    } else if (!motion_finger_down) {
-        //printf("FINGERDOWN: This is the motion finger.\n");
-        motion_finger = e->fingerId;
-        motion_finger_down = SDL_TRUE;
-    } else if (!button_finger_down) {
-        //printf("FINGERDOWN: This is the button finger.\n");
-        button_finger = e->fingerId;
-        button_finger_down = SDL_TRUE;
-        #if USE_LIBEVDEV
-        if (uidev_mouse) {
-            libevdev_uinput_write_event(uidev_mouse, EV_KEY, BTN_LEFT, 1);
-            libevdev_uinput_write_event(uidev_mouse, EV_SYN, SYN_REPORT, 0);
-        }
-        #endif
+    const Uint64 freq = SDL_GetPerformanceFrequency();
+    SDL_zero(pacer);
+
+    int fps = target_fps;
+    SDL_DisplayMode mode;
+    if ((fps <= 0) && (SDL_GetWindowDisplayMode(window, &mode) == 0)) {
+        fps = mode.refresh_rate;
     }
+    pacer.interval = freq / ((fps > 0) ? fps : 60);
+    pacer.vsync = ((info->flags & SDL_RENDERER_PRESENTVSYNC) && (target_fps <= 0)) ? SDL_TRUE : SDL_FALSE;
+    reset_frame_stats();
 }
 
-static void handle_fingerup_mouse(const SDL_TouchFingerEvent *e)
+static void render_window(void);
+
+// time a few presents to see if the renderer actually waits for vsync. This
+//  runs after the first image is up, so it doesn't hold up the first pixel,
+//  and it redraws that image instead of blanking the screen.
+static void probe_frame_pacer(void)
 {
-    if (motion_finger_down && (e->fingerId == motion_finger)) {
-        //printf("FINGERUP: This is the motion finger.\n");
-        motion_finger_down = SDL_FALSE;
-        motion_finger = 0;
-    } else if (button_finger_down && (e->fingerId == button_finger)) {
-        //printf("FINGERUP: This is the button finger.\n");
-        button_finger_down = SDL_FALSE;
-        button_finger = 0;
-        #if USE_LIBEVDEV
-        if (uidev_mouse) {
-            libevdev_uinput_write_event(uidev_mouse, EV_KEY, BTN_LEFT, 0);
-            libevdev_uinput_write_event(uidev_mouse, EV_SYN, SYN_REPORT, 0);
+    if (pacer.vsync) {
+        render_window();
+        SDL_RenderPresent(renderer);  // the first one can take longer for reasons.
+        const Uint64 start = SDL_GetPerformanceCounter();
+        for (int i = 0; i < FRAME_PACER_PROBE_FRAMES; i++) {
+            render_window();
+            SDL_RenderPresent(renderer);
+        }
+        const Uint64 interval = (SDL_GetPerformanceCounter() - start) / FRAME_PACER_PROBE_FRAMES;
+        if (ticks_to_ms(interval) >= MIN_VSYNC_INTERVAL_MS) {
+            pacer.interval = interval;
+        } else {
+            pacer.vsync = SDL_FALSE;  // present doesn't block, pace it with the display's refresh rate.
         }
-        #endif
     }
+
+    printf("Frame pacing: %.2fms per frame (%s)\n", ticks_to_ms(pacer.interval), pacer.vsync ? "vsync" : "timer");
+    reset_frame_stats();  // the start image's fade was paced on a guess.
 }
 
-static void handle_fingermotion_mouse(const SDL_TouchFingerEvent *e)
+static void render_window(void)
 {
-    if (!motion_finger_down || (e->fingerId != motion_finger)) {
-        return;
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    if (current_image) {
+        draw_image(current_image, 255);
     }
+    SDL_RenderSetLogicalSize(renderer, screenw, screenh);
 
-    #if USE_LIBEVDEV
-    if (uidev_mouse) {
-        SDL_bool hasdata = SDL_FALSE;
-            if (e->dx != 0.0f) {
-                hasdata = SDL_TRUE;
-                const int val = (int) (((float) screenw) * e->dx);
-                //printf("X FINGERMOTION: %d\n", val);
-                libevdev_uinput_write_event(uidev_mouse, EV_REL, REL_X, val);
-            }
-            if (e->dy != 0.0f) {
-                hasdata = SDL_TRUE;
-                const int val = (int) (((float) screenh) * e->dy);
-                //printf("Y FINGERMOTION: %d\n", val);
-                libevdev_uinput_write_event(uidev_mouse, EV_REL, REL_Y, val);
-            }
-            if (hasdata) {
-                libevdev_uinput_write_event(uidev_mouse, EV_SYN, SYN_REPORT, 0);
-            }
+    if (handle_redraw) {
+        handle_redraw();
     }
-    #endif
 }
 
-static void handle_fingerdown_keyboard(const SDL_TouchFingerEvent *e)
+static void redraw_window(void)
 {
-    if (fingers_down == 4) {
-        slide_out_keyboard();
-    } else {
-        const int x = (int) (((float) screenw) * e->x);
-        const int y = (int) (((float) screenh) * e->y);
-        const SDL_Point pt = { x, y };
-        int keyindex = -1;
+    render_window();
+    present_frame();
+}
+
+
+static void handle_fingerdown_keyboard(const SDL_TouchFingerEvent *e);
+static void handle_fingerup_keyboard(const SDL_TouchFingerEvent *e);
+static void handle_fingermotion_keyboard(const SDL_TouchFingerEvent *e);
+static void handle_redraw_keyboard(void);
+static void handle_fingerdown_mouse(const SDL_TouchFingerEvent *e);
+static void handle_fingerup_mouse(const SDL_TouchFingerEvent *e);
+static void handle_fingermotion_mouse(const SDL_TouchFingerEvent *e);
+static void send_mouse_button(const SDL_bool pressed);
+static void free_keyboard(void);
+static void update_keyboard_load(void);
+
+
+static void mem_count(const memowner owner, const int delta)
+{
+    SDL_AtomicAdd(&mem_used[owner], delta);
+    const int total = SDL_AtomicAdd(&mem_total, delta) + delta;
+    int peak;
+    while ((total > (peak = SDL_AtomicGet(&mem_peak))) && !SDL_AtomicCAS(&mem_peak, peak, total)) {
+        // try again.
+    }
+}
+
+// anything from here can be freed with SDL_free(), like any other SDL_malloc().
+static void *mem_alloc(const size_t len, const memowner owner)
+{
+    Uint8 *block = (len <= (((size_t) -1) - MEM_HEADER_LEN)) ? (Uint8 *) real_malloc(len + MEM_HEADER_LEN) : NULL;
+    if (!block) {
+        return NULL;
+    }
+    memheader *header = (memheader *) block;
+    header->len = len;
+    header->owner = owner;
+    mem_count(owner, (int) len);
+    return block + MEM_HEADER_LEN;
+}
+
+static void *SDLCALL mem_malloc(size_t len)
+{
+    return mem_alloc(len, MEM_OTHER);
+}
+
+static void *SDLCALL mem_calloc(size_t num, size_t size)
+{
+    if (size && (num > ((((size_t) -1) - MEM_HEADER_LEN) / size))) {
+        return NULL;
+    }
+    const size_t len = num * size;
+    Uint8 *block = (Uint8 *) real_calloc(1, len + MEM_HEADER_LEN);  // not malloc+memset, so big blocks can come straight from zeroed pages.
+    if (!block) {
+        return NULL;
+    }
+    memheader *header = (memheader *) block;
+    header->len = len;
+    header->owner = MEM_OTHER;
+    mem_count(MEM_OTHER, (int) len);
+    return block + MEM_HEADER_LEN;
+}
+
+static void *SDLCALL mem_realloc(void *ptr, size_t len)
+{
+    if (!ptr) {
+        return mem_malloc(len);
+    } else if (len > (((size_t) -1) - MEM_HEADER_LEN)) {
+        return NULL;
+    }
+    const memheader old = *((const memheader *) (((Uint8 *) ptr) - MEM_HEADER_LEN));
+    Uint8 *block = (Uint8 *) real_realloc(((Uint8 *) ptr) - MEM_HEADER_LEN, len + MEM_HEADER_LEN);
+    if (!block) {
+        return NULL;
+    }
+    ((memheader *) block)->len = len;  // it keeps its owner.
+    mem_count(old.owner, ((int) len) - ((int) old.len));
+    return block + MEM_HEADER_LEN;
+}
+
+static void SDLCALL mem_free(void *ptr)
+{
+    if (ptr) {
+        Uint8 *block = ((Uint8 *) ptr) - MEM_HEADER_LEN;
+        const memheader *header = (const memheader *) block;
+        mem_count(header->owner, -((int) header->len));
+        real_free(block);
+    }
+}
+
+// this has to happen before anything calls SDL_malloc, so it's the first thing main() does.
+static void init_memory_accounting(void)
+{
+    for (int i = 0; i < MEM_NUM_OWNERS; i++) {
+        SDL_AtomicSet(&mem_used[i], 0);
+    }
+    SDL_AtomicSet(&mem_total, 0);
+    SDL_AtomicSet(&mem_peak, 0);
+    SDL_GetMemoryFunctions(&real_malloc, &real_calloc, &real_realloc, &real_free);
+    SDL_SetMemoryFunctions(mem_malloc, mem_calloc, mem_realloc, mem_free);
+}
+
+static int texture_bytes(SDL_Texture *tex)
+{
+    int w = 0, h = 0;
+    return (tex && (SDL_QueryTexture(tex, NULL, NULL, &w, &h) == 0)) ? (w * h * 4) : 0;
+}
+
+static void report_memory(void)
+{
+    static const char *names[MEM_NUM_OWNERS] = { "other", "decode", "anim", "compositor", "keyboard", "textures", "texturepool" };
+    const float mb = 1024.0f * 1024.0f;
+    printf("Memory: %.1fMB in use, peak %.1fMB", ((float) SDL_AtomicGet(&mem_total)) / mb, ((float) SDL_AtomicGet(&mem_peak)) / mb);
+    if (mem_budget_mb) {
+        printf(", budget %uMB", (unsigned int) mem_budget_mb);
+    }
+    for (int i = 0; i < MEM_NUM_OWNERS; i++) {
+        printf("%s%s %.1fMB", i ? ", " : " (", names[i], ((float) SDL_AtomicGet(&mem_used[i])) / mb);
+    }
+    printf(")\n");
+    printf("Textures: %u reused from the pool, %u created\n", (unsigned int) texture_pool_reused, (unsigned int) texture_pool_created);
+}
+
+// percent of --membudget we're using, 0 if there isn't one.
+static int memory_budget_percent(void)
+{
+    if (!mem_budget_mb) {
+        return 0;
+    }
+    return (int) ((((Sint64) SDL_AtomicGet(&mem_total)) * 100) / (((Sint64) mem_budget_mb) * 1024 * 1024));
+}
+
+// percent of the time something was stalled waiting on memory (reclaim,
+//  swap, refaults), the kernel's 10 second average.
+static int memory_pressure_avg10(void)
+{
+    float avg10 = 0.0f;
+    FILE *io = memory_pressure_path ? fopen(memory_pressure_path, "r") : NULL;
+    if (io) {
+        if (fscanf(io, "some avg10=%f", &avg10) != 1) {
+            avg10 = 0.0f;
+        }
+        fclose(io);
+    }
+    return (int) avg10;
+}
+
+#if USE_POSIX
+static void memory_signal_handler(int sig)
+{
+    SDL_AtomicSet(&memory_report_requested, 1);  // the main thread does the actual work.
+}
+#endif
+
+static void *stbi_malloc_hook(size_t len)
+{
+    // only the main thread ever decodes into a texture; worker threads
+    //  decoding animation frames never look at any of this.
+    if (SDL_ThreadID() != main_thread_id) {
+        return mem_alloc(len, MEM_DECODE);
+    }
+
+    // stb_image's final output buffer is always w*h*4 bytes for the way we
+    //  call it (the JPEG loader asks for one extra byte that it never writes
+    //  to), so the first allocation of that size gets the texture memory. If
+    //  it turns out to be a scratch buffer instead, that's okay; we only hand
+    //  it out once, and copy the real result over it later.
+    if (stbi_target_pixels && !stbi_target_taken && ((len == stbi_target_len) || (len == (stbi_target_len + 1)))) {
+        stbi_target_taken = SDL_TRUE;
+        return stbi_target_pixels;
+    }
+    return mem_alloc(len, MEM_DECODE);
+}
+
+static void *stbi_realloc_hook(void *ptr, size_t len)
+{
+    if (ptr && (SDL_ThreadID() == main_thread_id) && (ptr == stbi_target_pixels)) {
+        void *retval = mem_alloc(len, MEM_DECODE);
+        if (retval) {
+            SDL_memcpy(retval, ptr, SDL_min(len, stbi_target_len));
+        }
+        return retval;
+    }
+    return SDL_realloc(ptr, len);
+}
+
+static void stbi_free_hook(void *ptr)
+{
+    if ((SDL_ThreadID() != main_thread_id) || (ptr != stbi_target_pixels)) {  // texture memory isn't ours to free.
+        SDL_free(ptr);
+    } else {
+        stbi_target_taken = SDL_FALSE;  // it's free to hand out again.
+    }
+}
+
+static void destroy_texture_pool(void)
+{
+    for (int i = 0; i < SDL_arraysize(texture_pool); i++) {
+        if (texture_pool[i].texture) {
+            mem_count(MEM_TEXTURE_POOL, -(texture_pool[i].w * texture_pool[i].h * 4));
+            SDL_DestroyTexture(texture_pool[i].texture);
+        }
+    }
+    SDL_zero(texture_pool);
+}
+
+static SDL_Texture *get_pooled_texture(const int access, const int w, const int h)
+{
+    SDL_Texture *retval = NULL;
+    for (int i = 0; i < SDL_arraysize(texture_pool); i++) {
+        pooledtexture *p = &texture_pool[i];
+        if (p->texture && (p->access == access) && (p->w == w) && (p->h == h)) {
+            retval = p->texture;
+            mem_count(MEM_TEXTURE_POOL, -(w * h * 4));
+            const int last = SDL_arraysize(texture_pool) - 1;
+            SDL_memmove(p, p + 1, sizeof (*p) * (last - i));  // keep it packed, oldest first.
+            SDL_zero(texture_pool[last]);
+            texture_pool_reused++;
+            break;
+        }
+    }
+
+    if (!retval) {
+        retval = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, access, w, h);
+        if (!retval) {
+            return NULL;
+        }
+        PROBE3(texture_create, w, h, access);
+        SDL_SetTextureBlendMode(retval, SDL_BLENDMODE_BLEND);
+        texture_pool_created++;
+    }
+
+    mem_count(MEM_TEXTURES, w * h * 4);
+    return retval;
+}
+
+// call this instead of SDL_DestroyTexture for textures load_image() made.
+static void release_texture(SDL_Texture *tex)
+{
+    Uint32 format = 0;
+    int access = 0;
+    int w = 0;
+    int h = 0;
+
+    if (!tex) {
+        return;
+    } else if ( (SDL_QueryTexture(tex, &format, &access, &w, &h) < 0) ||
+                (format != SDL_PIXELFORMAT_ABGR8888) || (access == SDL_TEXTUREACCESS_TARGET) ||
+                ((w * h * 4) > TEXTURE_POOL_MAX_BYTES) ) {
+        mem_count(MEM_TEXTURES, -(w * h * 4));
+        SDL_DestroyTexture(tex);
+        return;
+    }
+
+    mem_count(MEM_TEXTURES, -(w * h * 4));
+
+    // oldest entry is at the front; push things out until there's room.
+    const int last = SDL_arraysize(texture_pool) - 1;
+    while ( texture_pool[0].texture && (texture_pool[last].texture ||
+            ((SDL_AtomicGet(&mem_used[MEM_TEXTURE_POOL]) + (w * h * 4)) > TEXTURE_POOL_MAX_BYTES)) ) {
+        mem_count(MEM_TEXTURE_POOL, -(texture_pool[0].w * texture_pool[0].h * 4));
+        SDL_DestroyTexture(texture_pool[0].texture);
+        SDL_memmove(&texture_pool[0], &texture_pool[1], sizeof (texture_pool[0]) * last);
+        SDL_zero(texture_pool[last]);
+    }
+
+    for (int i = 0; i < SDL_arraysize(texture_pool); i++) {
+        pooledtexture *p = &texture_pool[i];
+        if (!p->texture) {
+            mem_count(MEM_TEXTURE_POOL, w * h * 4);
+            p->texture = tex;
+            p->access = access;
+            p->w = w;
+            p->h = h;
+            return;
+        }
+    }
+}
+
+static SDL_Texture *create_image_texture(const int w, const int h)
+{
+    const int access = use_streaming_textures ? SDL_TEXTUREACCESS_STREAMING : SDL_TEXTUREACCESS_STATIC;
+    return get_pooled_texture(access, w, h);
+}
+
+static void release_image_tiles(marqueeimage *img)
+{
+    for (int i = 0; i < img->numtiles; i++) {
+        SDL_Texture *tex = img->tiles[i].texture;
+        if (!img->preview) {
+            release_texture(tex);
+        } else if (tex) {
+            mem_count(MEM_TEXTURES, -texture_bytes(tex));
+            SDL_DestroyTexture(tex);
+        }
+        img->tiles[i].texture = NULL;
+    }
+    img->numtiles = 0;
+    img->preview = SDL_FALSE;
+}
+
+static void free_anim(marqueeanim *anim);
+static void abandon_refine(imagerefine *refine);
+
+static void free_image(marqueeimage *img)
+{
+    if (img) {
+        if (img->refine) {
+            abandon_refine(img->refine);
+        }
+
+        if (img->anim) {
+            free_anim(img->anim);  // this owns the textures.
+        } else {
+            release_image_tiles(img);
+        }
+        SDL_free(img);
+    }
+}
+
+static void draw_image(const marqueeimage *img, const Uint8 alpha)
+{
+    SDL_RenderSetLogicalSize(renderer, img->w, img->h);
+    for (int i = 0; i < img->numtiles; i++) {
+        SDL_Texture *tex = img->tiles[i].texture;
+        SDL_SetTextureAlphaMod(tex, alpha);
+        SDL_RenderCopy(renderer, tex, NULL, &img->tiles[i].rect);
+    }
+}
+
+// Box-filter an image down to half size. Returns a new buffer, w*4 pitch.
+static Uint8 *halve_pixels(const Uint8 *src, const int w, const int h, const int pitch, int *_w, int *_h)
+{
+    const int neww = SDL_max(w / 2, 1);
+    const int newh = SDL_max(h / 2, 1);
+    Uint8 *retval = (Uint8 *) mem_alloc(neww * newh * 4, MEM_DECODE);
+    if (!retval) {
+        return NULL;
+    }
+
+    Uint8 *dst = retval;
+    for (int y = 0; y < newh; y++) {
+        const Uint8 *row1 = src + (SDL_min(y * 2, h - 1) * pitch);
+        const Uint8 *row2 = src + (SDL_min((y * 2) + 1, h - 1) * pitch);
+        for (int x = 0; x < neww; x++) {
+            const int x1 = SDL_min(x * 2, w - 1) * 4;
+            const int x2 = SDL_min((x * 2) + 1, w - 1) * 4;
+            for (int i = 0; i < 4; i++) {
+                *(dst++) = (Uint8) ((row1[x1+i] + row1[x2+i] + row2[x1+i] + row2[x2+i] + 2) / 4);
+            }
+        }
+    }
+
+    *_w = neww;
+    *_h = newh;
+    return retval;
+}
+
+// Bilinear resample to an exact size. This is only good for less than a 2x
+//  reduction; halve_pixels() does the rest. Returns a new buffer, w*4 pitch.
+static Uint8 *scale_pixels(const Uint8 *src, const int w, const int h, const int pitch, const int neww, const int newh)
+{
+    Uint8 *retval = (Uint8 *) mem_alloc(((size_t) neww) * ((size_t) newh) * 4, MEM_DECODE);
+    if (!retval) {
+        return NULL;
+    }
+
+    const Sint64 stepx = (((Sint64) w) << 16) / neww;  // 16.16 fixed point.
+    const Sint64 stepy = (((Sint64) h) << 16) / newh;
+    Uint8 *dst = retval;
+    for (int y = 0; y < newh; y++) {
+        const Sint64 fy = SDL_max(((y * stepy) + (stepy / 2)) - 32768, 0);  // sample at pixel centers.
+        const int y1 = SDL_min((int) (fy >> 16), h - 1);
+        const int y2 = SDL_min(y1 + 1, h - 1);
+        const int fracy = (int) ((fy >> 8) & 0xFF);
+        const Uint8 *row1 = src + (y1 * pitch);
+        const Uint8 *row2 = src + (y2 * pitch);
+        for (int x = 0; x < neww; x++) {
+            const Sint64 fx = SDL_max(((x * stepx) + (stepx / 2)) - 32768, 0);
+            const int x1 = SDL_min((int) (fx >> 16), w - 1) * 4;
+            const int x2 = SDL_min((int) (fx >> 16) + 1, w - 1) * 4;
+            const int fracx = (int) ((fx >> 8) & 0xFF);
+            for (int i = 0; i < 4; i++) {
+                const int top = (row1[x1+i] * (256 - fracx)) + (row1[x2+i] * fracx);
+                const int bottom = (row2[x1+i] * (256 - fracx)) + (row2[x2+i] * fracx);
+                *(dst++) = (Uint8) (((top * (256 - fracy)) + (bottom * fracy)) >> 16);
+            }
+        }
+    }
+    return retval;
+}
+
+// The size an image actually covers on the panel once it's letterboxed.
+//  Returns SDL_FALSE if that's not smaller than the image itself.
+static SDL_bool panel_fit_size(const int w, const int h, int *_fitw, int *_fith)
+{
+    if (!prescale_images || !panelw || !panelh) {
+        return SDL_FALSE;
+    }
+
+    int fitw, fith;
+    if ((((Sint64) w) * panelh) > (((Sint64) h) * panelw)) {  // wider than the panel.
+        fitw = panelw;
+        fith = SDL_max((int) ((((Sint64) h) * panelw) / w), 1);
+    } else {
+        fitw = SDL_max((int) ((((Sint64) w) * panelh) / h), 1);
+        fith = panelh;
+    }
+
+    if ((fitw >= w) || (fith >= h)) {
+        return SDL_FALSE;  // we don't scale up; the GPU does that for free.
+    }
+
+    *_fitw = fitw;
+    *_fith = fith;
+    return SDL_TRUE;
+}
+
+// Upload decoded pixels, split into a grid of textures if the image is
+//  bigger than the GPU can handle in one piece (the Pi's limit is 2048x2048).
+static marqueeimage *image_from_pixels(const char *fname, const Uint8 *pixels, const int w, const int h, const int pitch)
+{
+    Uint8 *scaled = NULL;
+    const Uint8 *src = pixels;
+    int srcw = w;
+    int srch = h;
+    int srcpitch = pitch;
+
+    // anything bigger than the panel gets scaled down to exactly what it'll
+    //  cover there: the GPU samples less every frame, and marquees mostly
+    //  share an aspect ratio, so they end up the same size and their
+    //  textures get reused from the pool.
+    int fitw, fith;
+    if (panel_fit_size(w, h, &fitw, &fith)) {
+        const Uint64 trace_start = trace_begin();
+        while ((srcw >= (fitw * 2)) && (srch >= (fith * 2))) {
+            Uint8 *halved = halve_pixels(src, srcw, srch, srcpitch, &srcw, &srch);
+            SDL_free(scaled);
+            scaled = halved;
+            if (!halved) {
+                fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
+                return NULL;
+            }
+            src = halved;
+            srcpitch = srcw * 4;
+        }
+
+        if ((srcw != fitw) || (srch != fith)) {
+            Uint8 *resampled = scale_pixels(src, srcw, srch, srcpitch, fitw, fith);
+            SDL_free(scaled);
+            scaled = resampled;
+            if (!resampled) {
+                fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
+                return NULL;
+            }
+            src = resampled;
+            srcw = fitw;
+            srch = fith;
+            srcpitch = srcw * 4;
+        }
+        trace_end("prescale", trace_start);
+    }
+
+    // absurdly large images get scaled down until the tiles fit in the grid.
+    while ( (max_texture_w && (srcw > (max_texture_w * MAX_IMAGE_TILES_PER_AXIS))) ||
+            (max_texture_h && (srch > (max_texture_h * MAX_IMAGE_TILES_PER_AXIS))) ) {
+        Uint8 *halved = halve_pixels(src, srcw, srch, srcpitch, &srcw, &srch);
+        SDL_free(scaled);
+        scaled = halved;
+        if (!halved) {
+            fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
+            return NULL;
+        }
+        src = halved;
+        srcpitch = srcw * 4;
+    }
+
+    const int tilew = max_texture_w ? SDL_min(srcw, max_texture_w) : srcw;
+    const int tileh = max_texture_h ? SDL_min(srch, max_texture_h) : srch;
+    const int tilesx = (srcw + (tilew - 1)) / tilew;
+    const int tilesy = (srch + (tileh - 1)) / tileh;
+
+    marqueeimage *retval = (marqueeimage *) SDL_calloc(1, sizeof (marqueeimage));
+    if (!retval) {
+        fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
+        SDL_free(scaled);
+        return NULL;
+    }
+
+    // logically, this is still the original size; it just draws scaled.
+    retval->w = w;
+    retval->h = h;
+
+    const float scalex = ((float) w) / ((float) srcw);
+    const float scaley = ((float) h) / ((float) srch);
+    for (int ty = 0; ty < tilesy; ty++) {
+        for (int tx = 0; tx < tilesx; tx++) {
+            const SDL_Rect srcrect = { tx * tilew, ty * tileh, SDL_min(tilew, srcw - (tx * tilew)), SDL_min(tileh, srch - (ty * tileh)) };
+            imagetile *tile = &retval->tiles[retval->numtiles];
+            tile->texture = create_image_texture(srcrect.w, srcrect.h);
+            if (!tile->texture) {
+                fprintf(stderr, "WARNING: couldn't create texture for \"%s\"\n", fname);
+                free_image(retval);
+                SDL_free(scaled);
+                return NULL;
+            }
+            retval->numtiles++;
+
+            const int x1 = (int) (((float) srcrect.x) * scalex);
+            const int y1 = (int) (((float) srcrect.y) * scaley);
+            const int x2 = (int) (((float) (srcrect.x + srcrect.w)) * scalex);
+            const int y2 = (int) (((float) (srcrect.y + srcrect.h)) * scaley);
+            tile->rect.x = x1;
+            tile->rect.y = y1;
+            tile->rect.w = x2 - x1;
+            tile->rect.h = y2 - y1;
+            const Uint64 trace_start = trace_begin();
+            SDL_UpdateTexture(tile->texture, NULL, src + (srcrect.y * srcpitch) + (srcrect.x * 4), srcpitch);
+            trace_end("SDL_UpdateTexture", trace_start);
+            PROBE3(texture_upload, srcrect.w, srcrect.h, srcrect.w * srcrect.h * 4);
+        }
+    }
+
+    SDL_free(scaled);
+    return retval;
+}
+
+static marqueeimage *image_from_texture(SDL_Texture *tex, const int w, const int h)
+{
+    marqueeimage *retval = (marqueeimage *) SDL_calloc(1, sizeof (marqueeimage));
+    if (!retval) {
+        release_texture(tex);
+        return NULL;
+    }
+    retval->w = w;
+    retval->h = h;
+    retval->numtiles = 1;
+    retval->tiles[0].texture = tex;
+    retval->tiles[0].rect.w = w;
+    retval->tiles[0].rect.h = h;
+    return retval;
+}
+
+// Makes an image draw at a different logical size, scaling its tile rects to
+//  match, since an SVG's raster might not be the size of the SVG itself.
+static void set_image_logical_size(marqueeimage *img, const int w, const int h)
+{
+    for (int i = 0; i < img->numtiles; i++) {
+        SDL_Rect *r = &img->tiles[i].rect;
+        const int x1 = (int) ((((Sint64) r->x) * w) / img->w);
+        const int y1 = (int) ((((Sint64) r->y) * h) / img->h);
+        const int x2 = (int) ((((Sint64) (r->x + r->w)) * w) / img->w);
+        const int y2 = (int) ((((Sint64) (r->y + r->h)) * h) / img->h);
+        r->x = x1;
+        r->y = y1;
+        r->w = x2 - x1;
+        r->h = y2 - y1;
+    }
+    img->w = w;
+    img->h = h;
+}
+
+static SDL_bool fits_in_one_texture(const int w, const int h)
+{
+    return ((!max_texture_w || (w <= max_texture_w)) && (!max_texture_h || (h <= max_texture_h))) ? SDL_TRUE : SDL_FALSE;
+}
+
+static Uint32 read_be32(const Uint8 *ptr)
+{
+    return (((Uint32) ptr[0]) << 24) | (((Uint32) ptr[1]) << 16) | (((Uint32) ptr[2]) << 8) | ((Uint32) ptr[3]);
+}
+
+static Uint16 read_be16(const Uint8 *ptr)
+{
+    return (Uint16) ((((Uint16) ptr[0]) << 8) | ((Uint16) ptr[1]));
+}
+
+static void write_be32(Uint8 *ptr, const Uint32 val)
+{
+    ptr[0] = (Uint8) ((val >> 24) & 0xFF);
+    ptr[1] = (Uint8) ((val >> 16) & 0xFF);
+    ptr[2] = (Uint8) ((val >> 8) & 0xFF);
+    ptr[3] = (Uint8) (val & 0xFF);
+}
+
+// call at the start of every thread that decodes; the main thread keeps its
+//  priority, since it has a screen to draw (and without CAP_SYS_NICE, it
+//  couldn't get it back afterwards).
+static void set_decode_thread_policy(void)
+{
+    #if USE_POSIX
+    if (SDL_ThreadID() == main_thread_id) {
+        return;
+    }
+
+    const pid_t tid = (pid_t) syscall(SYS_gettid);
+    if (decode_nice == DECODE_NICE_IDLE) {
+        struct sched_param param;
+        SDL_zero(param);
+        sched_setscheduler(tid, SCHED_IDLE, &param);  // we don't care if this fails.
+    } else {
+        setpriority(PRIO_PROCESS, tid, decode_nice);
+    }
+
+    if (CPU_COUNT(&decode_cpus) > 0) {
+        sched_setaffinity(tid, sizeof (decode_cpus), &decode_cpus);
+    }
+    #endif
+}
+
+// "2,3" or "1-3", like taskset.
+static void parse_decode_cpus(const char *str)
+{
+    #if USE_POSIX
+    CPU_ZERO(&decode_cpus);
+    while (*str) {
+        char *end = NULL;
+        const long first = SDL_strtol(str, &end, 10);
+        long last = first;
+        if (end == str) {
+            break;
+        } else if (*end == '-') {
+            str = end + 1;
+            last = SDL_strtol(str, &end, 10);
+        }
+        for (long i = first; (i >= 0) && (i <= last) && (i < CPU_SETSIZE); i++) {
+            CPU_SET((int) i, &decode_cpus);
+        }
+        str = (*end == ',') ? (end + 1) : end;
+    }
+    #else
+    fprintf(stderr, "WARNING: --decodecpus isn't supported on this platform\n");
+    #endif
+}
+
+// Percent of the time something was waiting for a CPU, from Linux's pressure
+//  stall information. Whoever asks first after a while rereads it; everyone
+//  else gets the last value.
+static int sample_cpu_pressure(void)
+{
+    if (!SDL_AtomicTryLock(&cpu_pressure_lock)) {
+        return SDL_AtomicGet(&cpu_pressure);
+    }
+
+    const Uint32 now = SDL_GetTicks();
+    if (!cpu_pressure_unavailable && (!cpu_pressure_ticks || SDL_TICKS_PASSED(now, cpu_pressure_ticks + CPU_PRESSURE_SAMPLE_MS))) {
+        FILE *io = fopen(cpu_pressure_path, "r");
+        float avg10 = 0.0f;
+        unsigned long long total = 0;
+        if (!io || (fscanf(io, "some avg10=%f avg60=%*f avg300=%*f total=%llu", &avg10, &total) != 2)) {
+            cpu_pressure_unavailable = SDL_TRUE;  // old kernel, or booted with psi=0. Never back off.
+            SDL_AtomicSet(&cpu_pressure, 0);
+            SDL_AtomicSet(&cpu_pressure_avg10, 0);
+        } else {
+            SDL_AtomicSet(&cpu_pressure_avg10, (int) avg10);
+            if (!cpu_pressure_ticks) {
+                SDL_AtomicSet(&cpu_pressure, (int) avg10);  // nothing to compare against yet.
+            } else {
+                const Uint64 elapsedus = ((Uint64) (now - cpu_pressure_ticks)) * 1000;
+                SDL_AtomicSet(&cpu_pressure, (int) (((((Uint64) total) - cpu_pressure_total) * 100) / SDL_max(elapsedus, 1)));
+            }
+        }
+        if (io) {
+            fclose(io);
+        }
+        cpu_pressure_ticks = now;
+        cpu_pressure_total = (Uint64) total;
+    }
+
+    SDL_AtomicUnlock(&cpu_pressure_lock);
+    return SDL_AtomicGet(&cpu_pressure);
+}
+
+// Long decodes call this between chunks of work, so they pause while
+//  something else (hopefully the emulator) wants the CPU.
+static void decode_backoff(void)
+{
+    if (!decode_pressure_limit || (SDL_ThreadID() == main_thread_id)) {
+        return;
+    }
+
+    for (Uint32 waited = 0; waited < MAX_DECODE_BACKOFF_MS; waited += DECODE_BACKOFF_STEP_MS) {
+        if (sample_cpu_pressure() < decode_pressure_limit) {
+            return;
+        }
+        SDL_Delay(DECODE_BACKOFF_STEP_MS);
+    }
+}
+
+static qualitylevel quality_for(const int value, const int reduced, const int minimal, const int hysteresis)
+{
+    // stay degraded until we're comfortably under the line that got us there.
+    if (value >= (minimal - ((quality >= QUALITY_MINIMAL) ? hysteresis : 0))) {
+        return QUALITY_MINIMAL;
+    } else if (value >= (reduced - ((quality >= QUALITY_REDUCED) ? hysteresis : 0))) {
+        return QUALITY_REDUCED;
+    }
+    return QUALITY_FULL;
+}
+
+// main thread only. Rereads the sensors at most once a second.
+static void update_quality(void)
+{
+    const Uint32 now = SDL_GetTicks();
+    if (quality_ticks && !SDL_TICKS_PASSED(now, quality_ticks + QUALITY_CHECK_MS)) {
+        return;
+    }
+    quality_ticks = now;
+
+    int millidegrees = 0;
+    FILE *io = thermal_path ? fopen(thermal_path, "r") : NULL;
+    if (io) {
+        if (fscanf(io, "%d", &millidegrees) != 1) {
+            millidegrees = 0;
+        }
+        fclose(io);
+    }
+
+    sample_cpu_pressure();
+    const int pressure = SDL_AtomicGet(&cpu_pressure_avg10);
+    const int budget = memory_budget_percent();
+    const int memstalls = memory_pressure_avg10();
+
+    const qualitylevel thermal = quality_for(millidegrees, THERMAL_REDUCED_MC, THERMAL_MINIMAL_MC, THERMAL_HYSTERESIS_MC);
+    const qualitylevel load = quality_for(pressure, PRESSURE_REDUCED, PRESSURE_MINIMAL, PRESSURE_HYSTERESIS);
+    const qualitylevel memory = SDL_max(quality_for(budget, MEM_BUDGET_REDUCED, MEM_BUDGET_MINIMAL, MEM_BUDGET_HYSTERESIS),
+                                        quality_for(memstalls, MEM_PRESSURE_REDUCED, MEM_PRESSURE_MINIMAL, MEM_PRESSURE_HYSTERESIS));
+    const qualitylevel newquality = SDL_max(SDL_max(thermal, load), memory);
+    if (newquality != quality) {
+        static const char *names[] = { "full", "reduced", "minimal" };
+        printf("Quality: %s (%.1fC, CPU pressure %d%%, memory %d%% of budget, memory pressure %d%%)\n", names[newquality], ((float) millidegrees) / 1000.0f, pressure, budget, memstalls);
+        quality = newquality;
+    }
+}
+
+// Baseline JPEGs with restart markers (DRI) can be cut into horizontal
+//  strips at restart boundaries that line up with the start of an MCU row.
+//  Each strip becomes a standalone JPEG (the original headers with the height
+//  patched, plus that strip's slice of the entropy-coded data) that stb_image
+//  decodes on its own thread, Huffman, IDCT, color conversion and all.
+//  Strips decode an extra band of rows above and below that gets thrown
+//  away, so chroma upsampling at the seams matches a serial decode exactly.
+#define MAX_JPEG_THREADS 4
+#define MIN_PARALLEL_JPEG_PIXELS (512 * 1024)
+
+typedef struct
+{
+    const Uint8 *jpg;
+    size_t headerlen;    // everything up to the end of the SOS segment.
+    size_t sofheightpos;  // where the SOF segment's height field is.
+    const size_t *intervals;  // offset where each restart interval starts, plus one past the end of the last.
+    int w;
+    int h;
+    int mcuh;
+    int mcus_per_row;
+    Uint32 restart_interval;
+    Uint8 *output;  // final w*h*4 pixels.
+} jpegjob;
+
+typedef struct
+{
+    const jpegjob *job;
+    int decode_row;  // first MCU row to decode.
+    int decode_rows;
+    int first_row;   // first pixel row to keep.
+    int num_rows;
+    SDL_bool okay;
+} jpegstrip;
+
+static int SDLCALL decode_jpeg_strip(void *data)
+{
+    jpegstrip *strip = (jpegstrip *) data;
+    set_decode_thread_policy();
+    decode_backoff();
+    const jpegjob *job = strip->job;
+    const int top = strip->decode_row * job->mcuh;
+    const int striph = SDL_min(job->h - top, strip->decode_rows * job->mcuh);
+    const size_t start = job->intervals[(((size_t) strip->decode_row) * job->mcus_per_row) / job->restart_interval];
+    const size_t endmcu = ((size_t) (strip->decode_row + strip->decode_rows)) * job->mcus_per_row;
+    const size_t endinterval = (endmcu + (job->restart_interval - 1)) / job->restart_interval;
+    size_t end = job->intervals[endinterval];
+    if ((job->jpg[end - 2] == 0xFF) && (job->jpg[end - 1] >= 0xD0) && (job->jpg[end - 1] <= 0xD7)) {
+        end -= 2;  // drop the restart marker between us and the next strip.
+    }
+
+    const size_t entropylen = end - start;
+    const size_t len = job->headerlen + entropylen + 2;
+    Uint8 *jpg = (Uint8 *) mem_alloc(len, MEM_DECODE);
+    if (!jpg) {
+        return 0;
+    }
+
+    SDL_memcpy(jpg, job->jpg, job->headerlen);
+    jpg[job->sofheightpos] = (Uint8) ((striph >> 8) & 0xFF);
+    jpg[job->sofheightpos + 1] = (Uint8) (striph & 0xFF);
+    SDL_memcpy(jpg + job->headerlen, job->jpg + start, entropylen);
+    jpg[len - 2] = 0xFF;  // EOI
+    jpg[len - 1] = 0xD9;
+
+    int w, h, n;
+    const Uint64 trace_start = trace_begin();
+    stbi_uc *img = stbi_load_from_memory(jpg, (int) len, &w, &h, &n, 4);
+    trace_end("decode_jpeg_strip", trace_start);
+    SDL_free(jpg);
+
+    if (img && (w == job->w) && (h == striph)) {
+        const size_t rowlen = ((size_t) w) * 4;
+        SDL_memcpy(job->output + (((size_t) strip->first_row) * rowlen), img + (((size_t) (strip->first_row - top)) * rowlen), rowlen * strip->num_rows);
+        strip->okay = SDL_TRUE;
+    }
+
+    stbi_image_free(img);
+    return 0;
+}
+
+static int gcd(int a, int b)
+{
+    while (b) {
+        const int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Returns NULL if this isn't a JPEG we can split up; decode it serially then.
+static stbi_uc *load_jpeg_parallel(const Uint8 *jpg, const size_t len, int *_w, int *_h)
+{
+    int numthreads = SDL_min(SDL_GetCPUCount(), MAX_JPEG_THREADS);
+    if ((numthreads < 2) || (len < 4) || (jpg[0] != 0xFF) || (jpg[1] != 0xD8)) {
+        return NULL;
+    }
+
+    jpegjob job;
+    SDL_zero(job);
+    job.jpg = jpg;
+
+    int hmax = 1, vmax = 1;
+    int numcomponents = 0;
+    size_t pos = 2;
+    while (!job.headerlen) {
+        if (((pos + 4) > len) || (jpg[pos] != 0xFF)) {
+            return NULL;
+        }
+
+        const Uint8 marker = jpg[pos + 1];
+        if (marker == 0xFF) {  // fill byte
+            pos++;
+            continue;
+        }
+
+        const size_t seglen = read_be16(jpg + pos + 2);
+        const Uint8 *seg = jpg + pos + 4;
+        if ((seglen < 2) || ((pos + 2 + seglen) > len)) {
+            return NULL;
+        }
+
+        if ((marker == 0xC0) || (marker == 0xC1)) {  // SOF0/SOF1: baseline or extended sequential Huffman.
+            if (seglen < 8) {
+                return NULL;
+            }
+            job.sofheightpos = pos + 5;
+            job.h = read_be16(seg + 1);
+            job.w = read_be16(seg + 3);
+            numcomponents = seg[5];
+            if ((numcomponents < 1) || (seglen < (8 + (3 * (size_t) numcomponents)))) {
+                return NULL;
+            }
+            for (int i = 0; i < numcomponents; i++) {
+                hmax = SDL_max(hmax, seg[7 + (i * 3)] >> 4);
+                vmax = SDL_max(vmax, seg[7 + (i * 3)] & 0xF);
+            }
+        } else if ((marker >= 0xC2) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xCC)) {
+            return NULL;  // progressive, lossless, arithmetic coded, etc.
+        } else if (marker == 0xDD) {  // DRI
+            if (seglen < 4) {
+                return NULL;
+            }
+            job.restart_interval = read_be16(seg);
+        } else if (marker == 0xDA) {  // SOS
+            if (!job.sofheightpos || (seg[0] != numcomponents)) {
+                return NULL;  // need one scan with every component interleaved.
+            }
+            job.headerlen = pos + 2 + seglen;
+        } else if ((marker == 0xD9) || ((marker >= 0xD0) && (marker <= 0xD8))) {
+            return NULL;
+        }
+        pos += 2 + seglen;
+    }
+
+    if (!job.restart_interval || !job.w || !job.h || (((Sint64) job.w) * ((Sint64) job.h) < MIN_PARALLEL_JPEG_PIXELS)) {
+        return NULL;
+    }
+
+    // stb_image decodes a single-component scan in 8x8 blocks, whatever the sampling factors say.
+    const int mcuw = (numcomponents == 1) ? 8 : (hmax * 8);
+    job.mcuh = (numcomponents == 1) ? 8 : (vmax * 8);
+    job.mcus_per_row = (job.w + (mcuw - 1)) / mcuw;
+    const int mcu_rows = (job.h + (job.mcuh - 1)) / job.mcuh;
+    const size_t total_mcus = ((size_t) job.mcus_per_row) * mcu_rows;
+    const size_t numintervals = (total_mcus + (job.restart_interval - 1)) / job.restart_interval;
+
+    // strips have to start on an MCU row that's also the start of a restart interval.
+    const int rows_per_unit = (int) (job.restart_interval / gcd((int) job.restart_interval, job.mcus_per_row));
+    const int units = mcu_rows / rows_per_unit;
+    numthreads = SDL_min(numthreads, units / 2);  // each strip should be at least twice its overlap.
+    if (numthreads < 2) {
+        return NULL;
+    }
+
+    // find every restart marker; the entropy-coded data can't contain 0xFF
+    //  followed by anything but a zero byte or a marker.
+    size_t *intervals = (size_t *) SDL_malloc(sizeof (size_t) * (numintervals + 1));
+    if (!intervals) {
+        return NULL;
+    }
+
+    size_t found = 0;
+    intervals[found++] = job.headerlen;
+    for (pos = job.headerlen; (pos + 1) < len; pos++) {
+        if (jpg[pos] != 0xFF) {
+            continue;
+        }
+        const Uint8 marker = jpg[pos + 1];
+        if ((marker >= 0xD0) && (marker <= 0xD7)) {
+            if (found == numintervals) {
+                break;  // more restart markers than MCUs to go with them?!
+            }
+            intervals[found++] = pos + 2;
+            pos++;
+        } else if ((marker != 0x00) && (marker != 0xFF)) {
+            break;  // EOI (or another scan, which we'll catch below).
+        }
+    }
+
+    if ((found != numintervals) || ((pos + 1) >= len) || (jpg[pos + 1] != 0xD9)) {
+        SDL_free(intervals);
+        return NULL;
+    }
+    intervals[numintervals] = pos;
+    job.intervals = intervals;
+
+    const size_t outputlen = ((size_t) job.w) * ((size_t) job.h) * 4;
+    job.output = (Uint8 *) STBI_MALLOC(outputlen);  // on the main thread, this might be texture memory.
+    if (!job.output) {
+        SDL_free(intervals);
+        return NULL;
+    }
+
+    jpegstrip strips[MAX_JPEG_THREADS];
+    SDL_Thread *threads[MAX_JPEG_THREADS];
+    SDL_zero(strips);
+    SDL_zero(threads);
+
+    for (int i = 0; i < numthreads; i++) {
+        jpegstrip *strip = &strips[i];
+        const int row = (units * i / numthreads) * rows_per_unit;
+        const int endrow = (i == (numthreads - 1)) ? mcu_rows : ((units * (i + 1) / numthreads) * rows_per_unit);
+        strip->job = &job;
+        strip->decode_row = (i > 0) ? (row - rows_per_unit) : row;
+        strip->decode_rows = SDL_min(mcu_rows, endrow + rows_per_unit) - strip->decode_row;
+        strip->first_row = row * job.mcuh;
+        strip->num_rows = SDL_min(job.h, endrow * job.mcuh) - strip->first_row;
+        if (i > 0) {  // this thread takes the first strip.
+            threads[i] = SDL_CreateThread(decode_jpeg_strip, "jpeg", strip);
+        }
+    }
+
+    decode_jpeg_strip(&strips[0]);
+
+    SDL_bool okay = strips[0].okay;
+    for (int i = 1; i < numthreads; i++) {
+        if (threads[i]) {
+            SDL_WaitThread(threads[i], NULL);
+        } else {
+            decode_jpeg_strip(&strips[i]);  // couldn't start a thread? Do it here.
+        }
+        okay = okay && strips[i].okay;
+    }
+
+    SDL_free(intervals);
+
+    if (!okay) {
+        STBI_FREE(job.output);
+        return NULL;
+    }
+
+    *_w = job.w;
+    *_h = job.h;
+    return job.output;
+}
+
+// Image files get mmap()'d instead of read into a buffer, so decoders read
+//  straight out of the page cache: no copy, and no stream of tiny reads off
+//  the SD card. The mapping is private and writable, so an in-place parser
+//  (nanosvg) only copies the pages it actually touches. Like SDL_LoadFile(),
+//  the data is always followed by a null terminator; here that's the zeroed
+//  tail of the last page, so files that exactly fill their last page, and
+//  things that can't be mapped at all, just get loaded the usual way.
+//  Replace files with a rename, not by rewriting them in place, while
+//  they're up; a mapped file that gets truncated out from under us crashes.
+#define MAX_WILLNEED_BYTES (64 * 1024 * 1024)
+
+static Uint8 *map_file(const char *fname, size_t *_len, SDL_bool *_mapped)
+{
+    const Uint64 trace_start = trace_begin();
+    *_mapped = SDL_FALSE;
+
+    #if USE_POSIX
+    const int fd = open(fname, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        const long pagesize = sysconf(_SC_PAGESIZE);
+        struct stat statbuf;
+        void *ptr = MAP_FAILED;
+        if ((fstat(fd, &statbuf) == 0) && S_ISREG(statbuf.st_mode) && (statbuf.st_size > 0) && ((Uint64) statbuf.st_size < SIZE_MAX) && (pagesize > 0) && ((statbuf.st_size % pagesize) != 0)) {
+            ptr = mmap(NULL, (size_t) statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);  // the mapping holds its own reference.
+
+        if (ptr != MAP_FAILED) {
+            const size_t len = (size_t) statbuf.st_size;
+            madvise(ptr, len, MADV_SEQUENTIAL);
+            if (len <= MAX_WILLNEED_BYTES) {  // big videos page in as they play instead.
+                madvise(ptr, len, MADV_WILLNEED);
+            }
+            *_len = len;
+            *_mapped = SDL_TRUE;
+            trace_end("map_file", trace_start);
+            return (Uint8 *) ptr;
+        }
+    }
+    #endif
+
+    Uint8 *retval = (Uint8 *) SDL_LoadFile(fname, _len);
+    trace_end("SDL_LoadFile", trace_start);
+    return retval;
+}
+
+static void unmap_file(Uint8 *data, const size_t len, const SDL_bool mapped)
+{
+    #if USE_POSIX
+    if (mapped) {
+        munmap(data, len);
+        return;
+    }
+    #endif
+    SDL_free(data);
+}
+
+// stbi_load_from_memory(), but big JPEGs with restart markers get decoded across cores.
+static stbi_uc *decode_image_pixels(const Uint8 *buf, const size_t len, int *_w, int *_h)
+{
+    const Uint64 trace_start = trace_begin();
+    stbi_uc *retval = load_jpeg_parallel(buf, len, _w, _h);
+    if (!retval) {
+        int n;
+        retval = stbi_load_from_memory(buf, (int) len, _w, _h, &n, 4);
+    }
+    trace_end("decode_image_pixels", trace_start);
+    return retval;
+}
+
+static stbi_uc *load_image_pixels(const char *fname, int *_w, int *_h)
+{
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &len, &mapped);
+    if (!buf) {
+        return NULL;
+    }
+
+    stbi_uc *retval = decode_image_pixels(buf, len, _w, _h);
+    unmap_file(buf, len, mapped);
+    return retval;
+}
+
+static marqueeimage *load_stbi_image(const char *fname)
+{
+    marqueeimage *retval = NULL;
+    int w, h;
+    stbi_uc *img = load_image_pixels(fname, &w, &h);
+    if (!img) {
+        fprintf(stderr, "WARNING: couldn't load image \"%s\"\n", fname);
+    } else {
+        retval = image_from_pixels(fname, img, w, h, w * 4);
+        stbi_image_free(img);
+    }
+    return retval;
+}
+
+// Decode directly into a locked streaming texture. This saves the separate
+//  decode buffer and the SDL_UpdateTexture copy from it.
+static marqueeimage *load_image_streaming(const char *fname)
+{
+    SDL_Texture *newtex = NULL;
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &len, &mapped);
+    int w, h, n, fitw, fith;
+
+    if (!buf || !stbi_info_from_memory(buf, (int) len, &w, &h, &n)) {
+        fprintf(stderr, "WARNING: couldn't load image \"%s\"\n", fname);
+        if (buf) {
+            unmap_file(buf, len, mapped);
+        }
+        return NULL;
+    } else if (!fits_in_one_texture(w, h)) {
+        unmap_file(buf, len, mapped);
+        return load_stbi_image(fname);  // has to be tiled, do it the usual way.
+    } else if (panel_fit_size(w, h, &fitw, &fith)) {
+        unmap_file(buf, len, mapped);
+        return load_stbi_image(fname);  // has to be scaled down first, do it the usual way.
+    }
+
+    newtex = get_pooled_texture(SDL_TEXTUREACCESS_STREAMING, w, h);
+    if (!newtex) {
+        fprintf(stderr, "WARNING: couldn't create texture for \"%s\"\n", fname);
+        unmap_file(buf, len, mapped);
+        return NULL;
+    }
+
+    void *pixels = NULL;
+    int pitch = 0;
+    if (SDL_LockTexture(newtex, NULL, &pixels, &pitch) < 0) {
+        fprintf(stderr, "WARNING: couldn't lock texture for \"%s\"\n", fname);
+        unmap_file(buf, len, mapped);
+        release_texture(newtex);
+        return NULL;
+    }
+
+    if (pitch == (w * 4)) {  // can only hand it to stb_image if there's no row padding.
+        stbi_target_pixels = pixels;
+        stbi_target_len = ((size_t) w) * ((size_t) h) * 4;
+        stbi_target_taken = SDL_FALSE;
+    }
+
+    stbi_uc *img = decode_image_pixels(buf, len, &w, &h);
+    unmap_file(buf, len, mapped);
+
+    if (!img) {
+        fprintf(stderr, "WARNING: couldn't load image \"%s\"\n", fname);
+    } else if (img != pixels) {  // didn't decode in place, copy it over.
+        const int rowlen = w * 4;
+        const Uint8 *src = img;
+        Uint8 *dst = (Uint8 *) pixels;
+        for (int y = 0; y < h; y++, src += rowlen, dst += pitch) {
+            SDL_memcpy(dst, src, rowlen);
+        }
+    }
+
+    stbi_target_pixels = NULL;
+    stbi_target_len = 0;
+    stbi_target_taken = SDL_FALSE;
+
+    if (img != pixels) {
+        stbi_image_free(img);
+    }
+
+    SDL_UnlockTexture(newtex);
+
+    if (!img) {
+        release_texture(newtex);
+        return NULL;
+    }
+
+    PROBE3(texture_upload, w, h, w * h * 4);
+    return image_from_texture(newtex, w, h);
+}
+
+#define MIN_PREVIEW_PIXELS (1024 * 1024)
+#define SVG_PREVIEW_SCALE 0.125f
+
+static void free_refine(imagerefine *refine)
+{
+    if (refine->svg) {
+        nsvgDelete(refine->svg);
+    }
+    SDL_free(refine->pixels);  // stb_image allocates with SDL_malloc off the main thread.
+    SDL_free(refine->fname);
+    SDL_free(refine);
+}
+
+static int SDLCALL refine_thread(void *data)
+{
+    imagerefine *refine = (imagerefine *) data;
+    set_decode_thread_policy();
+    decode_backoff();
+
+    const Uint64 trace_start = trace_begin();
+    if (!refine->svg) {
+        refine->pixels = load_image_pixels(refine->fname, &refine->w, &refine->h);
+    } else {
+        const int w = SDL_max((int) (refine->svg->width * refine->svgscale), 1);
+        const int h = SDL_max((int) (refine->svg->height * refine->svgscale), 1);
+        NSVGrasterizer *rast = nsvgCreateRasterizer();
+        Uint8 *pixels = rast ? (Uint8 *) mem_alloc(((size_t) w) * ((size_t) h) * 4, MEM_DECODE) : NULL;
+        if (pixels) {
+            nsvgRasterize(rast, refine->svg, 0, 0, refine->svgscale, pixels, w, h, w * 4);
+            refine->pixels = pixels;
+            refine->w = w;
+            refine->h = h;
+        }
+        if (rast) {
+            nsvgDeleteRasterizer(rast);
+        }
+    }
+    trace_end("refine", trace_start);
+
+    if (!SDL_AtomicCAS(&refine->state, REFINE_RUNNING, REFINE_DONE)) {
+        free_refine(refine);  // abandoned, nobody is waiting for this.
+    }
+    return 0;
+}
+
+static void abandon_refine(imagerefine *refine)
+{
+    SDL_Thread *thread = refine->thread;  // refine might be gone as soon as we mark it abandoned.
+    if (SDL_AtomicCAS(&refine->state, REFINE_RUNNING, REFINE_ABANDONED)) {
+        SDL_DetachThread(thread);
+    } else {
+        SDL_WaitThread(thread, NULL);
+        free_refine(refine);
+    }
+}
+
+// SDL only looks at the scale quality hint when it creates a texture (we ship
+//  an SDL that predates SDL_SetTextureScaleMode), so set it just for this one.
+static SDL_Texture *create_linear_texture(const int w, const int h)
+{
+    const char *hint = SDL_GetHint(SDL_HINT_RENDER_SCALE_QUALITY);
+    char *prevhint = SDL_strdup(hint ? hint : "nearest");  // SDL won't take NULL to go back to the default.
+    if (!prevhint) {
+        return NULL;
+    }
+
+    if (!SDL_SetHintWithPriority(SDL_HINT_RENDER_SCALE_QUALITY, "linear", SDL_HINT_OVERRIDE)) {
+        fprintf(stderr, "WARNING: couldn't ask for linear filtering: %s\n", SDL_GetError());
+    }
+    SDL_Texture *retval = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, w, h);
+    if (!SDL_SetHintWithPriority(SDL_HINT_RENDER_SCALE_QUALITY, prevhint, SDL_HINT_OVERRIDE)) {
+        fprintf(stderr, "WARNING: couldn't restore the scale quality hint: %s\n", SDL_GetError());
+    }
+    SDL_free(prevhint);
+    return retval;
+}
+
+// Wraps a small RGBA buffer in an image that draws at the full logical size.
+static marqueeimage *image_from_preview(const Uint8 *pixels, const int pw, const int ph, const int w, const int h)
+{
+    marqueeimage *retval = (marqueeimage *) SDL_calloc(1, sizeof (marqueeimage));
+    if (!retval) {
+        return NULL;
+    }
+
+    // not from the texture pool: it wants linear filtering, and SDL only
+    //  applies that when creating a texture.
+    SDL_Texture *tex = create_linear_texture(pw, ph);
+    if (!tex) {
+        SDL_free(retval);
+        return NULL;
+    }
+    PROBE3(texture_create, pw, ph, SDL_TEXTUREACCESS_STATIC);
+    mem_count(MEM_TEXTURES, pw * ph * 4);
+    SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+
+    const Uint64 trace_start = trace_begin();
+    SDL_UpdateTexture(tex, NULL, pixels, pw * 4);
+    trace_end("SDL_UpdateTexture", trace_start);
+    PROBE3(texture_upload, pw, ph, pw * ph * 4);
+
+    retval->w = w;
+    retval->h = h;
+    retval->numtiles = 1;
+    retval->preview = SDL_TRUE;
+    retval->tiles[0].texture = tex;
+    retval->tiles[0].rect.w = w;
+    retval->tiles[0].rect.h = h;
+    return retval;
+}
+
+// Hands the rest of the work to a thread; on failure, the caller still owns svg.
+static SDL_bool start_refine(marqueeimage *img, const char *fname, NSVGimage *svg, const float svgscale)
+{
+    imagerefine *refine = (imagerefine *) SDL_calloc(1, sizeof (imagerefine));
+    char *fnamecpy = SDL_strdup(fname);
+    if (!refine || !fnamecpy) {
+        SDL_free(refine);
+        SDL_free(fnamecpy);
+        return SDL_FALSE;
+    }
+
+    refine->fname = fnamecpy;
+    refine->svg = svg;
+    refine->svgscale = svgscale;
+    SDL_AtomicSet(&refine->state, REFINE_RUNNING);
+    refine->thread = SDL_CreateThread(refine_thread, "refine", refine);
+    if (!refine->thread) {
+        refine->svg = NULL;
+        free_refine(refine);
+        return SDL_FALSE;
+    }
+
+    img->refine = refine;
+    return SDL_TRUE;
+}
+
+// Swaps in the full-resolution image once the thread has it. Returns SDL_TRUE if that needs a redraw.
+static SDL_bool update_refine(marqueeimage *img)
+{
+    imagerefine *refine = img ? img->refine : NULL;
+    if (!refine || (SDL_AtomicGet(&refine->state) != REFINE_DONE)) {
+        return SDL_FALSE;
+    }
+
+    SDL_WaitThread(refine->thread, NULL);
+    img->refine = NULL;
+
+    marqueeimage *full = refine->pixels ? image_from_pixels(refine->fname, refine->pixels, refine->w, refine->h, refine->w * 4) : NULL;
+    if (!full) {
+        fprintf(stderr, "WARNING: couldn't load image \"%s\", keeping the preview\n", refine->fname);
+        free_refine(refine);
+        return SDL_FALSE;
+    }
+
+    release_image_tiles(img);
+
+    set_image_logical_size(full, img->w, img->h);
+    img->numtiles = full->numtiles;
+    for (int i = 0; i < full->numtiles; i++) {
+        img->tiles[i] = full->tiles[i];
+    }
+
+    SDL_free(full);  // img owns its textures now.
+    free_refine(refine);
+    return SDL_TRUE;
+}
+
+// stb_image's IDCT, but each 8x8 block only needs its average, which is just the DC term.
+static void idct_dc_only(stbi_uc *out, int out_stride, short data[64])
+{
+    (void) out_stride;
+    *out = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
+// Decodes a JPEG at 1/8 scale, one pixel per block. This still has to walk
+//  all the Huffman data of a baseline JPEG, but skips the IDCT, upsampling,
+//  and color conversion of the full image; progressive JPEGs stop after
+//  their DC scans. Returns RGBA pixels, or NULL.
+static Uint8 *decode_jpeg_dc(const Uint8 *buf, const size_t len, int *_w, int *_h)
+{
+    stbi__jpeg *j = (stbi__jpeg *) SDL_calloc(1, sizeof (stbi__jpeg));
+    if (!j) {
+        return NULL;
+    }
+
+    stbi__context s;
+    stbi__start_mem(&s, buf, (int) len);
+    j->s = &s;
+    stbi__setup_jpeg(j);
+    j->idct_block_kernel = idct_dc_only;
+    s.img_n = 0;  // make stbi__cleanup_jpeg safe.
+
+    // this is stbi__decode_jpeg_image(), but it can stop early.
+    SDL_bool okay = stbi__decode_jpeg_header(j, STBI__SCAN_load) ? SDL_TRUE : SDL_FALSE;
+    int m = okay ? stbi__get_marker(j) : STBI__MARKER_none;
+    while (okay && !stbi__EOI(m)) {
+        if (stbi__SOS(m)) {
+            okay = stbi__process_scan_header(j) ? SDL_TRUE : SDL_FALSE;
+            if (okay && j->progressive && (j->spec_start != 0)) {
+                break;  // DC scans come first; everything after this is detail.
+            }
+            okay = okay && stbi__parse_entropy_coded_data(j);
+            if (okay && (j->marker == STBI__MARKER_none)) {  // skip trailing junk to the next marker, like stb_image does.
+                while (!stbi__at_eof(j->s)) {
+                    if (stbi__get8(j->s) == 255) {
+                        j->marker = stbi__get8(j->s);
+                        break;
+                    }
+                }
+            }
+        } else {
+            okay = stbi__process_marker(j, m) ? SDL_TRUE : SDL_FALSE;
+        }
+
+        if (okay) {
+            m = stbi__get_marker(j);
+        }
+    }
+
+    if (okay && j->progressive) {
+        stbi__jpeg_finish(j);
+    }
+
+    const int ncomp = s.img_n;
+    const int w = (int) ((s.img_x + 7) / 8);
+    const int h = (int) ((s.img_y + 7) / 8);
+    Uint8 *retval = NULL;
+    Uint8 *rows = NULL;
+    if (okay && ((ncomp == 1) || (ncomp == 3))) {
+        retval = (Uint8 *) mem_alloc(((size_t) w) * ((size_t) h) * 4, MEM_DECODE);
+        rows = (Uint8 *) mem_alloc(((size_t) w) * 3, MEM_DECODE);
+    }
+
+    if (retval && rows) {
+        const SDL_bool is_rgb = ((ncomp == 3) && ((j->rgb == 3) || ((j->app14_color_transform == 0) && !j->jfif))) ? SDL_TRUE : SDL_FALSE;
+        for (int y = 0; y < h; y++) {
+            for (int c = 0; c < ncomp; c++) {
+                const int by = (y * j->img_comp[c].v) / j->img_v_max;
+                const stbi_uc *src = j->img_comp[c].data + (by * 8 * j->img_comp[c].w2);
+                for (int x = 0; x < w; x++) {
+                    rows[(c * w) + x] = src[((x * j->img_comp[c].h) / j->img_h_max) * 8];
+                }
+            }
+
+            Uint8 *dst = retval + (((size_t) y) * w * 4);
+            if (ncomp == 1) {
+                for (int x = 0; x < w; x++, dst += 4) {
+                    dst[0] = dst[1] = dst[2] = rows[x];
+                    dst[3] = 0xFF;
+                }
+            } else if (is_rgb) {
+                for (int x = 0; x < w; x++, dst += 4) {
+                    dst[0] = rows[x];
+                    dst[1] = rows[w + x];
+                    dst[2] = rows[(w * 2) + x];
+                    dst[3] = 0xFF;
+                }
+            } else {
+                j->YCbCr_to_RGB_kernel(dst, rows, rows + w, rows + (w * 2), w, 4);
+            }
+        }
+        *_w = w;
+        *_h = h;
+    } else {
+        SDL_free(retval);
+        retval = NULL;
+    }
+
+    SDL_free(rows);
+    stbi__cleanup_jpeg(j);
+    SDL_free(j);
+    return retval;
+}
+
+static marqueeimage *load_jpeg_preview(const char *fname)
+{
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &len, &mapped);
+    if (!buf) {
+        return NULL;
+    }
+
+    int w, h, n, pw, ph;
+    Uint8 *pixels = NULL;
+    if ((len > 2) && (buf[0] == 0xFF) && (buf[1] == 0xD8) && stbi_info_from_memory(buf, (int) len, &w, &h, &n) && ((((Sint64) w) * ((Sint64) h)) >= MIN_PREVIEW_PIXELS)) {
+        const Uint64 trace_start = trace_begin();
+        pixels = decode_jpeg_dc(buf, len, &pw, &ph);
+        trace_end("decode_jpeg_dc", trace_start);
+    }
+    unmap_file(buf, len, mapped);
+
+    marqueeimage *retval = pixels ? image_from_preview(pixels, pw, ph, w, h) : NULL;
+    SDL_free(pixels);
+    if (retval && (quality >= QUALITY_MINIMAL)) {
+        loaded_degraded = SDL_TRUE;  // the preview will have to do for now.
+    } else if (retval && !start_refine(retval, fname, NULL, 0.0f)) {
+        free_image(retval);
+        retval = NULL;
+    }
+    return retval;
+}
+
+static marqueeimage *load_svg_image(const char *fname, const SDL_bool allow_preview)
+{
+    marqueeimage *retval = NULL;
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &len, &mapped);
+    NSVGimage *image = buf ? nsvgParse((char *) buf, "px", 96.0f) : NULL;  // parses in place, the mapping is copy-on-write.
+    if (buf) {
+        unmap_file(buf, len, mapped);
+    }
+
+    if (!image) {
+        fprintf(stderr, "WARNING: couldn't load SVG image \"%s\"\n", fname);
+        return NULL;
+    }
+
+    NSVGrasterizer *rast = nsvgCreateRasterizer();
+    if (!rast) {
+        fprintf(stderr, "WARNING: couldn't create SVG rasterizer for \"%s\"\n", fname);
+        nsvgDelete(image);
+        return NULL;
+    }
+
+    const int w = (int) image->width;
+    const int h = (int) image->height;
+
+    // vector art can just be rasterized smaller if it's absurdly large.
+    float scale = 1.0f;
+    if (max_texture_w && (w > (max_texture_w * MAX_IMAGE_TILES_PER_AXIS))) {
+        scale = ((float) (max_texture_w * MAX_IMAGE_TILES_PER_AXIS)) / ((float) w);
+    }
+    if (max_texture_h && (h > (max_texture_h * MAX_IMAGE_TILES_PER_AXIS))) {
+        scale = SDL_min(scale, ((float) (max_texture_h * MAX_IMAGE_TILES_PER_AXIS)) / ((float) h));
+    }
+    int fitw, fith;
+    if (panel_fit_size(w, h, &fitw, &fith)) {  // just rasterize it at the size it'll draw.
+        scale = SDL_min(scale, ((float) fitw) / ((float) w));
+    }
+    if (quality != QUALITY_FULL) {  // it still draws at full size, just blurrier.
+        scale *= (quality == QUALITY_REDUCED) ? 0.5f : 0.25f;
+        loaded_degraded = SDL_TRUE;
+    }
+    const int rasterw = SDL_max((int) (((float) w) * scale), 1);
+    const int rasterh = SDL_max((int) (((float) h) * scale), 1);
+
+    if (allow_preview && ((((Sint64) rasterw) * ((Sint64) rasterh)) >= MIN_PREVIEW_PIXELS)) {
+        const int pw = SDL_max((int) (((float) w) * scale * SVG_PREVIEW_SCALE), 1);
+        const int ph = SDL_max((int) (((float) h) * scale * SVG_PREVIEW_SCALE), 1);
+        Uint8 *pixels = (Uint8 *) mem_alloc(((size_t) pw) * ((size_t) ph) * 4, MEM_DECODE);
+        if (pixels) {
+            const Uint64 trace_start = trace_begin();
+            nsvgRasterize(rast, image, 0, 0, scale * SVG_PREVIEW_SCALE, pixels, pw, ph, pw * 4);
+            trace_end("nsvgRasterize_preview", trace_start);
+            retval = image_from_preview(pixels, pw, ph, w, h);
+            SDL_free(pixels);
+        }
+
+        if (retval && start_refine(retval, fname, image, scale)) {
+            nsvgDeleteRasterizer(rast);
+            return retval;  // the refine thread owns the SVG now.
+        }
+        free_image(retval);
+        retval = NULL;
+    }
+
+    SDL_Texture *newtex = NULL;
+    if (use_streaming_textures && fits_in_one_texture(rasterw, rasterh)) {
+        newtex = get_pooled_texture(SDL_TEXTUREACCESS_STREAMING, rasterw, rasterh);
+    }
+
+    void *pixels = NULL;
+    int pitch = 0;
+    if (newtex && (SDL_LockTexture(newtex, NULL, &pixels, &pitch) == 0)) {
+        const Uint64 trace_start = trace_begin();
+        nsvgRasterize(rast, image, 0, 0, scale, (unsigned char *) pixels, rasterw, rasterh, pitch);
+        trace_end("nsvgRasterize", trace_start);
+        SDL_UnlockTexture(newtex);
+        PROBE3(texture_upload, rasterw, rasterh, rasterw * rasterh * 4);
+        retval = image_from_texture(newtex, w, h);
+    } else {
+        release_texture(newtex);
+        unsigned char *img = mem_alloc(rasterw * rasterh * 4, MEM_DECODE);
+        if (!img) {
+            fprintf(stderr, "WARNING: out of memory for \"%s\"\n", fname);
+        } else {
+            const Uint64 trace_start = trace_begin();
+            nsvgRasterize(rast, image, 0, 0, scale, img, rasterw, rasterh, rasterw * 4);
+            trace_end("nsvgRasterize", trace_start);
+            retval = image_from_pixels(fname, img, rasterw, rasterh, rasterw * 4);
+            if (retval) {
+                set_image_logical_size(retval, w, h);
+            }
+            SDL_free(img);
+        }
+    }
+
+    nsvgDeleteRasterizer(rast);
+    nsvgDelete(image);
+    return retval;
+}
+
+static const Uint8 png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+
+// walks to the next PNG chunk, returns SDL_FALSE at the end of the file (or if it's corrupt).
+static SDL_bool next_png_chunk(const Uint8 *buf, const size_t buflen, size_t *_pos, Uint32 *_type, const Uint8 **_data, Uint32 *_datalen)
+{
+    const size_t pos = *_pos;
+    if ((pos + 12) > buflen) {
+        return SDL_FALSE;
+    }
+    const Uint32 datalen = read_be32(buf + pos);
+    if ((((size_t) datalen) + 12) > (buflen - pos)) {
+        return SDL_FALSE;
+    }
+    *_type = read_be32(buf + pos + 4);
+    *_data = buf + pos + 8;
+    *_datalen = datalen;
+    *_pos = pos + 12 + datalen;
+    return SDL_TRUE;
+}
+
+#define PNG_CHUNK(a,b,c,d) ((((Uint32) (a)) << 24) | (((Uint32) (b)) << 16) | (((Uint32) (c)) << 8) | ((Uint32) (d)))
+
+static SDL_bool is_animated_png(const Uint8 *buf, const size_t buflen)
+{
+    if ((buflen < sizeof (png_signature)) || (SDL_memcmp(buf, png_signature, sizeof (png_signature)) != 0)) {
+        return SDL_FALSE;
+    }
+
+    // acTL has to come before the first IDAT, so we don't have to look far.
+    size_t pos = sizeof (png_signature);
+    Uint32 type, datalen;
+    const Uint8 *data;
+    while (next_png_chunk(buf, buflen, &pos, &type, &data, &datalen)) {
+        if (type == PNG_CHUNK('I','D','A','T')) {
+            break;
+        } else if ((type == PNG_CHUNK('a','c','T','L')) && (datalen >= 8)) {
+            return (read_be32(data) > 1) ? SDL_TRUE : SDL_FALSE;
+        }
+    }
+    return SDL_FALSE;
+}
+
+static SDL_bool skip_gif_subblocks(const Uint8 *buf, const size_t buflen, size_t *_pos)
+{
+    size_t pos = *_pos;
+    while (pos < buflen) {
+        const Uint8 len = buf[pos++];
+        if (len == 0) {
+            *_pos = pos;
+            return SDL_TRUE;
+        }
+        pos += len;
+    }
+    return SDL_FALSE;
+}
+
+// just walks the blocks to see if there's more than one frame; doesn't decode anything.
+static SDL_bool is_animated_gif(const Uint8 *buf, const size_t buflen)
+{
+    if ((buflen < 13) || (SDL_memcmp(buf, "GIF8", 4) != 0)) {
+        return SDL_FALSE;
+    }
+
+    size_t pos = 13;
+    if (buf[10] & 0x80) {  // global color table
+        pos += 3 * (2 << (buf[10] & 7));
+    }
+
+    int frames = 0;
+    while (pos < buflen) {
+        const Uint8 tag = buf[pos++];
+        if (tag == 0x21) {  // extension
+            pos++;
+            if (!skip_gif_subblocks(buf, buflen, &pos)) {
+                break;
+            }
+        } else if (tag == 0x2C) {  // image descriptor
+            if ((pos + 9) > buflen) {
+                break;
+            }
+            const Uint8 flags = buf[pos + 8];
+            pos += 9;
+            if (flags & 0x80) {  // local color table
+                pos += 3 * (2 << (flags & 7));
+            }
+            pos++;  // LZW minimum code size
+            if (!skip_gif_subblocks(buf, buflen, &pos)) {
+                break;
+            } else if (++frames > 1) {
+                return SDL_TRUE;
+            }
+        } else {  // 0x3B is the trailer, anything else is garbage.
+            break;
+        }
+    }
+    return SDL_FALSE;
+}
+
+static void anim_reset_apng(marqueeanim *anim)
+{
+    anim->apng_pos = sizeof (png_signature);
+    anim->apng_prev_dispose = 0;
+    SDL_zero(anim->apng_prev_rect);
+    SDL_memset(anim->apng_canvas, '\0', anim->framelen);
+}
+
+// Each APNG frame is decoded by wrapping its data up as a standalone PNG
+//  for stb_image, then compositing the result onto the canvas.
+static SDL_bool decode_next_apng_frame(marqueeanim *anim, Uint8 *dst, Uint32 *_delayms)
+{
+    const Uint8 *buf = anim->filedata;
+    const size_t buflen = anim->filelen;
+    const Uint8 *fctl = NULL;
+    SDL_bool looped = SDL_FALSE;
+    Uint32 type, datalen;
+    const Uint8 *data;
+
+    // find the next frame control chunk, looping back to the start at the end.
+    while (!fctl) {
+        if (!next_png_chunk(buf, buflen, &anim->apng_pos, &type, &data, &datalen) || (type == PNG_CHUNK('I','E','N','D'))) {
+            if (looped) {
+                return SDL_FALSE;  // no frames at all?!
+            }
+            looped = SDL_TRUE;
+            anim_reset_apng(anim);
+        } else if ((type == PNG_CHUNK('f','c','T','L')) && (datalen >= 26)) {
+            fctl = data;
+        }
+    }
+
+    const Uint32 fw = read_be32(fctl + 4);
+    const Uint32 fh = read_be32(fctl + 8);
+    const Uint32 fx = read_be32(fctl + 12);
+    const Uint32 fy = read_be32(fctl + 16);
+    const Uint16 delaynum = read_be16(fctl + 20);
+    const Uint16 delayden = read_be16(fctl + 22);
+    const Uint8 dispose = fctl[24];
+    const Uint8 blend = fctl[25];
+    if (!fw || !fh || (fw > (Uint32) anim->w) || (fh > (Uint32) anim->h) || (fx > (Uint32) (anim->w - fw)) || (fy > (Uint32) (anim->h - fh))) {
+        return SDL_FALSE;
+    }
+
+    // gather up the frame data (IDAT for the default image, fdAT after that).
+    size_t pos = anim->apng_pos;
+    size_t framedatalen = 0;
+    while (next_png_chunk(buf, buflen, &pos, &type, &data, &datalen)) {
+        if (type == PNG_CHUNK('I','D','A','T')) {
+            framedatalen += datalen + 12;
+        } else if ((type == PNG_CHUNK('f','d','A','T')) && (datalen >= 4)) {
+            framedatalen += datalen + 8;
+        } else {
+            break;
+        }
+    }
+
+    const size_t pnglen = sizeof (png_signature) + anim->apng_headerlen + framedatalen + 12;
+    Uint8 *png = (Uint8 *) mem_alloc(pnglen, MEM_ANIM);
+    if (!png) {
+        return SDL_FALSE;
+    }
+
+    // stb_image doesn't check chunk CRCs, so we don't bother filling them in.
+    Uint8 *ptr = png;
+    SDL_memcpy(ptr, png_signature, sizeof (png_signature));
+    ptr += sizeof (png_signature);
+    SDL_memcpy(ptr, anim->apng_header, anim->apng_headerlen);
+    write_be32(ptr + 8, fw);  // IHDR is always first, patch in this frame's size.
+    write_be32(ptr + 12, fh);
+    ptr += anim->apng_headerlen;
+
+    while (next_png_chunk(buf, buflen, &anim->apng_pos, &type, &data, &datalen)) {
+        if (type == PNG_CHUNK('I','D','A','T')) {
+            SDL_memcpy(ptr, data - 8, datalen + 12);
+            ptr += datalen + 12;
+        } else if ((type == PNG_CHUNK('f','d','A','T')) && (datalen >= 4)) {
+            write_be32(ptr, datalen - 4);
+            write_be32(ptr + 4, PNG_CHUNK('I','D','A','T'));
+            SDL_memcpy(ptr + 8, data + 4, datalen - 4);
+            write_be32(ptr + 8 + (datalen - 4), 0);
+            ptr += datalen + 8;
+        } else {
+            anim->apng_pos -= datalen + 12;  // put it back for next time.
+            break;
+        }
+    }
+
+    write_be32(ptr, 0);
+    write_be32(ptr + 4, PNG_CHUNK('I','E','N','D'));
+    write_be32(ptr + 8, 0);
+    ptr += 12;
+
+    int w, h, n;
+    stbi_uc *img = stbi_load_from_memory(png, (int) (ptr - png), &w, &h, &n, 4);
+    SDL_free(png);
+    if (!img) {
+        return SDL_FALSE;
+    }
+
+    // dispose of the previous frame the way it asked.
+    const int pitch = anim->w * 4;
+    const SDL_Rect *prev = &anim->apng_prev_rect;
+    if (anim->apng_prev_dispose == 1) {  // APNG_DISPOSE_OP_BACKGROUND
+        for (int y = 0; y < prev->h; y++) {
+            SDL_memset(anim->apng_canvas + ((prev->y + y) * pitch) + (prev->x * 4), '\0', prev->w * 4);
+        }
+    } else if (anim->apng_prev_dispose == 2) {  // APNG_DISPOSE_OP_PREVIOUS
+        for (int y = 0; y < prev->h; y++) {
+            const int offset = ((prev->y + y) * pitch) + (prev->x * 4);
+            SDL_memcpy(anim->apng_canvas + offset, anim->apng_saved + offset, prev->w * 4);
+        }
+    }
+
+    if (dispose == 2) {
+        SDL_memcpy(anim->apng_saved, anim->apng_canvas, anim->framelen);
+    }
+
+    for (int y = 0; y < h; y++) {
+        const Uint8 *src = img + (y * w * 4);
+        Uint8 *row = anim->apng_canvas + ((fy + y) * pitch) + (fx * 4);
+        if (blend == 0) {  // APNG_BLEND_OP_SOURCE
+            SDL_memcpy(row, src, w * 4);
+            continue;
+        }
+
+        // APNG_BLEND_OP_OVER
+        for (int x = 0; x < w; x++, src += 4, row += 4) {
+            const int sa = src[3];
+            if (sa == 255) {
+                SDL_memcpy(row, src, 4);
+            } else if (sa != 0) {
+                const int da = (row[3] * (255 - sa)) / 255;
+                const int outa = sa + da;
+                for (int i = 0; i < 3; i++) {
+                    row[i] = (Uint8) (((src[i] * sa) + (row[i] * da)) / outa);
+                }
+                row[3] = (Uint8) outa;
+            }
+        }
+    }
+
+    stbi_image_free(img);
+
+    SDL_memcpy(dst, anim->apng_canvas, anim->framelen);
+
+    anim->apng_prev_dispose = dispose;
+    anim->apng_prev_rect.x = (int) fx;
+    anim->apng_prev_rect.y = (int) fy;
+    anim->apng_prev_rect.w = (int) fw;
+    anim->apng_prev_rect.h = (int) fh;
+
+    *_delayms = (Uint32) ((((Uint32) delaynum) * 1000) / (delayden ? delayden : 100));
+    return SDL_TRUE;
+}
+
+static void anim_reset_gif(marqueeanim *anim)
+{
+    SDL_free(anim->gif.out);
+    SDL_free(anim->gif.background);
+    SDL_free(anim->gif.history);
+    SDL_zero(anim->gif);
+    stbi__start_mem(&anim->gifctx, anim->filedata, (int) anim->filelen);
+    anim->gif_frames_decoded = 0;
+}
+
+static SDL_bool decode_next_gif_frame(marqueeanim *anim, Uint8 *dst, Uint32 *_delayms)
+{
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int comp = 0;
+        // "restore to previous" disposal needs the frame from two frames ago.
+        Uint8 *two_back = (anim->gif_frames_decoded >= 2) ? anim->gif_history[anim->gif_frames_decoded % 2] : NULL;
+        stbi_uc *img = stbi__gif_load_next(&anim->gifctx, &anim->gif, &comp, 4, two_back);
+        if (img == ((stbi_uc *) &anim->gifctx)) {  // end of the animation, start over.
+            if (anim->gif_frames_decoded == 0) {
+                return SDL_FALSE;
+            }
+            anim_reset_gif(anim);
+            continue;
+        } else if (!img) {
+            return SDL_FALSE;
+        }
+
+        SDL_memcpy(dst, img, anim->framelen);
+        SDL_memcpy(anim->gif_history[anim->gif_frames_decoded % 2], img, anim->framelen);
+        anim->gif_frames_decoded++;
+        *_delayms = (Uint32) anim->gif.delay;
+        return SDL_TRUE;
+    }
+    return SDL_FALSE;
+}
+
+static Uint32 read_le32(const Uint8 *ptr)
+{
+    return (((Uint32) ptr[3]) << 24) | (((Uint32) ptr[2]) << 16) | (((Uint32) ptr[1]) << 8) | ((Uint32) ptr[0]);
+}
+
+static Uint64 read_be64(const Uint8 *ptr)
+{
+    return (((Uint64) read_be32(ptr)) << 32) | ((Uint64) read_be32(ptr + 4));
+}
+
+// Motion-JPEG frames usually leave out the Huffman tables and expect the
+//  decoder to use the example tables from the JPEG spec (Annex K.3).
+static const Uint8 mjpeg_default_dht[] = {
+    0xFF, 0xC4, 0x01, 0xA2,
+    // DC luminance
+    0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    // AC luminance
+    0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00, 0x01,
+    0x7D, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61,
+    0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52, 0xD1,
+    0xF0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26, 0x27,
+    0x28, 0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88,
+    0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6,
+    0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3, 0xC4,
+    0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xE1,
+    0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7,
+    0xF8, 0xF9, 0xFA,
+    // DC chrominance
+    0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B,
+    // AC chrominance
+    0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01, 0x02,
+    0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61,
+    0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33, 0x52,
+    0xF0, 0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19, 0x1A,
+    0x26, 0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85, 0x86,
+    0x87, 0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4,
+    0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2,
+    0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9,
+    0xDA, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7,
+    0xF8, 0xF9, 0xFA,
+};
+
+// returns a new copy of the JPEG with the default Huffman tables inserted,
+//  or NULL if it already has its own (or isn't something we understand).
+static Uint8 *add_default_huffman_tables(const Uint8 *jpg, const size_t len, size_t *_newlen)
+{
+    if ((len < 4) || (jpg[0] != 0xFF) || (jpg[1] != 0xD8)) {
+        return NULL;
+    }
+
+    size_t pos = 2;
+    while ((pos + 4) <= len) {
+        if (jpg[pos] != 0xFF) {
+            return NULL;
+        }
+
+        const Uint8 marker = jpg[pos + 1];
+        if (marker == 0xFF) {  // fill byte
+            pos++;
+        } else if (marker == 0xC4) {  // DHT, it has its own tables.
+            return NULL;
+        } else if (marker == 0xDA) {  // SOS, tables go right before this.
+            Uint8 *retval = (Uint8 *) SDL_malloc(len + sizeof (mjpeg_default_dht));
+            if (retval) {
+                SDL_memcpy(retval, jpg, pos);
+                SDL_memcpy(retval + pos, mjpeg_default_dht, sizeof (mjpeg_default_dht));
+                SDL_memcpy(retval + pos + sizeof (mjpeg_default_dht), jpg + pos, len - pos);
+                *_newlen = len + sizeof (mjpeg_default_dht);
+            }
+            return retval;
+        } else {
+            pos += 2 + read_be16(jpg + pos + 2);
+        }
+    }
+    return NULL;
+}
+
+static SDL_bool add_video_frame(marqueeanim *anim, const size_t offset, const size_t len, char *fname, const Uint32 delayms)
+{
+    // grow by doubling; numframes is always a power of two when we run out.
+    const Uint32 num = anim->video_numframes;
+    if ((num == 0) || ((num & (num - 1)) == 0)) {
+        void *ptr = SDL_realloc(anim->video_frames, sizeof (videoframe) * (num ? (num * 2) : 64));
+        if (!ptr) {
+            return SDL_FALSE;
+        }
+        anim->video_frames = (videoframe *) ptr;
+    }
+
+    videoframe *frame = &anim->video_frames[num];
+    frame->offset = offset;
+    frame->len = len;
+    frame->fname = fname;
+    frame->delayms = delayms;
+    anim->video_numframes++;
+    return SDL_TRUE;
+}
+
+static void parse_avi_chunks(marqueeanim *anim, size_t pos, const size_t end, Uint32 *usecs_per_frame, char *streamid)
+{
+    const Uint8 *buf = anim->filedata;
+    while ((pos + 8) <= end) {
+        const char *id = (const char *) (buf + pos);
+        const Uint32 len = read_le32(buf + pos + 4);
+        const size_t datapos = pos + 8;
+        if (len > (end - datapos)) {
+            break;  // truncated file; take what we've got.
+        }
+
+        if ((SDL_memcmp(id, "RIFF", 4) == 0) || (SDL_memcmp(id, "LIST", 4) == 0)) {
+            if (len >= 4) {
+                parse_avi_chunks(anim, datapos + 4, datapos + len, usecs_per_frame, streamid);
+            }
+        } else if ((SDL_memcmp(id, "avih", 4) == 0) && (len >= 4)) {
+            *usecs_per_frame = read_le32(buf + datapos);
+        } else if ((id[2] == 'd') && ((id[3] == 'c') || (id[3] == 'b')) && (len > 0)) {  // "00dc" is stream 0's video data.
+            if (!streamid[0]) {
+                streamid[0] = id[0];
+                streamid[1] = id[1];
+            }
+            if ((id[0] == streamid[0]) && (id[1] == streamid[1])) {
+                if (!add_video_frame(anim, datapos, len, NULL, 0)) {
+                    break;
+                }
+            }
+        }
+
+        pos = datapos + len + (len & 1);  // chunks are padded to even sizes.
+    }
+}
+
+static SDL_bool parse_avi(marqueeanim *anim)
+{
+    if ((anim->filelen < 12) || (SDL_memcmp(anim->filedata, "RIFF", 4) != 0) || (SDL_memcmp(anim->filedata + 8, "AVI ", 4) != 0)) {
+        return SDL_FALSE;
+    }
+
+    Uint32 usecs_per_frame = 0;
+    char streamid[2] = { 0, 0 };
+    parse_avi_chunks(anim, 0, anim->filelen, &usecs_per_frame, streamid);
+
+    const Uint32 delayms = usecs_per_frame ? ((usecs_per_frame + 500) / 1000) : (1000 / video_fps);
+    for (Uint32 i = 0; i < anim->video_numframes; i++) {
+        anim->video_frames[i].delayms = delayms;
+    }
+    return SDL_TRUE;
+}
+
+typedef struct
+{
+    SDL_bool is_video;
+    SDL_bool is_mjpeg;
+    Uint32 timescale;
+    SDL_bool co64;
+    const Uint8 *stsz, *stco, *stsc, *stts;
+    size_t stszlen, stcolen, stsclen, sttslen;
+} movtrack;
+
+static void build_mov_frames(marqueeanim *anim, const movtrack *trak)
+{
+    if (!trak->stsz || !trak->stco || !trak->stsc || (trak->stszlen < 12) || (trak->stcolen < 8) || (trak->stsclen < 8)) {
+        return;
+    }
+
+    const Uint32 fixedsize = read_be32(trak->stsz + 4);
+    const Uint32 numsamples = read_be32(trak->stsz + 8);
+    const Uint32 numchunks = read_be32(trak->stco + 4);
+    const Uint32 numstsc = read_be32(trak->stsc + 4);
+    const Uint32 numstts = ((trak->stts && (trak->sttslen >= 8)) ? read_be32(trak->stts + 4) : 0);
+    const size_t chunkoffsetsize = trak->co64 ? 8 : 4;
+    if ( (!fixedsize && (numsamples > ((trak->stszlen - 12) / 4))) ||
+         (numchunks > ((trak->stcolen - 8) / chunkoffsetsize)) ||
+         (numstsc == 0) || (numstsc > ((trak->stsclen - 8) / 12)) ||
+         (numstts > ((trak->sttslen - 8) / 8)) ) {
+        return;  // corrupt.
+    }
+
+    const Uint32 defaultdelay = 1000 / video_fps;
+    Uint32 sample = 0;
+    Uint32 stscidx = 0;
+    Uint32 sttsidx = 0;
+    Uint32 sttsleft = numstts ? read_be32(trak->stts + 8) : 0;
+    for (Uint32 chunk = 0; (chunk < numchunks) && (sample < numsamples); chunk++) {
+        // stsc is a list of runs of chunks with the same number of samples each; chunks count from 1.
+        while (((stscidx + 1) < numstsc) && (read_be32(trak->stsc + 8 + ((stscidx + 1) * 12)) <= (chunk + 1))) {
+            stscidx++;
+        }
+        const Uint32 samples_per_chunk = read_be32(trak->stsc + 8 + (stscidx * 12) + 4);
+        Uint64 offset = trak->co64 ? read_be64(trak->stco + 8 + (chunk * 8)) : read_be32(trak->stco + 8 + (chunk * 4));
+
+        for (Uint32 i = 0; (i < samples_per_chunk) && (sample < numsamples); i++, sample++) {
+            const Uint32 len = fixedsize ? fixedsize : read_be32(trak->stsz + 12 + (sample * 4));
+            if ((offset > anim->filelen) || (len > (anim->filelen - offset))) {
+                return;  // truncated file; take what we've got.
+            }
+
+            Uint32 delayms = defaultdelay;
+            while ((sttsleft == 0) && ((sttsidx + 1) < numstts)) {
+                sttsidx++;
+                sttsleft = read_be32(trak->stts + 8 + (sttsidx * 8));
+            }
+            if (sttsleft && trak->timescale) {
+                const Uint64 delta = read_be32(trak->stts + 8 + (sttsidx * 8) + 4);
+                delayms = (Uint32) ((delta * 1000) / trak->timescale);
+                sttsleft--;
+            }
+
+            if (!add_video_frame(anim, (size_t) offset, len, NULL, delayms)) {
+                return;
+            }
+            offset += len;
+        }
+    }
+}
+
+static void parse_mov_atoms(marqueeanim *anim, size_t pos, const size_t end, movtrack *trak)
+{
+    const Uint8 *buf = anim->filedata;
+    while ((pos + 8) <= end) {
+        Uint64 size = read_be32(buf + pos);
+        const Uint32 type = read_be32(buf + pos + 4);
+        size_t hdrlen = 8;
+        if (size == 1) {  // 64-bit size follows.
+            if ((pos + 16) > end) {
+                break;
+            }
+            size = read_be64(buf + pos + 8);
+            hdrlen = 16;
+        } else if (size == 0) {  // runs to the end of the file.
+            size = end - pos;
+        }
+
+        if ((size < hdrlen) || (size > (end - pos))) {
+            break;
+        }
+
+        const Uint8 *data = buf + pos + hdrlen;
+        const size_t datalen = (size_t) (size - hdrlen);
+
+        if ((type == PNG_CHUNK('m','o','o','v')) || (trak && ((type == PNG_CHUNK('m','d','i','a')) || (type == PNG_CHUNK('m','i','n','f')) || (type == PNG_CHUNK('s','t','b','l'))))) {
+            parse_mov_atoms(anim, pos + hdrlen, pos + (size_t) size, trak);
+        } else if (type == PNG_CHUNK('t','r','a','k')) {
+            movtrack newtrak;
+            SDL_zero(newtrak);
+            parse_mov_atoms(anim, pos + hdrlen, pos + (size_t) size, &newtrak);
+            if (!anim->video_numframes && newtrak.is_video && newtrak.is_mjpeg) {
+                build_mov_frames(anim, &newtrak);  // first Motion-JPEG video track wins.
+            }
+        } else if (trak) {
+            if ((type == PNG_CHUNK('m','d','h','d')) && (datalen >= 24)) {
+                trak->timescale = read_be32(data + ((data[0] == 1) ? 20 : 12));
+            } else if ((type == PNG_CHUNK('h','d','l','r')) && (datalen >= 12)) {
+                trak->is_video = (read_be32(data + 8) == PNG_CHUNK('v','i','d','e')) ? SDL_TRUE : SDL_FALSE;
+            } else if ((type == PNG_CHUNK('s','t','s','d')) && (datalen >= 16)) {
+                const Uint32 format = read_be32(data + 12);
+                trak->is_mjpeg = ( (format == PNG_CHUNK('j','p','e','g')) || (format == PNG_CHUNK('m','j','p','a')) ||
+                                   (format == PNG_CHUNK('M','J','P','G')) || (format == PNG_CHUNK('A','V','D','J')) ) ? SDL_TRUE : SDL_FALSE;
+            } else if (type == PNG_CHUNK('s','t','s','z')) {
+                trak->stsz = data;
+                trak->stszlen = datalen;
+            } else if ((type == PNG_CHUNK('s','t','c','o')) || (type == PNG_CHUNK('c','o','6','4'))) {
+                trak->stco = data;
+                trak->stcolen = datalen;
+                trak->co64 = (type == PNG_CHUNK('c','o','6','4')) ? SDL_TRUE : SDL_FALSE;
+            } else if (type == PNG_CHUNK('s','t','s','c')) {
+                trak->stsc = data;
+                trak->stsclen = datalen;
+            } else if (type == PNG_CHUNK('s','t','t','s')) {
+                trak->stts = data;
+                trak->sttslen = datalen;
+            }
+        }
+
+        pos += (size_t) size;
+    }
+}
+
+static SDL_bool parse_mov(marqueeanim *anim)
+{
+    parse_mov_atoms(anim, 0, anim->filelen, NULL);
+    return SDL_TRUE;
+}
+
+#if USE_POSIX
+// sorts "frame2.jpg" before "frame10.jpg".
+static int compare_numbered_filenames(const void *_a, const void *_b)
+{
+    const char *a = ((const videoframe *) _a)->fname;
+    const char *b = ((const videoframe *) _b)->fname;
+    while (*a && *b) {
+        if (SDL_isdigit(*a) && SDL_isdigit(*b)) {
+            while (*a == '0') { a++; }
+            while (*b == '0') { b++; }
+            size_t alen = 0, blen = 0;
+            while (SDL_isdigit(a[alen])) { alen++; }
+            while (SDL_isdigit(b[blen])) { blen++; }
+            if (alen != blen) {
+                return (alen < blen) ? -1 : 1;
+            }
+            const int rc = SDL_strncmp(a, b, alen);
+            if (rc != 0) {
+                return rc;
+            }
+            a += alen;
+            b += blen;
+        } else if (*a != *b) {
+            return (*a < *b) ? -1 : 1;
+        } else {
+            a++;
+            b++;
+        }
+    }
+    return *a ? 1 : (*b ? -1 : 0);
+}
+
+static SDL_bool parse_jpeg_directory(marqueeanim *anim, const char *dirname)
+{
+    DIR *dir = opendir(dirname);
+    if (!dir) {
+        return SDL_FALSE;
+    }
+
+    const Uint32 delayms = 1000 / video_fps;
+    struct dirent *dent;
+    while ((dent = readdir(dir)) != NULL) {
+        const char *ext = SDL_strrchr(dent->d_name, '.');
+        if (ext && ((SDL_strcasecmp(ext, ".jpg") == 0) || (SDL_strcasecmp(ext, ".jpeg") == 0))) {
+            const size_t len = SDL_strlen(dirname) + SDL_strlen(dent->d_name) + 2;
+            char *path = (char *) SDL_malloc(len);
+            if (!path) {
+                break;
+            }
+            SDL_snprintf(path, len, "%s/%s", dirname, dent->d_name);
+            if (!add_video_frame(anim, 0, 0, path, delayms)) {
+                SDL_free(path);
+                break;
+            }
+        }
+    }
+    closedir(dir);
+
+    if (anim->video_numframes) {
+        SDL_qsort(anim->video_frames, anim->video_numframes, sizeof (videoframe), compare_numbered_filenames);
+    }
+    return SDL_TRUE;
+}
+#endif
+
+static SDL_bool decode_video_frame(marqueeanim *anim, const Uint32 sequence, Uint8 *dst, Uint32 *_delayms)
+{
+    const videoframe *frame = &anim->video_frames[sequence % anim->video_numframes];
+    Uint8 *loaded = NULL;
+    SDL_bool mapped = SDL_FALSE;
+    const Uint8 *jpg = NULL;
+    size_t len = 0;
+
+    if (frame->fname) {
+        loaded = map_file(frame->fname, &len, &mapped);
+        jpg = loaded;
+    } else {
+        jpg = anim->filedata + frame->offset;
+        len = frame->len;
+    }
+
+    SDL_bool retval = SDL_FALSE;
+    if (jpg) {
+        size_t patchedlen = 0;
+        Uint8 *patched = add_default_huffman_tables(jpg, len, &patchedlen);
+        int w, h, n;
+        stbi_uc *img = patched ? stbi_load_from_memory(patched, (int) patchedlen, &w, &h, &n, 4) : stbi_load_from_memory(jpg, (int) len, &w, &h, &n, 4);
+        if (img && (w == anim->w) && (h == anim->h)) {
+            SDL_memcpy(dst, img, anim->framelen);
+            retval = SDL_TRUE;
+        }
+        stbi_image_free(img);
+        SDL_free(patched);
+    }
+
+    if (loaded) {
+        unmap_file(loaded, len, mapped);
+    }
+    *_delayms = frame->delayms ? frame->delayms : 1;
+    return retval;
+}
+
+static SDL_bool decode_anim_frame(marqueeanim *anim, const Uint32 sequence, Uint8 *dst, Uint32 *_delayms)
+{
+    if (anim->source == ANIMSOURCE_MJPEG) {
+        return decode_video_frame(anim, sequence, dst, _delayms);
+    }
+
+    // GIF and APNG have to go in order, so there's only one worker and it ignores sequence.
+    const SDL_bool retval = (anim->source == ANIMSOURCE_GIF) ? decode_next_gif_frame(anim, dst, _delayms) : decode_next_apng_frame(anim, dst, _delayms);
+    if (retval && (*_delayms < 20)) {
+        *_delayms = 100;  // this is what web browsers do with tiny delays, so art expects it.
+    }
+    return retval;
+}
+
+static int SDLCALL anim_worker(void *data)
+{
+    marqueeanim *anim = (marqueeanim *) data;
+    set_decode_thread_policy();
+
+    while (SDL_TRUE) {
+        // claim the next frame in the stream, once its slot comes free.
+        animframe *frame = NULL;
+        SDL_LockMutex(anim->lock);
+        while (!SDL_AtomicGet(&anim->quit)) {
+            frame = &anim->frames[anim->next_sequence % anim->ringsize];
+            if (frame->state == ANIMFRAME_FREE) {
+                break;
+            }
+            SDL_CondWait(anim->cond, anim->lock);
+        }
+
+        if (SDL_AtomicGet(&anim->quit)) {
+            SDL_UnlockMutex(anim->lock);
+            break;
+        }
+
+        const Uint32 sequence = anim->next_sequence++;
+        frame->state = ANIMFRAME_DECODING;
+        frame->sequence = sequence;
+        SDL_UnlockMutex(anim->lock);
+
+        decode_backoff();  // with the frame claimed, so nobody else picks it up meanwhile.
+
+        Uint32 delayms = 0;
+        const Uint64 trace_start = trace_begin();
+        const SDL_bool okay = decode_anim_frame(anim, sequence, frame->pixels, &delayms);
+        trace_end("decode_anim_frame", trace_start);
+        if (!okay && (anim->source != ANIMSOURCE_MJPEG)) {
+            fprintf(stderr, "WARNING: failed to decode animation frame in \"%s\"; stopping here.\n", anim->fname);
+            break;  // the main thread just keeps showing what it has.
+        }
+
+        SDL_LockMutex(anim->lock);
+        frame->delayms = delayms;
+        frame->failed = !okay;
+        frame->ready_ticks = SDL_GetTicks();
+        frame->state = ANIMFRAME_DECODED;
+        SDL_UnlockMutex(anim->lock);
+    }
+
+    return 0;
+}
+
+// reports and resets the stats, if they cover at least a few seconds (or force is set).
+static void print_video_stats(marqueeanim *anim, const SDL_bool force)
+{
+    videostats *stats = &anim->stats;
+    const Uint32 now = SDL_GetTicks();
+    if (!force && !SDL_TICKS_PASSED(now, stats->start_ticks + 10000)) {
+        return;
+    }
+
+    if ((anim->source == ANIMSOURCE_MJPEG) && stats->shown) {
+        printf("Video stats for \"%s\": %dx%d, %u shown, %u dropped, %u late, %u failed; decode lead avg %u ms, min %u ms\n",
+               anim->fname, anim->w, anim->h, (unsigned int) stats->shown, (unsigned int) stats->dropped,
+               (unsigned int) stats->late, (unsigned int) stats->failed,
+               (unsigned int) (stats->total_lead_ms / stats->shown), (unsigned int) stats->min_lead_ms);
+    }
+    SDL_zerop(stats);
+    stats->min_lead_ms = 0xFFFFFFFF;
+    stats->start_ticks = now;
+}
+
+static void free_anim(marqueeanim *anim)
+{
+    if (!anim) {
+        return;
+    }
+
+    if (anim->numthreads) {
+        SDL_AtomicSet(&anim->quit, 1);
+        SDL_LockMutex(anim->lock);
+        SDL_CondBroadcast(anim->cond);
+        SDL_UnlockMutex(anim->lock);
+        for (int i = 0; i < anim->numthreads; i++) {
+            SDL_WaitThread(anim->threads[i], NULL);
+        }
+    }
+
+    print_video_stats(anim, SDL_TRUE);
+
+    for (int i = 0; i < anim->ringsize; i++) {
+        release_texture(anim->frames[i].texture);
+        SDL_free(anim->frames[i].pixels);
+    }
+
+    if (anim->source == ANIMSOURCE_GIF) {
+        SDL_free(anim->gif.out);
+        SDL_free(anim->gif.background);
+        SDL_free(anim->gif.history);
+    }
+
+    for (Uint32 i = 0; i < anim->video_numframes; i++) {
+        SDL_free(anim->video_frames[i].fname);
+    }
+
+    SDL_free(anim->video_frames);
+    SDL_free(anim->gif_history[0]);
+    SDL_free(anim->gif_history[1]);
+    SDL_free(anim->apng_canvas);
+    SDL_free(anim->apng_saved);
+    SDL_free(anim->apng_header);
+    SDL_DestroyCond(anim->cond);
+    SDL_DestroyMutex(anim->lock);
+    if (anim->filedata) {
+        unmap_file(anim->filedata, anim->filelen, anim->filemapped);
+    }
+    SDL_free(anim->fname);
+    SDL_free(anim);
+}
+
+static SDL_bool upload_anim_frame(marqueeanim *anim, animframe *frame)
+{
+    void *pixels = NULL;
+    int pitch = 0;
+    const Uint64 trace_start = trace_begin();
+    if (SDL_LockTexture(frame->texture, NULL, &pixels, &pitch) < 0) {
+        return SDL_FALSE;
+    }
+
+    const int rowlen = anim->w * 4;
+    const Uint8 *src = frame->pixels;
+    Uint8 *dst = (Uint8 *) pixels;
+    if (pitch == rowlen) {
+        SDL_memcpy(dst, src, anim->framelen);
+    } else {
+        for (int y = 0; y < anim->h; y++, src += rowlen, dst += pitch) {
+            SDL_memcpy(dst, src, rowlen);
+        }
+    }
+    SDL_UnlockTexture(frame->texture);
+    trace_end("upload_anim_frame", trace_start);
+    PROBE3(texture_upload, anim->w, anim->h, (int) anim->framelen);
+    return SDL_TRUE;
+}
+
+static animframestate get_anim_frame_state(marqueeanim *anim, const int slot)
+{
+    SDL_LockMutex(anim->lock);
+    const animframestate retval = anim->frames[slot].state;
+    SDL_UnlockMutex(anim->lock);
+    return retval;
+}
+
+static SDL_bool anim_frame_is_uploaded(marqueeanim *anim, const int slot)
+{
+    return (get_anim_frame_state(anim, slot) == ANIMFRAME_UPLOADED) ? SDL_TRUE : SDL_FALSE;
+}
+
+// hand a slot back to the workers.
+static void free_anim_slot(marqueeanim *anim, const int slot)
+{
+    SDL_LockMutex(anim->lock);
+    anim->frames[slot].state = ANIMFRAME_FREE;
+    SDL_CondBroadcast(anim->cond);
+    SDL_UnlockMutex(anim->lock);
+}
+
+// Call this every so often on the main thread. Uploads frames the workers
+//  have finished and flips to the next one when it's due. Returns SDL_TRUE if
+//  the image needs to be redrawn.
+static SDL_bool update_animation(marqueeimage *img)
+{
+    marqueeanim *anim = img ? img->anim : NULL;
+    if (!anim) {
+        return SDL_FALSE;
+    }
+
+    // workers don't touch decoded frames, so we can upload without holding the
+    //  lock. The slot on screen waits until it's due, or we'd draw it early.
+    for (int i = 0; i < anim->ringsize; i++) {
+        animframe *frame = &anim->frames[i];
+        if (i == anim->shown_slot) {
+            continue;
+        }
+        SDL_LockMutex(anim->lock);
+        const SDL_bool decoded = (frame->state == ANIMFRAME_DECODED) ? SDL_TRUE : SDL_FALSE;
+        SDL_UnlockMutex(anim->lock);
+        if (decoded && (frame->failed || upload_anim_frame(anim, frame))) {
+            SDL_LockMutex(anim->lock);
+            frame->state = ANIMFRAME_UPLOADED;
+            SDL_UnlockMutex(anim->lock);
+        }
+    }
+
+    const Uint32 now = SDL_GetTicks();
+    while (SDL_TICKS_PASSED(now, anim->next_frame_ticks)) {
+        const int next = (anim->display_slot + 1) % anim->ringsize;
+        animframe *frame = &anim->frames[next];
+        SDL_bool ready = anim_frame_is_uploaded(anim, next);
+        if (next == anim->shown_slot) {  // skipped all the way around the ring to the frame on screen.
+            const animframestate state = get_anim_frame_state(anim, next);
+            ready = SDL_FALSE;
+            if (state == ANIMFRAME_UPLOADED) {
+                free_anim_slot(anim, next);  // the workers need it back to make progress.
+            } else if ((state == ANIMFRAME_DECODED) && (frame->failed || upload_anim_frame(anim, frame))) {
+                SDL_LockMutex(anim->lock);
+                frame->state = ANIMFRAME_UPLOADED;
+                SDL_UnlockMutex(anim->lock);
+                ready = SDL_TRUE;
+            }
+        }
+
+        if (!ready) {
+            if (!anim->stalled) {
+                anim->stalled = SDL_TRUE;
+                anim->stats.late++;
+            }
+            return SDL_FALSE;  // decoder is behind (or done); keep showing the current frame.
+        }
+        anim->stalled = SDL_FALSE;
+
+        // frames we skipped go right back to the workers; the one on screen
+        //  stays put until something replaces it.
+        if (anim->display_slot != anim->shown_slot) {
+            free_anim_slot(anim, anim->display_slot);
+        }
+        anim->display_slot = next;
+
+        if ((anim->source == ANIMSOURCE_MJPEG) && ((frame->sequence % anim->video_numframes) == 0)) {
+            print_video_stats(anim, SDL_FALSE);  // report at the end of a loop, if it's been a while.
+        }
+
+        if (frame->failed) {
+            anim->stats.failed++;
+            continue;
+        }
+
+        anim->next_frame_ticks += frame->delayms;
+        if (SDL_TICKS_PASSED(now, anim->next_frame_ticks)) {
+            if (anim->source != ANIMSOURCE_MJPEG) {
+                anim->next_frame_ticks = now + frame->delayms;  // fell way behind, just reset the cadence.
+            } else if ((((next + 1) % anim->ringsize) != anim->shown_slot) && anim_frame_is_uploaded(anim, (next + 1) % anim->ringsize)) {
+                anim->stats.dropped++;  // video keeps to the clock; skip ahead if we can.
+                continue;
+            }
+        }
+
+        const Uint32 lead = now - frame->ready_ticks;
+        anim->stats.shown++;
+        anim->stats.total_lead_ms += lead;
+        anim->stats.min_lead_ms = SDL_min(anim->stats.min_lead_ms, lead);
+        if (anim->shown_slot != next) {
+            free_anim_slot(anim, anim->shown_slot);
+        }
+        anim->shown_slot = next;
+        img->tiles[0].texture = frame->texture;
+        return SDL_TRUE;
+    }
+
+    return SDL_FALSE;
+}
+
+// milliseconds until update_animation() has something to do, or -1 if never.
+static Sint32 animation_wait_ms(const marqueeimage *img)
+{
+    const marqueeanim *anim = img ? img->anim : NULL;
+    if (!anim) {
+        return -1;
+    }
+    return SDL_max((Sint32) (anim->next_frame_ticks - SDL_GetTicks()), 1);
+}
+
+// Returns the first frame's dimensions, or SDL_FALSE if there's nothing usable.
+static SDL_bool prepare_anim_source(marqueeanim *anim, int *_w, int *_h)
+{
+    int n;
+
+    if (anim->source == ANIMSOURCE_MJPEG) {
+        if (!anim->video_numframes) {
+            return SDL_FALSE;
+        }
+
+        const videoframe *frame = &anim->video_frames[0];
+        if (!frame->fname) {
+            return stbi_info_from_memory(anim->filedata + frame->offset, (int) frame->len, _w, _h, &n) ? SDL_TRUE : SDL_FALSE;
+        }
+        size_t len = 0;
+        SDL_bool mapped = SDL_FALSE;
+        Uint8 *jpg = map_file(frame->fname, &len, &mapped);
+        const SDL_bool retval = (jpg && stbi_info_from_memory(jpg, (int) len, _w, _h, &n)) ? SDL_TRUE : SDL_FALSE;
+        if (jpg) {
+            unmap_file(jpg, len, mapped);
+        }
+        return retval;
+    }
+
+    return stbi_info_from_memory(anim->filedata, (int) anim->filelen, _w, _h, &n) ? SDL_TRUE : SDL_FALSE;
+}
+
+// Animated GIF and APNG files, and Motion-JPEG video (AVI, QuickTime, or a
+//  directory of numbered JPEGs), get decoded a few frames ahead on worker
+//  threads into a small ring of buffers and streaming textures. Returns NULL
+//  if this isn't an animation (or is too big for the memory budget), in
+//  which case the caller should load it as a still image.
+static marqueeimage *load_animated_image(const char *fname)
+{
+    const char *ext = SDL_strrchr(fname, '.');
+    SDL_bool is_dir = SDL_FALSE;
+
+    #if USE_POSIX
+    struct stat statbuf;
+    is_dir = ((stat(fname, &statbuf) == 0) && S_ISDIR(statbuf.st_mode)) ? SDL_TRUE : SDL_FALSE;
+    #endif
+
+    if (is_dir) {
+        // handled below.
+    } else if (!ext) {
+        return NULL;
+    } else if ( (SDL_strcasecmp(ext, ".gif") != 0) && (SDL_strcasecmp(ext, ".png") != 0) && (SDL_strcasecmp(ext, ".apng") != 0) &&
+                (SDL_strcasecmp(ext, ".avi") != 0) && (SDL_strcasecmp(ext, ".mov") != 0) && (SDL_strcasecmp(ext, ".qt") != 0) ) {
+        return NULL;
+    }
+
+    size_t filelen = 0;
+    SDL_bool filemapped = SDL_FALSE;
+    Uint8 *filedata = is_dir ? NULL : map_file(fname, &filelen, &filemapped);
+    if (!is_dir && !filedata) {
+        return NULL;
+    }
+
+    marqueeanim *anim = (marqueeanim *) SDL_calloc(1, sizeof (marqueeanim));
+    if (!anim) {
+        if (filedata) {
+            unmap_file(filedata, filelen, filemapped);
+        }
+        return NULL;
+    }
+
+    anim->fname = SDL_strdup(fname);
+    anim->filedata = filedata;
+    anim->filelen = filelen;
+    anim->filemapped = filemapped;
+    print_video_stats(anim, SDL_TRUE);  // resets them.
+
+    SDL_bool okay = SDL_FALSE;
+    if (is_dir) {
+        #if USE_POSIX
+        anim->source = ANIMSOURCE_MJPEG;
+        okay = parse_jpeg_directory(anim, fname);
+        #endif
+    } else if (SDL_strcasecmp(ext, ".avi") == 0) {
+        anim->source = ANIMSOURCE_MJPEG;
+        okay = parse_avi(anim);
+    } else if ((SDL_strcasecmp(ext, ".mov") == 0) || (SDL_strcasecmp(ext, ".qt") == 0)) {
+        anim->source = ANIMSOURCE_MJPEG;
+        okay = parse_mov(anim);
+    } else if (is_animated_gif(filedata, filelen)) {
+        anim->source = ANIMSOURCE_GIF;
+        okay = SDL_TRUE;
+    } else if (is_animated_png(filedata, filelen)) {
+        anim->source = ANIMSOURCE_APNG;
+        okay = SDL_TRUE;
+    }
+
+    int w = 0, h = 0;
+    if (!okay || !prepare_anim_source(anim, &w, &h) || !fits_in_one_texture(w, h)) {
+        if (anim->source == ANIMSOURCE_MJPEG) {
+            fprintf(stderr, "WARNING: couldn't play video \"%s\"\n", fname);
+        }
+        free_anim(anim);
+        return NULL;  // not an animation, or not one we can play; try it as a still image.
+    }
+
+    int numthreads = 1;
+    anim->ringsize = ANIM_RING_SIZE;
+    if (anim->source == ANIMSOURCE_MJPEG) {
+        numthreads = video_threads ? video_threads : (SDL_GetCPUCount() - 1);
+        numthreads = SDL_max(1, SDL_min(numthreads, MAX_VIDEO_WORKERS));
+        anim->ringsize = VIDEO_RING_SIZE;
+    }
+
+    // ring buffers + ring textures + decoder state (GIF keeps three frames of
+    //  its own plus our two history frames, APNG keeps the canvas, a saved copy,
+    //  and the decoded sub-frame, MJPEG workers each have a decoded frame).
+    const size_t framelen = ((size_t) w) * ((size_t) h) * 4;
+    const size_t overhead = (anim->source == ANIMSOURCE_GIF) ? 5 : (anim->source == ANIMSOURCE_APNG) ? 3 : numthreads;
+    const size_t needed = (framelen * anim->ringsize * 2) + (framelen * overhead);
+    if (needed > (((size_t) anim_budget_mb) * 1024 * 1024)) {
+        fprintf(stderr, "WARNING: animation \"%s\" needs %u megabytes, budget is %u; showing it as a still image.\n",
+                fname, (unsigned int) (needed / (1024 * 1024)), (unsigned int) anim_budget_mb);
+        free_anim(anim);
+        return NULL;
+    } else if (mem_budget_mb && ((((Sint64) SDL_AtomicGet(&mem_total)) + ((Sint64) needed)) > (((Sint64) mem_budget_mb) * 1024 * 1024))) {
+        fprintf(stderr, "WARNING: animation \"%s\" needs %u megabytes, that's more than --membudget has left; showing it as a still image.\n",
+                fname, (unsigned int) (needed / (1024 * 1024)));
+        free_anim(anim);
+        return NULL;
+    }
+
+    anim->w = w;
+    anim->h = h;
+    anim->framelen = framelen;
+    anim->lock = SDL_CreateMutex();
+    anim->cond = SDL_CreateCond();
+
+    okay = (anim->fname && anim->lock && anim->cond) ? SDL_TRUE : SDL_FALSE;
+    for (int i = 0; okay && (i < anim->ringsize); i++) {
+        animframe *frame = &anim->frames[i];
+        frame->pixels = (Uint8 *) mem_alloc(framelen, MEM_ANIM);
+        frame->texture = get_pooled_texture(SDL_TEXTUREACCESS_STREAMING, w, h);
+        okay = (frame->pixels && frame->texture) ? SDL_TRUE : SDL_FALSE;
+    }
+
+    if (!okay) {
+        // nothing else to set up.
+    } else if (anim->source == ANIMSOURCE_GIF) {
+        anim->gif_history[0] = (Uint8 *) mem_alloc(framelen, MEM_ANIM);
+        anim->gif_history[1] = (Uint8 *) mem_alloc(framelen, MEM_ANIM);
+        okay = (anim->gif_history[0] && anim->gif_history[1]) ? SDL_TRUE : SDL_FALSE;
+        if (okay) {
+            anim_reset_gif(anim);
+        }
+    } else if (anim->source == ANIMSOURCE_APNG) {
+        anim->apng_canvas = (Uint8 *) mem_alloc(framelen, MEM_ANIM);
+        anim->apng_saved = (Uint8 *) mem_alloc(framelen, MEM_ANIM);
+        okay = (anim->apng_canvas && anim->apng_saved) ? SDL_TRUE : SDL_FALSE;
+
+        // keep IHDR, PLTE and tRNS around to build each frame into a standalone PNG.
+        size_t pos = sizeof (png_signature);
+        Uint32 type, datalen;
+        const Uint8 *data;
+        while (okay && next_png_chunk(filedata, filelen, &pos, &type, &data, &datalen)) {
+            if ((type == PNG_CHUNK('I','H','D','R')) || (type == PNG_CHUNK('P','L','T','E')) || (type == PNG_CHUNK('t','R','N','S'))) {
+                void *ptr = SDL_realloc(anim->apng_header, anim->apng_headerlen + datalen + 12);
+                if (!ptr) {
+                    okay = SDL_FALSE;
+                } else {
+                    anim->apng_header = (Uint8 *) ptr;
+                    SDL_memcpy(anim->apng_header + anim->apng_headerlen, data - 8, datalen + 12);
+                    anim->apng_headerlen += datalen + 12;
+                }
+            } else if (type == PNG_CHUNK('I','D','A','T')) {
+                break;
+            }
+        }
+
+        if (okay) {
+            anim_reset_apng(anim);
+        }
+    }
+
+    // decode the first frame right here, so there's something to show immediately.
+    Uint32 delayms = 0;
+    if (okay && !decode_anim_frame(anim, 0, anim->frames[0].pixels, &delayms)) {
+        okay = SDL_FALSE;
+    } else if (okay && !upload_anim_frame(anim, &anim->frames[0])) {
+        okay = SDL_FALSE;
+    }
+
+    marqueeimage *retval = okay ? image_from_texture(anim->frames[0].texture, w, h) : NULL;
+    if (!retval) {
+        fprintf(stderr, "WARNING: couldn't set up animation for \"%s\"; showing it as a still image.\n", fname);
+        free_anim(anim);
+        return NULL;
+    }
+
+    anim->frames[0].state = ANIMFRAME_UPLOADED;
+    anim->frames[0].delayms = delayms;
+    anim->display_slot = 0;
+    anim->shown_slot = 0;
+    anim->next_sequence = 1;
+    anim->next_frame_ticks = SDL_GetTicks() + delayms;
+    retval->anim = anim;
+
+    for (int i = 0; i < numthreads; i++) {
+        anim->threads[anim->numthreads] = SDL_CreateThread(anim_worker, "anim", anim);
+        if (anim->threads[anim->numthreads]) {
+            anim->numthreads++;
+        }
+    }
+
+    if (!anim->numthreads) {
+        fprintf(stderr, "WARNING: couldn't start animation thread for \"%s\"; showing the first frame only.\n", fname);
+    }
+
+    return retval;
+}
+
+// Big PNGs that fit in one texture decode as a pipeline: one thread inflates
+//  into a small sliding window and hands off complete rows a band at a time,
+//  another unfilters each band and converts it to RGBA, and the main thread
+//  uploads finished bands to the texture as they arrive. Peak memory is a
+//  few bands instead of several full copies of the image, and the stages
+//  overlap instead of each sweeping the whole image through the cache.
+#define PNG_BAND_SLOTS 3
+#define PNG_BAND_BYTES (64 * 1024)
+#define PNG_ZLIB_WINDOW (32 * 1024)
+#define MIN_PIPELINED_PNG_PIXELS (512 * 1024)
+
+typedef struct
+{
+    Uint8 *slots[PNG_BAND_SLOTS];
+    int firstrow[PNG_BAND_SLOTS];
+    int numrows[PNG_BAND_SLOTS];
+    int head;   // next slot to fill.
+    int count;  // slots filled and waiting to be consumed.
+    SDL_bool done;  // producer won't add any more.
+} pngbandqueue;
+
+typedef struct
+{
+    int w;
+    int h;
+    int color;  // PNG color type.
+    int depth;
+    int channels;
+    size_t stride;  // bytes per raw row, including the filter byte.
+    int rows_per_band;
+    Uint8 palette[256 * 4];
+    SDL_bool has_trans;
+    Uint16 trans[3];  // color key, already scaled like the samples it's compared to.
+    Uint8 *idata;
+    size_t idatalen;
+
+    // inflate thread only.
+    char *window;
+    size_t windowlen;
+    size_t rowpos;  // where the next undelivered row starts in the window.
+    int rows_inflated;
+    int fillslot;
+    int fillrows;
+
+    pngbandqueue raw;
+    pngbandqueue rgba;
+    SDL_mutex *lock;
+    SDL_cond *cond;
+    SDL_bool failed;  // protected by lock.
+} pngpipeline;
+
+// returns the slot to fill, or -1 if the pipeline failed.
+static int png_queue_acquire_fill(pngpipeline *png, pngbandqueue *q)
+{
+    SDL_LockMutex(png->lock);
+    while ((q->count == PNG_BAND_SLOTS) && !png->failed) {
+        SDL_CondWait(png->cond, png->lock);
+    }
+    const int retval = png->failed ? -1 : q->head;
+    SDL_UnlockMutex(png->lock);
+    return retval;
+}
+
+static void png_queue_publish(pngpipeline *png, pngbandqueue *q, const int firstrow, const int numrows)
+{
+    SDL_LockMutex(png->lock);
+    q->firstrow[q->head] = firstrow;
+    q->numrows[q->head] = numrows;
+    q->head = (q->head + 1) % PNG_BAND_SLOTS;
+    q->count++;
+    SDL_CondBroadcast(png->cond);
+    SDL_UnlockMutex(png->lock);
+}
+
+// returns the oldest filled slot, or -1 if there won't be any more.
+static int png_queue_acquire_consume(pngpipeline *png, pngbandqueue *q)
+{
+    SDL_LockMutex(png->lock);
+    while ((q->count == 0) && !q->done && !png->failed) {
+        SDL_CondWait(png->cond, png->lock);
+    }
+    const int retval = ((q->count == 0) || png->failed) ? -1 : (((q->head - q->count) + PNG_BAND_SLOTS) % PNG_BAND_SLOTS);
+    SDL_UnlockMutex(png->lock);
+    return retval;
+}
+
+static void png_queue_release(pngpipeline *png, pngbandqueue *q)
+{
+    SDL_LockMutex(png->lock);
+    q->count--;
+    SDL_CondBroadcast(png->cond);
+    SDL_UnlockMutex(png->lock);
+}
+
+static void png_pipeline_finish(pngpipeline *png, pngbandqueue *q, const SDL_bool okay)
+{
+    SDL_LockMutex(png->lock);
+    if (!okay) {
+        png->failed = SDL_TRUE;
+    }
+    q->done = SDL_TRUE;
+    SDL_CondBroadcast(png->cond);
+    SDL_UnlockMutex(png->lock);
+}
+
+// copy complete rows out of the inflate window into raw bands.
+static SDL_bool png_deliver_rows(pngpipeline *png, const Uint8 *buf, const size_t used)
+{
+    while (((png->rowpos + png->stride) <= used) && (png->rows_inflated < png->h)) {
+        if (png->fillslot < 0) {
+            png->fillslot = png_queue_acquire_fill(png, &png->raw);
+            if (png->fillslot < 0) {
+                return SDL_FALSE;
+            }
+            png->fillrows = 0;
+        }
+
+        SDL_memcpy(png->raw.slots[png->fillslot] + (png->fillrows * png->stride), buf + png->rowpos, png->stride);
+        png->rowpos += png->stride;
+        png->rows_inflated++;
+        png->fillrows++;
+
+        if ((png->fillrows == png->rows_per_band) || (png->rows_inflated == png->h)) {
+            png_queue_publish(png, &png->raw, png->rows_inflated - png->fillrows, png->fillrows);
+            png->fillslot = -1;
+        }
+    }
+
+    if (png->rows_inflated == png->h) {
+        png->rowpos = used;  // ignore anything extra at the end.
+    }
+    return SDL_TRUE;
+}
+
+// stb_image calls this when the window fills up, instead of growing it.
+static int png_pipeline_zflush(stbi__zbuf *z, char *zout, int n)
+{
+    pngpipeline *png = (pngpipeline *) z->zflush_userdata;
+    const size_t used = (size_t) (zout - z->zout_start);
+    decode_backoff();  // once per window's worth of inflated data.
+    if (!png_deliver_rows(png, (const Uint8 *) z->zout_start, used)) {
+        return 0;
+    }
+
+    // keep the last 32K, since matches can reach that far back, plus any partial row.
+    const size_t keep = SDL_max(SDL_min(used, PNG_ZLIB_WINDOW), used - png->rowpos);
+    if ((keep + n) > png->windowlen) {
+        return 0;  // shouldn't happen; the window has room for a whole stored block.
+    }
+
+    SDL_memmove(z->zout_start, zout - keep, keep);
+    png->rowpos -= used - keep;
+    z->zout = z->zout_start + keep;
+    return 1;
+}
+
+static int SDLCALL png_inflate_thread(void *data)
+{
+    pngpipeline *png = (pngpipeline *) data;
+    set_decode_thread_policy();
+    stbi__zbuf *z = (stbi__zbuf *) SDL_calloc(1, sizeof (stbi__zbuf));
+    SDL_bool okay = SDL_FALSE;
+
+    const Uint64 trace_start = trace_begin();
+    if (z) {
+        z->zbuffer = png->idata;
+        z->zbuffer_end = png->idata + png->idatalen;
+        z->zout_start = z->zout = png->window;
+        z->zout_end = png->window + png->windowlen;
+        z->zflush = png_pipeline_zflush;
+        z->zflush_userdata = png;
+        okay = stbi__parse_zlib(z, 1) ? SDL_TRUE : SDL_FALSE;
+        okay = okay && png_deliver_rows(png, (const Uint8 *) z->zout_start, (size_t) (z->zout - z->zout_start));
+        okay = okay && (png->rows_inflated == png->h);
+        SDL_free(z);
+    }
+    trace_end("png_inflate", trace_start);
+
+    png_pipeline_finish(png, &png->raw, okay);
+    return 0;
+}
+
+static void png_convert_row(const pngpipeline *png, const Uint8 *src, Uint8 *dst)
+{
+    static const Uint8 depth_scale[] = { 0, 0xFF, 0x55, 0, 0x11, 0, 0, 0, 0x01 };  // same as stb_image.
+    const int w = png->w;
+
+    if ((png->color == 0) || (png->color == 3)) {  // grayscale or palette, maybe fewer than 8 bits per pixel.
+        const int depth = png->depth;
+        const int mask = (1 << SDL_min(depth, 8)) - 1;
+        for (int x = 0; x < w; x++, dst += 4) {
+            int v, key;
+            if (depth == 16) {
+                key = (src[x * 2] << 8) | src[(x * 2) + 1];
+                v = src[x * 2];
+            } else {
+                const int bit = x * depth;
+                key = v = (src[bit >> 3] >> (8 - depth - (bit & 7))) & mask;
+            }
+
+            if (png->color == 3) {
+                SDL_memcpy(dst, &png->palette[v * 4], 4);
+            } else {
+                if (depth < 16) {
+                    key = v = v * depth_scale[depth];
+                }
+                dst[0] = dst[1] = dst[2] = (Uint8) v;
+                dst[3] = (png->has_trans && (key == png->trans[0])) ? 0 : 0xFF;
+            }
+        }
+    } else if (png->depth == 8) {
+        for (int x = 0; x < w; x++, dst += 4, src += png->channels) {
+            switch (png->color) {
+                case 2:
+                    dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+                    dst[3] = (png->has_trans && (src[0] == png->trans[0]) && (src[1] == png->trans[1]) && (src[2] == png->trans[2])) ? 0 : 0xFF;
+                    break;
+                case 4:
+                    dst[0] = dst[1] = dst[2] = src[0];
+                    dst[3] = src[1];
+                    break;
+                default:
+                    SDL_memcpy(dst, src, 4);
+                    break;
+            }
+        }
+    } else {  // 16 bits per channel; keep the high byte, like stb_image.
+        for (int x = 0; x < w; x++, dst += 4, src += png->channels * 2) {
+            switch (png->color) {
+                case 2:
+                    dst[0] = src[0]; dst[1] = src[2]; dst[2] = src[4];
+                    dst[3] = (png->has_trans && (read_be16(src) == png->trans[0]) && (read_be16(src + 2) == png->trans[1]) && (read_be16(src + 4) == png->trans[2])) ? 0 : 0xFF;
+                    break;
+                case 4:
+                    dst[0] = dst[1] = dst[2] = src[0];
+                    dst[3] = src[2];
+                    break;
+                default:
+                    dst[0] = src[0]; dst[1] = src[2]; dst[2] = src[4]; dst[3] = src[6];
+                    break;
+            }
+        }
+    }
+}
+
+static int SDLCALL png_unfilter_thread(void *data)
+{
+    pngpipeline *png = (pngpipeline *) data;
+    set_decode_thread_policy();
+    const size_t rowlen = png->stride - 1;
+    const size_t bpp = SDL_max(1, (png->channels * png->depth) / 8);
+    Uint8 *prev = (Uint8 *) SDL_calloc(1, rowlen);
+    Uint8 *cur = (Uint8 *) SDL_malloc(rowlen);
+    SDL_bool okay = (prev && cur) ? SDL_TRUE : SDL_FALSE;
+
+    while (okay) {
+        const int rawslot = png_queue_acquire_consume(png, &png->raw);
+        if (rawslot < 0) {
+            break;
+        }
+
+        const int outslot = png_queue_acquire_fill(png, &png->rgba);
+        if (outslot < 0) {
+            break;
+        }
+
+        const int numrows = png->raw.numrows[rawslot];
+        const Uint8 *raw = png->raw.slots[rawslot];
+        Uint8 *out = png->rgba.slots[outslot];
+        for (int y = 0; okay && (y < numrows); y++, raw += png->stride, out += png->w * 4) {
+            const Uint8 *in = raw + 1;
+            switch (raw[0]) {
+                case 0:  // none
+                    SDL_memcpy(cur, in, rowlen);
+                    break;
+                case 1:  // sub
+                    SDL_memcpy(cur, in, bpp);
+                    for (size_t i = bpp; i < rowlen; i++) {
+                        cur[i] = (Uint8) (in[i] + cur[i - bpp]);
+                    }
+                    break;
+                case 2:  // up
+                    for (size_t i = 0; i < rowlen; i++) {
+                        cur[i] = (Uint8) (in[i] + prev[i]);
+                    }
+                    break;
+                case 3:  // average
+                    for (size_t i = 0; i < rowlen; i++) {
+                        const int a = (i >= bpp) ? cur[i - bpp] : 0;
+                        cur[i] = (Uint8) (in[i] + ((a + prev[i]) >> 1));
+                    }
+                    break;
+                case 4:  // paeth
+                    for (size_t i = 0; i < rowlen; i++) {
+                        const int a = (i >= bpp) ? cur[i - bpp] : 0;
+                        const int b = prev[i];
+                        const int c = (i >= bpp) ? prev[i - bpp] : 0;
+                        const int p = a + b - c;
+                        const int pa = SDL_abs(p - a), pb = SDL_abs(p - b), pc = SDL_abs(p - c);
+                        cur[i] = (Uint8) (in[i] + (((pa <= pb) && (pa <= pc)) ? a : ((pb <= pc) ? b : c)));
+                    }
+                    break;
+                default:
+                    okay = SDL_FALSE;  // corrupt.
+                    break;
+            }
+
+            if (okay) {
+                png_convert_row(png, cur, out);
+                Uint8 *tmp = prev;
+                prev = cur;
+                cur = tmp;
+            }
+        }
+
+        if (okay) {
+            png_queue_publish(png, &png->rgba, png->raw.firstrow[rawslot], numrows);
+        }
+        png_queue_release(png, &png->raw);
+    }
+
+    SDL_free(prev);
+    SDL_free(cur);
+    png_pipeline_finish(png, &png->rgba, okay);
+    return 0;
+}
+
+// Returns NULL if this isn't a PNG the pipeline handles; load it the usual way then.
+static marqueeimage *load_png_pipelined(const char *fname)
+{
+    size_t buflen = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &buflen, &mapped);
+    if (!buf) {
+        return NULL;
+    } else if ((buflen < sizeof (png_signature)) || (SDL_memcmp(buf, png_signature, sizeof (png_signature)) != 0)) {
+        unmap_file(buf, buflen, mapped);
+        return NULL;
+    }
+
+    pngpipeline *png = (pngpipeline *) SDL_calloc(1, sizeof (pngpipeline));
+    if (!png) {
+        unmap_file(buf, buflen, mapped);
+        return NULL;
+    }
+
+    // find the header, palette, transparency, and how much IDAT data there is.
+    SDL_bool okay = SDL_TRUE;
+    SDL_bool have_header = SDL_FALSE;
+    SDL_bool have_end = SDL_FALSE;
+    SDL_bool have_palette = SDL_FALSE;
+    size_t pos = sizeof (png_signature);
+    Uint32 type, datalen;
+    const Uint8 *data;
+    int fitw, fith;
+    for (int i = 0; i < 256; i++) {
+        png->palette[(i * 4) + 3] = 0xFF;
+    }
+
+    while (okay && next_png_chunk(buf, buflen, &pos, &type, &data, &datalen)) {
+        if (type == PNG_CHUNK('I','H','D','R')) {
+            // only non-interlaced, standard compression and filtering.
+            okay = ((datalen == 13) && !data[10] && !data[11] && !data[12]) ? SDL_TRUE : SDL_FALSE;
+            png->w = (int) read_be32(data);
+            png->h = (int) read_be32(data + 4);
+            png->depth = data[8];
+            png->color = data[9];
+            have_header = SDL_TRUE;
+        } else if (!have_header || (type == PNG_CHUNK('C','g','B','I'))) {
+            okay = SDL_FALSE;  // broken, or an iPhone-mangled PNG; let stb_image sort it out.
+        } else if (type == PNG_CHUNK('P','L','T','E')) {
+            okay = ((datalen <= (256 * 3)) && ((datalen % 3) == 0)) ? SDL_TRUE : SDL_FALSE;
+            have_palette = SDL_TRUE;
+            for (Uint32 i = 0; okay && (i < (datalen / 3)); i++) {
+                SDL_memcpy(&png->palette[i * 4], data + (i * 3), 3);
+            }
+        } else if (type == PNG_CHUNK('t','R','N','S')) {
+            if (png->color == 3) {
+                for (Uint32 i = 0; (i < datalen) && (i < 256); i++) {
+                    png->palette[(i * 4) + 3] = data[i];
+                }
+            } else if (((png->color == 0) && (datalen == 2)) || ((png->color == 2) && (datalen == 6))) {
+                png->has_trans = SDL_TRUE;
+                for (Uint32 i = 0; i < (datalen / 2); i++) {
+                    png->trans[i] = (png->depth == 16) ? read_be16(data + (i * 2)) : (Uint16) (data[(i * 2) + 1] * ((png->color == 0) ? (0xFF / ((1 << png->depth) - 1)) : 1));
+                }
+            }
+        } else if (type == PNG_CHUNK('I','D','A','T')) {
+            png->idatalen += datalen;
+        } else if (type == PNG_CHUNK('I','E','N','D')) {
+            have_end = SDL_TRUE;
+            break;
+        } else if (!(type & 0x20000000)) {
+            okay = SDL_FALSE;  // unknown critical chunk.
+        }
+    }
+
+    switch (png->color) {
+        case 0: png->channels = 1; break;
+        case 2: png->channels = 3; break;
+        case 3: png->channels = 1; break;
+        case 4: png->channels = 2; break;
+        case 6: png->channels = 4; break;
+        default: okay = SDL_FALSE; break;
+    }
+
+    if ( !okay || !have_end || !png->idatalen || ((png->color == 3) && !have_palette) || (png->w <= 0) || (png->h <= 0) || (png->w > (1 << 24)) || (png->h > (1 << 24)) ||
+         ((png->depth != 1) && (png->depth != 2) && (png->depth != 4) && (png->depth != 8) && (png->depth != 16)) ||
+         ((png->depth < 8) && (png->color != 0) && (png->color != 3)) || ((png->depth == 16) && (png->color == 3)) ||
+         ((((Sint64) png->w) * ((Sint64) png->h)) < MIN_PIPELINED_PNG_PIXELS) || !fits_in_one_texture(png->w, png->h) ||
+         panel_fit_size(png->w, png->h, &fitw, &fith) ) {  // bands go straight to the texture; scaling needs the whole image.
+        SDL_free(png);
+        unmap_file(buf, buflen, mapped);
+        return NULL;
+    }
+
+    // glue the IDAT chunks back into one zlib stream.
+    png->idata = (Uint8 *) mem_alloc(png->idatalen, MEM_DECODE);
+    okay = png->idata ? SDL_TRUE : SDL_FALSE;
+    size_t idatapos = 0;
+    pos = sizeof (png_signature);
+    while (okay && next_png_chunk(buf, buflen, &pos, &type, &data, &datalen)) {
+        if (type == PNG_CHUNK('I','D','A','T')) {
+            SDL_memcpy(png->idata + idatapos, data, datalen);
+            idatapos += datalen;
+        }
+    }
+    unmap_file(buf, buflen, mapped);
+
+    png->stride = 1 + ((((size_t) png->w) * png->channels * png->depth) + 7) / 8;
+    png->rows_per_band = SDL_max(1, PNG_BAND_BYTES / (png->w * 4));
+    png->windowlen = PNG_ZLIB_WINDOW + png->stride + SDL_max(PNG_BAND_BYTES, 65536 + 258);
+    png->window = (char *) mem_alloc(png->windowlen, MEM_DECODE);
+    png->fillslot = -1;
+    png->lock = SDL_CreateMutex();
+    png->cond = SDL_CreateCond();
+    okay = okay && png->window && png->lock && png->cond;
+    for (int i = 0; okay && (i < PNG_BAND_SLOTS); i++) {
+        png->raw.slots[i] = (Uint8 *) mem_alloc(png->stride * png->rows_per_band, MEM_DECODE);
+        png->rgba.slots[i] = (Uint8 *) mem_alloc(((size_t) png->w) * 4 * png->rows_per_band, MEM_DECODE);
+        okay = (png->raw.slots[i] && png->rgba.slots[i]) ? SDL_TRUE : SDL_FALSE;
+    }
+
+    SDL_Texture *tex = okay ? create_image_texture(png->w, png->h) : NULL;
+    SDL_Thread *inflater = tex ? SDL_CreateThread(png_inflate_thread, "pnginflate", png) : NULL;
+    SDL_Thread *unfilterer = inflater ? SDL_CreateThread(png_unfilter_thread, "pngunfilter", png) : NULL;
+
+    // upload bands as they come in.
+    int rows_uploaded = 0;
+    if (unfilterer) {
+        int slot;
+        while ((slot = png_queue_acquire_consume(png, &png->rgba)) >= 0) {
+            const SDL_Rect rect = { 0, png->rgba.firstrow[slot], png->w, png->rgba.numrows[slot] };
+            const Uint64 trace_start = trace_begin();
+            SDL_UpdateTexture(tex, &rect, png->rgba.slots[slot], png->w * 4);
+            trace_end("SDL_UpdateTexture", trace_start);
+            PROBE3(texture_upload, rect.w, rect.h, rect.w * rect.h * 4);
+            rows_uploaded += rect.h;
+            png_queue_release(png, &png->rgba);
+        }
+    } else if (inflater) {
+        png_pipeline_finish(png, &png->rgba, SDL_FALSE);  // make the inflate thread give up.
+    }
+
+    if (inflater) {
+        SDL_WaitThread(inflater, NULL);
+    }
+    if (unfilterer) {
+        SDL_WaitThread(unfilterer, NULL);
+    }
+
+    marqueeimage *retval = NULL;
+    if (tex && !png->failed && (rows_uploaded == png->h)) {
+        retval = image_from_texture(tex, png->w, png->h);
+    } else if (tex) {
+        release_texture(tex);
+    }
+
+    for (int i = 0; i < PNG_BAND_SLOTS; i++) {
+        SDL_free(png->raw.slots[i]);
+        SDL_free(png->rgba.slots[i]);
+    }
+    SDL_DestroyCond(png->cond);
+    SDL_DestroyMutex(png->lock);
+    SDL_free(png->window);
+    SDL_free(png->idata);
+    SDL_free(png);
+    return retval;
+}
+
+// allow_preview means the caller will call update_refine() until the full image is in.
+static marqueeimage *load_image_by_type(const char *fname, const SDL_bool allow_preview)
+{
+    if (!fname) {
+        return NULL;
+    }
+
+    const char *ext = SDL_strrchr(fname, '.');
+    if (ext && (SDL_strcasecmp(ext, ".svg") == 0)) {
+        return load_svg_image(fname, allow_preview);
+    } else if (anim_budget_mb > 0) {
+        marqueeimage *retval = load_animated_image(fname);
+        if (retval) {
+            return retval;
+        }
+    }
+
+    if (ext && (SDL_strcasecmp(ext, ".png") == 0)) {
+        marqueeimage *retval = load_png_pipelined(fname);
+        if (retval) {
+            return retval;
+        }
+    } else if (allow_preview && ext && ((SDL_strcasecmp(ext, ".jpg") == 0) || (SDL_strcasecmp(ext, ".jpeg") == 0))) {
+        marqueeimage *retval = load_jpeg_preview(fname);
+        if (retval) {
+            return retval;
+        }
+    }
+
+    if (use_streaming_textures) {
+        return load_image_streaming(fname);
+    }
+    return load_stbi_image(fname);
+}
+
+static marqueeimage *load_image(const char *fname, const SDL_bool allow_preview)
+{
+    PROBE1(load_image_start, fname);
+    const Uint64 trace_start = trace_begin();
+    marqueeimage *retval = load_image_by_type(fname, allow_preview);
+    trace_end("load_image", trace_start);
+
+    #if USE_SDT
+    if (fname) {
+        const char *ext = SDL_strrchr(fname, '.');
+        const char *format = retval && retval->anim ? "anim" : (ext ? ext + 1 : "");
+        struct stat statbuf;
+        const Sint64 bytes = (stat(fname, &statbuf) == 0) ? (Sint64) statbuf.st_size : -1;  // one syscall per marquee change; only when probes are built in.
+        PROBE5(load_image_end, fname, format, retval ? retval->w : 0, retval ? retval->h : 0, bytes);
+    }
+    #endif
+
+    return retval;
+}
+
+
+// Without a GPU, SDL's software renderer blends every fade frame with a
+//  generic per-pixel loop on one core, and fades stutter. Instead, we render
+//  each image once, at screen size, into a buffer, and each fade frame is
+//  just a crossfade of those two buffers straight into the window surface
+//  (which is what the software renderer draws to anyhow), using the best
+//  SIMD kernel the CPU has, split across a few threads. Animations and
+//  full-res swaps during a fade just re-render the buffer that changed.
+#define MAX_COMPOSITOR_THREADS 4
+#define COMPOSITOR_BANDS_PER_THREAD 4
+
+typedef void (*crossfade_fn)(Uint8 *dst, const Uint8 *a, const Uint8 *b, const size_t len, const int t);
+
+typedef struct
+{
+    SDL_bool enabled;
+    crossfade_fn crossfade;
+    const char *crossfade_name;
+    Uint8 *from;  // screen-sized snapshots, in the window surface's format, w*4 pitch.
+    Uint8 *to;
+    int w;
+    int h;
+
+    // per-frame job; workers grab bands of rows until they run out.
+    Uint8 *dst;
+    int dstpitch;
+    int weight;
+    int numbands;
+    SDL_atomic_t next_band;
+    int numthreads;
+    SDL_Thread *threads[MAX_COMPOSITOR_THREADS];
+    SDL_sem *start;
+    SDL_sem *done;
+    SDL_atomic_t quit;
+} softcompositor;
+
+static softcompositor compositor;
+
+// all kernels compute (a * (256 - t) + b * t) >> 8 per byte, so they match exactly. t is 1..255.
+static void crossfade_scalar(Uint8 *dst, const Uint8 *a, const Uint8 *b, const size_t len, const int t)
+{
+    const int ta = 256 - t;
+    for (size_t i = 0; i < len; i++) {
+        dst[i] = (Uint8) (((a[i] * ta) + (b[i] * t)) >> 8);
+    }
+}
+
+#if USE_SSE2_CROSSFADE
+static void crossfade_sse2(Uint8 *dst, const Uint8 *a, const Uint8 *b, const size_t len, const int t)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i wa = _mm_set1_epi16((short) (256 - t));
+    const __m128i wb = _mm_set1_epi16((short) t);
+    size_t i = 0;
+    for (; (i + 16) <= len; i += 16) {
+        const __m128i va = _mm_loadu_si128((const __m128i *) (a + i));
+        const __m128i vb = _mm_loadu_si128((const __m128i *) (b + i));
+        const __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+        const __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+    }
+    crossfade_scalar(dst + i, a + i, b + i, len - i, t);
+}
+#endif
+
+#if USE_AVX2_CROSSFADE
+__attribute__((target("avx2")))
+static void crossfade_avx2(Uint8 *dst, const Uint8 *a, const Uint8 *b, const size_t len, const int t)
+{
+    // unpack and pack both work within 128-bit lanes, so the bytes come back out in order.
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i wa = _mm256_set1_epi16((short) (256 - t));
+    const __m256i wb = _mm256_set1_epi16((short) t);
+    size_t i = 0;
+    for (; (i + 32) <= len; i += 32) {
+        const __m256i va = _mm256_loadu_si256((const __m256i *) (a + i));
+        const __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i));
+        const __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), wa), _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), wb));
+        const __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), wa), _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), wb));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+    }
+    crossfade_scalar(dst + i, a + i, b + i, len - i, t);
+}
+#endif
+
+#if USE_NEON_CROSSFADE
+static void crossfade_neon(Uint8 *dst, const Uint8 *a, const Uint8 *b, const size_t len, const int t)
+{
+    const uint8x8_t wa = vdup_n_u8((Uint8) (256 - t));
+    const uint8x8_t wb = vdup_n_u8((Uint8) t);
+    size_t i = 0;
+    for (; (i + 16) <= len; i += 16) {
+        const uint8x16_t va = vld1q_u8(a + i);
+        const uint8x16_t vb = vld1q_u8(b + i);
+        const uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa), vget_low_u8(vb), wb);
+        const uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa), vget_high_u8(vb), wb);
+        vst1q_u8(dst + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+    }
+    crossfade_scalar(dst + i, a + i, b + i, len - i, t);
+}
+#endif
+
+static void crossfade_bands(void)
+{
+    const size_t rowlen = ((size_t) compositor.w) * 4;
+    const int rows_per_band = (compositor.h + (compositor.numbands - 1)) / compositor.numbands;
+    int band;
+    while ((band = SDL_AtomicAdd(&compositor.next_band, 1)) < compositor.numbands) {
+        const int y1 = band * rows_per_band;
+        const int y2 = SDL_min(y1 + rows_per_band, compositor.h);
+        for (int y = y1; y < y2; y++) {
+            const size_t offset = ((size_t) y) * rowlen;
+            Uint8 *dst = compositor.dst + (((size_t) y) * compositor.dstpitch);
+            if (compositor.weight <= 0) {
+                SDL_memcpy(dst, compositor.from + offset, rowlen);
+            } else if (compositor.weight >= 256) {
+                SDL_memcpy(dst, compositor.to + offset, rowlen);
+            } else {
+                compositor.crossfade(dst, compositor.from + offset, compositor.to + offset, rowlen, compositor.weight);
+            }
+        }
+    }
+}
+
+static int SDLCALL compositor_thread(void *data)
+{
+    while (SDL_TRUE) {
+        SDL_SemWait(compositor.start);
+        if (SDL_AtomicGet(&compositor.quit)) {
+            break;
+        }
+        crossfade_bands();
+        SDL_SemPost(compositor.done);
+    }
+    return 0;
+}
+
+static void init_compositor(void)
+{
+    SDL_RendererInfo info;
+    SDL_zero(info);
+    SDL_GetRendererInfo(renderer, &info);
+    if (!force_software && !(info.flags & SDL_RENDERER_SOFTWARE)) {
+        return;  // the GPU does fades just fine.
+    }
+
+    compositor.crossfade = crossfade_scalar;
+    compositor.crossfade_name = "scalar";
+    #if USE_SSE2_CROSSFADE
+    if (SDL_HasSSE2()) {
+        compositor.crossfade = crossfade_sse2;
+        compositor.crossfade_name = "SSE2";
+    }
+    #endif
+    #if USE_AVX2_CROSSFADE
+    if (SDL_HasAVX2()) {
+        compositor.crossfade = crossfade_avx2;
+        compositor.crossfade_name = "AVX2";
+    }
+    #endif
+    #if USE_NEON_CROSSFADE
+    if (SDL_HasNEON()) {
+        compositor.crossfade = crossfade_neon;
+        compositor.crossfade_name = "NEON";
+    }
+    #endif
+
+    // the main thread does its share too.
+    const int numthreads = SDL_max(SDL_min(SDL_GetCPUCount(), MAX_COMPOSITOR_THREADS), 1);
+    compositor.start = SDL_CreateSemaphore(0);
+    compositor.done = SDL_CreateSemaphore(0);
+    SDL_AtomicSet(&compositor.quit, 0);
+    for (int i = 1; compositor.start && compositor.done && (i < numthreads); i++) {
+        SDL_Thread *thread = SDL_CreateThread(compositor_thread, "compositor", NULL);
+        if (!thread) {
+            break;
+        }
+        compositor.threads[compositor.numthreads++] = thread;
+    }
+    compositor.numbands = (compositor.numthreads + 1) * COMPOSITOR_BANDS_PER_THREAD;
+    compositor.enabled = SDL_TRUE;
+    printf("Software compositor: %s crossfade, %d thread(s)\n", compositor.crossfade_name, compositor.numthreads + 1);
+}
+
+static void deinit_compositor(void)
+{
+    SDL_AtomicSet(&compositor.quit, 1);
+    for (int i = 0; i < compositor.numthreads; i++) {
+        SDL_SemPost(compositor.start);
+    }
+    for (int i = 0; i < compositor.numthreads; i++) {
+        SDL_WaitThread(compositor.threads[i], NULL);
+    }
+    if (compositor.start) {
+        SDL_DestroySemaphore(compositor.start);
+    }
+    if (compositor.done) {
+        SDL_DestroySemaphore(compositor.done);
+    }
+    SDL_free(compositor.from);
+    SDL_free(compositor.to);
+    SDL_zero(compositor);
+}
+
+// render one image alone, at screen size, and read it back.
+static SDL_bool snapshot_image(const marqueeimage *img, Uint8 *dst, const Uint32 format, const int pitch)
+{
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+    SDL_RenderClear(renderer);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    if (img) {
+        draw_image(img, 255);
+    }
+    SDL_RenderSetLogicalSize(renderer, 0, 0);  // read the whole output, letterboxing included.
+    const SDL_bool retval = (SDL_RenderReadPixels(renderer, NULL, format, dst, pitch) == 0) ? SDL_TRUE : SDL_FALSE;
+    SDL_RenderSetLogicalSize(renderer, screenw, screenh);
+    return retval;
+}
+
+// Returns SDL_FALSE if the fade should just go through the renderer instead.
+static SDL_bool begin_composited_fade(const marqueeimage *from, const marqueeimage *to)
+{
+    SDL_Surface *surface = compositor.enabled ? SDL_GetWindowSurface(window) : NULL;
+    if (!surface || (surface->format->BytesPerPixel != 4)) {
+        return SDL_FALSE;
+    }
+
+    int w = 0, h = 0;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+    if ((w != surface->w) || (h != surface->h)) {
+        return SDL_FALSE;
+    }
+
+    if ((w != compositor.w) || (h != compositor.h) || !compositor.from || !compositor.to) {
+        const size_t len = ((size_t) w) * ((size_t) h) * 4;
+        SDL_free(compositor.from);
+        SDL_free(compositor.to);
+        compositor.from = (Uint8 *) mem_alloc(len, MEM_COMPOSITOR);
+        compositor.to = (Uint8 *) mem_alloc(len, MEM_COMPOSITOR);
+        compositor.w = w;
+        compositor.h = h;
+        if (!compositor.from || !compositor.to) {
+            SDL_free(compositor.from);
+            SDL_free(compositor.to);
+            compositor.from = compositor.to = NULL;
+            return SDL_FALSE;
+        }
+    }
+
+    const Uint32 format = surface->format->format;
+    return (snapshot_image(from, compositor.from, format, w * 4) && snapshot_image(to, compositor.to, format, w * 4)) ? SDL_TRUE : SDL_FALSE;
+}
+
+// Blends the snapshots into the window surface; the caller presents it.
+static void composite_fade_frame(const float percent)
+{
+    SDL_Surface *surface = SDL_GetWindowSurface(window);
+    if (!surface || (SDL_MUSTLOCK(surface) && (SDL_LockSurface(surface) < 0))) {
+        return;
+    }
+
+    const Uint64 trace_start = trace_begin();
+    compositor.dst = (Uint8 *) surface->pixels;
+    compositor.dstpitch = surface->pitch;
+    compositor.weight = (int) (percent * 256.0f);
+    SDL_AtomicSet(&compositor.next_band, 0);
+    for (int i = 0; i < compositor.numthreads; i++) {
+        SDL_SemPost(compositor.start);
+    }
+    crossfade_bands();
+    for (int i = 0; i < compositor.numthreads; i++) {
+        SDL_SemWait(compositor.done);
+    }
+    trace_end("composite_fade_frame", trace_start);
+
+    if (SDL_MUSTLOCK(surface)) {
+        SDL_UnlockSurface(surface);
+    }
+}
+
+// main thread, outside of fades. Lets go of everything that's only kept
+//  around to make the next marquee change faster.
+static void release_memory_caches(void)
+{
+    destroy_texture_pool();
+    SDL_free(compositor.from);  // begin_composited_fade() makes new ones when it needs them.
+    SDL_free(compositor.to);
+    compositor.from = compositor.to = NULL;
+}
+
+// Roughly what load_image() needs at full quality: the decoded pixels and
+//  the texture they go into. 0 if we can't tell; SVGs raster at screen size.
+static size_t estimate_image_bytes(const char *fname)
+{
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = map_file(fname, &len, &mapped);  // load_image() maps it again right after; it's in the page cache now.
+    int w = 0, h = 0, n = 0;
+    const SDL_bool okay = (buf && stbi_info_from_memory(buf, (int) len, &w, &h, &n)) ? SDL_TRUE : SDL_FALSE;
+    if (buf) {
+        unmap_file(buf, len, mapped);
+    }
+    return okay ? (((size_t) w) * ((size_t) h) * 4 * 2) : 0;
+}
+
+static SDL_bool fits_memory_budget(const size_t needed)
+{
+    return (!mem_budget_mb || ((((Sint64) SDL_AtomicGet(&mem_total)) + ((Sint64) needed)) <= (((Sint64) mem_budget_mb) * 1024 * 1024))) ? SDL_TRUE : SDL_FALSE;
+}
+
+static void set_new_image(const char *fname)
+{
+    printf("Setting new image \"%s\"\n", fname);
+
+    // the old and new images (and whatever decodes the new one) are about to
+    //  coexist, so make room first, and decode smaller if that isn't enough.
+    const size_t needed = mem_budget_mb ? estimate_image_bytes(fname) : 0;
+    if (mem_budget_mb && ((memory_budget_percent() >= MEM_BUDGET_REDUCED) || !fits_memory_budget(needed))) {
+        release_memory_caches();
+        quality_ticks = 0;  // check again now that we've freed up what we can.
+    }
+    update_quality();
+    const SDL_bool over_budget = !fits_memory_budget(needed);
+    if (over_budget && (quality != QUALITY_MINIMAL)) {
+        printf("Quality: minimal (\"%s\" needs about %uMB, more than --membudget has left)\n", fname, (unsigned int) (needed / (1024 * 1024)));
+        quality = QUALITY_MINIMAL;  // update_quality() will put it back.
+    }
+    loaded_degraded = SDL_FALSE;
+    marqueeimage *newimg = load_image(fname, SDL_TRUE);
+    const SDL_bool degraded = loaded_degraded;
+    const Uint32 fade = (quality >= QUALITY_MINIMAL) ? 0 : fadems;  // just cut to it.
+    const SDL_bool composited = fade && begin_composited_fade(current_image, newimg);
+    const Uint32 startms = SDL_GetTicks();
+    const Uint32 timeout = startms + fade;
+    int fadeframes = 0;
+    PROBE3(fade_start, fname, fade, composited);
+    for (Uint32 now = startms; !SDL_TICKS_PASSED(now, timeout); now = SDL_GetTicks(), fadeframes++) {
+        const Uint64 trace_start = trace_begin();
+        const float unclamped_percent = ((float) (now - startms)) / ((float) fade);
+        const float percent = SDL_max(0.0f, SDL_min(unclamped_percent, 1.0f));
+
+        const SDL_bool from_changed = update_animation(current_image) | update_refine(current_image);
+        const SDL_bool to_changed = update_animation(newimg) | update_refine(newimg);
+
+        if (composited) {
+            const Uint32 format = SDL_GetWindowSurface(window)->format->format;
+            if (from_changed) {
+                snapshot_image(current_image, compositor.from, format, compositor.w * 4);
+            }
+            if (to_changed) {
+                snapshot_image(newimg, compositor.to, format, compositor.w * 4);
+            }
+            composite_fade_frame(percent);
+        } else {
+            SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
+            SDL_RenderClear(renderer);
+            SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+
+            if (current_image) {  // fading out
+                draw_image(current_image, (Uint8) (255.0f * (1.0f - percent)));
+            }
+
+            if (newimg) {  // fading in
+                draw_image(newimg, (Uint8) (255.0f * percent));
+            }
+        }
+
+        // !!! FIXME: move this loop to state variables and make it part of
+        // !!! FIXME:  redraw_window() instead of shoving a handle_redraw
+        // !!! FIXME:  call in here.
+        if (handle_redraw) {
+            handle_redraw();
+        }
+
+        present_frame();  // at reduced quality, this skips every other refresh.
+        trace_end("fade_frame", trace_start);
+    }
+
+    marqueeimage *destroyme = current_image;
+    current_image = newimg;
+    current_image_degraded = degraded && !over_budget;  // reloading it won't help if it'll never fit.
+    SDL_free(current_image_fname);
+    current_image_fname = fname ? SDL_strdup(fname) : NULL;
+
+    // one last time, with no fade at all.
+    redraw_window();
+    PROBE3(fade_end, fname, SDL_GetTicks() - startms, fadeframes);
+
+    free_image(destroyme);
+    marquee_snapshot_pending = SDL_TRUE;
+}
+
+static void report_boot_time(const char *what)
+{
+    printf("Boot: %s after %.1fms\n", what, ticks_to_ms(SDL_GetPerformanceCounter() - boot_ticks));
+}
+
+// The last marquee shown is saved as raw pixels, already at the output's
+//  size, so the next boot can put it on the screen without decoding anything.
+#define MARQUEE_SNAPSHOT_MAGIC 0x3153514D  // "MQS1"
+typedef struct
+{
+    Uint32 magic;
+    Uint32 format;
+    Uint32 w;
+    Uint32 h;
+} marqueesnapshotheader;
+
+typedef struct
+{
+    char *path;
+    marqueesnapshotheader header;
+    Uint8 *pixels;
+} marqueesnapshotjob;
+
+static char *marquee_snapshot_path(void)
+{
+    char *prefdir = SDL_GetPrefPath("icculus", "arcade1up-lcd-marquee");
+    if (!prefdir) {
+        return NULL;
+    }
+    const size_t len = SDL_strlen(prefdir) + 32;
+    char *retval = (char *) SDL_malloc(len);
+    if (retval) {
+        SDL_snprintf(retval, len, "%slastmarquee.raw", prefdir);
+    }
+    SDL_free(prefdir);
+    return retval;
+}
+
+// SD cards can take a while to write a few megabytes, so this is its own thread.
+static int SDLCALL marquee_snapshot_thread(void *data)
+{
+    marqueesnapshotjob *job = (marqueesnapshotjob *) data;
+    const size_t len = ((size_t) job->header.w) * job->header.h * 4;
+    const size_t tmplen = SDL_strlen(job->path) + 8;
+    char *tmppath = (char *) SDL_malloc(tmplen);
+    SDL_RWops *rw = NULL;
+
+    if (tmppath) {
+        SDL_snprintf(tmppath, tmplen, "%s.tmp", job->path);
+        rw = SDL_RWFromFile(tmppath, "wb");
+    }
+
+    if (rw) {
+        SDL_bool okay = ((SDL_RWwrite(rw, &job->header, sizeof (job->header), 1) == 1) && (SDL_RWwrite(rw, job->pixels, len, 1) == 1)) ? SDL_TRUE : SDL_FALSE;
+        if (SDL_RWclose(rw) < 0) {
+            okay = SDL_FALSE;
+        }
+        // write it next to the old one and rename it over, so losing power halfway through never leaves a torn snapshot.
+        if (!okay || (rename(tmppath, job->path) == -1)) {
+            fprintf(stderr, "WARNING: Couldn't save marquee snapshot to \"%s\"\n", job->path);
+            remove(tmppath);
+        }
+    }
+
+    SDL_free(tmppath);
+    SDL_free(job->pixels);
+    SDL_free(job->path);
+    SDL_free(job);
+    SDL_AtomicSet(&marquee_snapshot_done, 1);
+    return 0;
+}
+
+static void save_marquee_snapshot(void)
+{
+    if (marquee_snapshot_writer) {
+        if (!SDL_AtomicGet(&marquee_snapshot_done)) {
+            return;  // still writing the last one; try again later.
+        }
+        SDL_WaitThread(marquee_snapshot_writer, NULL);
+        marquee_snapshot_writer = NULL;
+    }
+
+    marquee_snapshot_pending = SDL_FALSE;
+
+    int w = 0, h = 0;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+    marqueesnapshotjob *job = (marqueesnapshotjob *) SDL_calloc(1, sizeof (marqueesnapshotjob));
+    if (job) {
+        job->path = marquee_snapshot_path();
+        job->pixels = (Uint8 *) SDL_malloc(((size_t) w) * h * 4);
+    }
+
+    // this draws into the backbuffer, but the next frame clears and redraws everything anyhow.
+    if (!job || !job->path || !job->pixels || !snapshot_image(current_image, job->pixels, SDL_PIXELFORMAT_ABGR8888, w * 4)) {
+        if (job) {
+            SDL_free(job->path);
+            SDL_free(job->pixels);
+            SDL_free(job);
+        }
+        return;
+    }
+
+    job->header.magic = MARQUEE_SNAPSHOT_MAGIC;
+    job->header.format = SDL_PIXELFORMAT_ABGR8888;
+    job->header.w = (Uint32) w;
+    job->header.h = (Uint32) h;
+    SDL_AtomicSet(&marquee_snapshot_done, 0);
+    marquee_snapshot_writer = SDL_CreateThread(marquee_snapshot_thread, "snapshot", job);
+    if (!marquee_snapshot_writer) {
+        marquee_snapshot_thread(job);  // just do it here, then.
+    }
+}
+
+// Puts the last marquee from the previous run on the screen. The pixels are
+//  already at the output's size, so this is just a texture upload.
+static SDL_bool restore_marquee_snapshot(void)
+{
+    char *path = marquee_snapshot_path();
+    size_t len = 0;
+    SDL_bool mapped = SDL_FALSE;
+    Uint8 *buf = path ? map_file(path, &len, &mapped) : NULL;
+    if (!buf) {
+        SDL_free(path);
+        return SDL_FALSE;
+    }
+
+    int w = 0, h = 0;
+    SDL_GetRendererOutputSize(renderer, &w, &h);
+
+    marqueeimage *img = NULL;
+    marqueesnapshotheader header;
+    if (len >= sizeof (header)) {
+        SDL_memcpy(&header, buf, sizeof (header));
+        if ( (header.magic == MARQUEE_SNAPSHOT_MAGIC) && (header.format == SDL_PIXELFORMAT_ABGR8888) &&
+             (header.w == (Uint32) w) && (header.h == (Uint32) h) &&
+             (len == (sizeof (header) + (((size_t) w) * h * 4))) ) {
+            img = image_from_pixels(path, buf + sizeof (header), w, h, w * 4);
+        }
+    }
+
+    unmap_file(buf, len, mapped);
+    SDL_free(path);
+
+    if (!img) {
+        return SDL_FALSE;  // a different display, or a bad file; decode the start image instead.
+    }
+
+    current_image = img;
+    redraw_window();
+    return SDL_TRUE;
+}
+
+static void lock_input(void)
+{
+    if (input_lock) {
+        SDL_LockMutex(input_lock);
+    }
+}
+
+static void unlock_input(void)
+{
+    if (input_lock) {
+        SDL_UnlockMutex(input_lock);
+    }
+}
+
+static void wake_main_thread(void)
+{
+    if (input_wake_event && (SDL_ThreadID() != main_thread_id)) {
+        SDL_Event e;
+        SDL_zero(e);
+        e.type = input_wake_event;
+        SDL_PushEvent(&e);
+    }
+}
+
+static void request_redraw(void)
+{
+    SDL_AtomicSet(&redraw_request, 1);
+    wake_main_thread();
+}
+
+// call whenever the keyboard's look changes (layer or pressed keys).
+static void keyboard_changed(void)
+{
+    SDL_AtomicIncRef(&keyboard_serial);
+}
+
+static void set_keyboard_layer(const int idx)
+{
+    const keyboardlayer *layer = &keyboard_layers[idx];
+    keyboard_texture = layer->texture;
+    keyinfo = layer->keys;
+    keyboard_hitgrid = layer->hitgrid;
+    keyboard_hitgrid_h = layer->hitgrid_h;
+    keyboardh = layer->h;
+    // keys still held from the old layer stay pressed until their fingers
+    //  come up (pressed_keys knows how to release them), but they aren't
+    //  keys on this layer.
+    SDL_memset(key_pressed_slot, 0xFF, sizeof (key_pressed_slot));
+    keyboard_changed();
+}
+
+static void animate_keyboard_slide(const SDL_bool slide_in)
+{
+    handle_redraw = handle_redraw_keyboard;
+    keyboard_slide_percent = slide_in ? 0.0f : 1.0f;
+
+    const Uint32 startms = SDL_GetTicks();
+    const Uint32 timeout = startms + keyboard_slide_ms;
+    for (Uint32 now = startms; !SDL_TICKS_PASSED(now, timeout); now = SDL_GetTicks()) {
+        const float unclamped_percent = ((float) (now - startms)) / ((float) keyboard_slide_ms);
+        const float percent = SDL_max(0.0f, SDL_min(unclamped_percent, 1.0f));
+        keyboard_slide_percent = slide_in ? percent : (1.0f - percent);
+        redraw_window();
+    }
+
+    keyboard_slide_percent = slide_in ? 1.0f : 0.0f;
+    redraw_window();
+    if (!slide_in) {
+        handle_redraw = NULL;
+    }
+}
+
+// These switch touch handling over right away; the main thread animates the slide.
+static void slide_in_keyboard(void)
+{
+    if (!keyboard_texture) {
+        return;  // no keyboard for you.
+    }
+
+    //printf("Sliding in keyboard!\n");
+
+    set_keyboard_layer(0);
+
+    // Send keyup events for anything that fingers are still touching.
+    if (button_finger_down) {
+        send_mouse_button(SDL_FALSE);
+    }
+    motion_finger_down = SDL_FALSE;
+    motion_finger = 0;
+    button_finger_down = SDL_FALSE;
+    button_finger = 0;
+
+    keyboard_slide_cooldown = SDL_TRUE;
+    handle_fingerup = handle_fingerup_keyboard;
+    handle_fingerdown = handle_fingerdown_keyboard;
+    handle_fingermotion = handle_fingermotion_keyboard;
+    SDL_AtomicSet(&keyboard_slide_request, KEYBOARD_SLIDE_IN);
+    wake_main_thread();
+}
+
+#if USE_LIBEVDEV
+static void write_uinput_key(const unsigned int scancode, const int pressed)
+{
+    if (uidev_keyboard) {
+        PROBE2(uinput_key, scancode, pressed);
+        libevdev_uinput_write_event(uidev_keyboard, EV_KEY, scancode, pressed);
+        libevdev_uinput_write_event(uidev_keyboard, EV_SYN, SYN_REPORT, 0);
+    }
+}
+#endif
+
+static void slide_out_keyboard(void)
+{
+    //printf("Sliding out keyboard!\n");
+
+    // Send keyup events for anything that fingers are still touching.
+    for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
+        if (pressed_keys[i].pressed) {
+            //printf("Released virtual keyboard key %u\n", pressed_keys[i].scancode);
+            pressed_keys[i].pressed = SDL_FALSE;
+            key_pressed_slot[pressed_keys[i].keyindex] = -1;
+            keyboard_changed();
+
+            #if USE_LIBEVDEV
+            write_uinput_key(pressed_keys[i].scancode, 0);
+            #endif
+        }
+    }
+
+    keyboard_slide_cooldown = SDL_TRUE;
+    handle_fingerup = handle_fingerup_mouse;
+    handle_fingerdown = handle_fingerdown_mouse;
+    handle_fingermotion = handle_fingermotion_mouse;
+    SDL_AtomicSet(&keyboard_slide_request, KEYBOARD_SLIDE_OUT);
+    wake_main_thread();
+}
+
+
+#if USE_LIBEVDEV
+// one write() for a whole report, instead of a syscall per event.
+static void write_uinput_events(const struct libevdev_uinput *uidev, const struct input_event *events, const size_t count)
+{
+    const Uint8 *ptr = (const Uint8 *) events;
+    size_t remaining = count * sizeof (struct input_event);
+    const int fd = libevdev_uinput_get_fd(uidev);
+    PROBE2(uinput_write, events, (int) count);
+    while (remaining > 0) {
+        const ssize_t rc = write(fd, ptr, remaining);
+        if (rc > 0) {
+            ptr += rc;
+            remaining -= (size_t) rc;
+        } else if ((rc < 0) && (errno != EINTR)) {
+            break;  // nothing useful to do about it.
+        }
+    }
+}
+
+static void set_input_event(struct input_event *ev, const unsigned int type, const unsigned int code, const int value)
+{
+    SDL_zerop(ev);
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
+}
+#endif
+
+// Motion piles up here until the end of an input frame (or until a button
+//  changes, so clicks land where they should), then goes out as a single
+//  report. Whatever fraction of a pixel is left over carries into the next one.
+static void flush_mouse_motion(void)
+{
+    const int x = (int) mouse_motion_x;
+    const int y = (int) mouse_motion_y;
+    if (!x && !y) {
+        return;
+    }
+
+    mouse_motion_x -= (float) x;
+    mouse_motion_y -= (float) y;
+
+    #if USE_LIBEVDEV
+    if (uidev_mouse) {
+        struct input_event events[3];
+        size_t count = 0;
+        if (x) {
+            set_input_event(&events[count++], EV_REL, REL_X, x);
+        }
+        if (y) {
+            set_input_event(&events[count++], EV_REL, REL_Y, y);
+        }
+        set_input_event(&events[count++], EV_SYN, SYN_REPORT, 0);
+        write_uinput_events(uidev_mouse, events, count);
+    }
+    #endif
+}
+
+static void send_mouse_button(const SDL_bool pressed)
+{
+    flush_mouse_motion();
+    #if USE_LIBEVDEV
+    if (uidev_mouse) {
+        struct input_event events[2];
+        set_input_event(&events[0], EV_KEY, BTN_LEFT, pressed ? 1 : 0);
+        set_input_event(&events[1], EV_SYN, SYN_REPORT, 0);
+        write_uinput_events(uidev_mouse, events, SDL_arraysize(events));
+    }
+    #endif
+}
+
+static void handle_fingerdown_mouse(const SDL_TouchFingerEvent *e)
+{
+    if (SDL_AtomicGet(&fingers_down) == 4) {
+        slide_in_keyboard();
+    } else if (!motion_finger_down) {
+        //printf("FINGERDOWN: This is the motion finger.\n");
+        motion_finger = e->fingerId;
+        motion_finger_down = SDL_TRUE;
+        mouse_motion_x = mouse_motion_y = 0.0f;
+    } else if (!button_finger_down) {
+        //printf("FINGERDOWN: This is the button finger.\n");
+        button_finger = e->fingerId;
+        button_finger_down = SDL_TRUE;
+        send_mouse_button(SDL_TRUE);
+    }
+}
+
+static void handle_fingerup_mouse(const SDL_TouchFingerEvent *e)
+{
+    if (motion_finger_down && (e->fingerId == motion_finger)) {
+        //printf("FINGERUP: This is the motion finger.\n");
+        motion_finger_down = SDL_FALSE;
+        motion_finger = 0;
+    } else if (button_finger_down && (e->fingerId == button_finger)) {
+        //printf("FINGERUP: This is the button finger.\n");
+        button_finger_down = SDL_FALSE;
+        button_finger = 0;
+        send_mouse_button(SDL_FALSE);
+    }
+}
+
+static void handle_fingermotion_mouse(const SDL_TouchFingerEvent *e)
+{
+    if (!motion_finger_down || (e->fingerId != motion_finger)) {
+        return;
+    }
 
-        // find the key we're touching
-        for (int i = 0; i < SDL_arraysize(keyinfo); i++) {
-            if (SDL_PointInRect(&pt, &keyinfo[i].rect)) {
-                keyindex = i;
-                break;
-            }
-        }
+    // flush_mouse_motion() sends this at the end of the input frame.
+    mouse_motion_x += ((float) screenw) * e->dx;
+    mouse_motion_y += ((float) screenh) * e->dy;
+}
+
+// Key rects are in the layout's images, but touches are in screen space,
+//  so build_keyboard_hitgrid() bakes a grid at screen scale where each cell
+//  holds the key under its center, and a hit-test is just an array lookup.
+#define KEYBOARD_HIT_CELL 2  // in screen pixels.
+#define KEYBOARD_SCREEN_Y 0  // top of the keyboard when it's all the way in; see handle_redraw_keyboard().
+
+static int keyboard_hit_test(const int x, const int y)
+{
+    const int cellx = x / KEYBOARD_HIT_CELL;
+    const int celly = (y - KEYBOARD_SCREEN_Y) / KEYBOARD_HIT_CELL;
+    if (!keyboard_hitgrid || (x < 0) || (y < KEYBOARD_SCREEN_Y) || (cellx >= keyboard_hitgrid_w) || (celly >= keyboard_hitgrid_h)) {
+        return -1;
+    }
+    return ((int) keyboard_hitgrid[(celly * keyboard_hitgrid_w) + cellx]) - 1;
+}
+
+static void handle_fingerdown_keyboard(const SDL_TouchFingerEvent *e)
+{
+    if (SDL_AtomicGet(&fingers_down) == 4) {
+        slide_out_keyboard();
+    } else {
+        const int x = (int) (((float) screenw) * e->x);
+        const int y = (int) (((float) screenh) * e->y);
+        const int keyindex = keyboard_hit_test(x, y);
 
         if (keyindex == -1) {
             return;  // not touching a key
+        } else if (key_pressed_slot[keyindex] != -1) {
+            return; // already a finger on this key, ignore it.
+        } else if (keyinfo[keyindex].layer != -1) {
+            set_keyboard_layer(keyinfo[keyindex].layer);
+            request_redraw();
+            return;
         }
 
         int pressedindex = -1;
         for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
             if (!pressed_keys[i].pressed) {
                 pressedindex = i;
-            } else if (pressed_keys[i].keyindex == keyindex) {
-                return; // already a finger on this key, ignore it.
+                break;
             }
         }
 
@@ -430,17 +4999,18 @@ static void handle_fingerdown_keyboard(const SDL_TouchFingerEvent *e)
         pressed_keys[pressedindex].pressed = SDL_TRUE;
         pressed_keys[pressedindex].finger = e->fingerId;
         pressed_keys[pressedindex].keyindex = keyindex;
+        pressed_keys[pressedindex].scancode = keyinfo[keyindex].scancode;
+        pressed_keys[pressedindex].screenrect = keyinfo[keyindex].screenrect;
+        key_pressed_slot[keyindex] = (Sint8) pressedindex;
+        keyboard_changed();
 
-        //printf("Pressed virtual keyboard key %u\n", keyinfo[keyindex].scancode);
+        //printf("Pressed virtual keyboard key %u\n", pressed_keys[pressedindex].scancode);
 
         #if USE_LIBEVDEV
-        if (uidev_keyboard) {
-            libevdev_uinput_write_event(uidev_keyboard, EV_KEY, keyinfo[keyindex].scancode, 1);
-            libevdev_uinput_write_event(uidev_keyboard, EV_SYN, SYN_REPORT, 0);
-        }
+        write_uinput_key(keyinfo[keyindex].scancode, 1);
         #endif
 
-        redraw_window();
+        request_redraw();  // the key already went out; the highlight can wait for the next frame.
     }
 }
 
@@ -448,17 +5018,18 @@ static void handle_fingerup_keyboard(const SDL_TouchFingerEvent *e)
 {
     for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
         if (pressed_keys[i].pressed && (pressed_keys[i].finger == e->fingerId)) {
-            //printf("Released virtual keyboard key %u\n", keyinfo[pressed_keys[i].keyindex].scancode);
+            //printf("Released virtual keyboard key %u\n", pressed_keys[i].scancode);
             pressed_keys[i].pressed = SDL_FALSE;
+            if (key_pressed_slot[pressed_keys[i].keyindex] == i) {  // might be from another layer.
+                key_pressed_slot[pressed_keys[i].keyindex] = -1;
+            }
+            keyboard_changed();
 
             #if USE_LIBEVDEV
-            if (uidev_keyboard) {
-                libevdev_uinput_write_event(uidev_keyboard, EV_KEY, keyinfo[pressed_keys[i].keyindex].scancode, 0);
-                libevdev_uinput_write_event(uidev_keyboard, EV_SYN, SYN_REPORT, 0);
-            }
+            write_uinput_key(pressed_keys[i].scancode, 0);
             #endif
 
-            redraw_window();
+            request_redraw();
             return;
         }
     }
@@ -469,27 +5040,654 @@ static void handle_fingermotion_keyboard(const SDL_TouchFingerEvent *e)
     // does nothing right now.
 }
 
+// returns the number of rects; they're relative to the top of the keyboard.
+static int get_keyboard_highlights(SDL_Rect *rects)
+{
+    int retval = 0;
+    for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
+        if (pressed_keys[i].pressed) {
+            rects[retval] = pressed_keys[i].screenrect;
+            rects[retval].y -= KEYBOARD_SCREEN_Y;
+            retval++;
+        }
+    }
+    return retval;
+}
+
+// Composites the keyboard and its highlights into keyboard_overlay, which
+//  only has to happen when a key or the layer changes, so every frame of a
+//  slide or fade just draws one textured quad. Returns SDL_FALSE if render
+//  targets aren't an option and the caller should draw the pieces itself.
+static SDL_bool update_keyboard_overlay(void)
+{
+    if (!SDL_RenderTargetSupported(renderer)) {
+        return SDL_FALSE;
+    }
+
+    if (keyboard_overlay && (keyboard_overlay_h != keyboardh)) {  // layers can be different heights.
+        mem_count(MEM_KEYBOARD, -texture_bytes(keyboard_overlay));
+        SDL_DestroyTexture(keyboard_overlay);
+        keyboard_overlay = NULL;
+    }
+
+    if (!keyboard_overlay) {
+        keyboard_overlay = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_TARGET, screenw, keyboardh);
+        if (!keyboard_overlay) {
+            return SDL_FALSE;
+        }
+        PROBE3(texture_create, screenw, keyboardh, SDL_TEXTUREACCESS_TARGET);
+        mem_count(MEM_KEYBOARD, screenw * keyboardh * 4);
+        SDL_SetTextureBlendMode(keyboard_overlay, SDL_BLENDMODE_BLEND);
+        keyboard_overlay_h = keyboardh;
+        keyboard_overlay_serial = -1;
+    }
+
+    const int serial = SDL_AtomicGet(&keyboard_serial);
+    if (serial == keyboard_overlay_serial) {
+        return SDL_TRUE;  // already up to date.
+    }
+
+    SDL_Rect rects[SDL_arraysize(pressed_keys)];
+    const int numrects = get_keyboard_highlights(rects);
+
+    // this saves and restores the window's logical size and viewport for us.
+    if (SDL_SetRenderTarget(renderer, keyboard_overlay) < 0) {
+        return SDL_FALSE;
+    }
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
+    SDL_RenderClear(renderer);
+    SDL_SetTextureBlendMode(keyboard_texture, SDL_BLENDMODE_NONE);  // keep the image's own alpha.
+    SDL_RenderCopy(renderer, keyboard_texture, NULL, NULL);
+    SDL_SetTextureBlendMode(keyboard_texture, SDL_BLENDMODE_BLEND);
+    if (numrects > 0) {
+        SDL_SetRenderDrawColor(renderer, 175, 0, 0, 90);
+        SDL_RenderFillRects(renderer, rects, numrects);
+    }
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    SDL_SetRenderTarget(renderer, NULL);
+
+    keyboard_overlay_serial = serial;
+    return SDL_TRUE;
+}
+
 static void handle_redraw_keyboard(void)
 {
     const int w = screenw;
     const int h = screenh;
     const int y = screenh - ((int) (((float) h) * keyboard_slide_percent));
     const SDL_Rect dst = { 0, y, w, keyboardh };
-    //SDL_SetTextureAlphaMod(keyboard_texture, 255.0f * keyboard_slide_percent);
-    SDL_RenderCopy(renderer, keyboard_texture, NULL, &dst);
 
-    SDL_SetRenderDrawColor(renderer, 175, 0, 0, 90);
-    for (int i = 0; i < SDL_arraysize(pressed_keys); i++) {
-        if (pressed_keys[i].pressed) {
-            SDL_RenderFillRect(renderer, &keyinfo[pressed_keys[i].keyindex].rect);
+    lock_input();  // the touch thread might switch layers or press keys.
+    if (update_keyboard_overlay()) {
+        SDL_RenderCopy(renderer, keyboard_overlay, NULL, &dst);
+    } else {
+        SDL_Rect rects[SDL_arraysize(pressed_keys)];
+        const int numrects = get_keyboard_highlights(rects);
+        //SDL_SetTextureAlphaMod(keyboard_texture, 255.0f * keyboard_slide_percent);
+        SDL_RenderCopy(renderer, keyboard_texture, NULL, &dst);
+        for (int i = 0; i < numrects; i++) {
+            rects[i].y += y;  // follow the keyboard while it slides.
         }
+        SDL_SetRenderDrawColor(renderer, 175, 0, 0, 90);
+        SDL_RenderFillRects(renderer, rects, numrects);
     }
+    unlock_input();
     SDL_SetRenderDrawColor(renderer, 255, 255, 255, 0);
 }
 
+static int read_backlight(const char *name)
+{
+    char path[256];
+    SDL_snprintf(path, sizeof (path), "%s/%s", backlight_path, name);
+    int retval = -1;
+    FILE *io = fopen(path, "r");
+    if (io) {
+        if (fscanf(io, "%d", &retval) != 1) {
+            retval = -1;
+        }
+        fclose(io);
+    }
+    return retval;
+}
+
+static void write_backlight(const char *name, const int value)
+{
+    // we don't care if any of this fails.
+    char path[256];
+    SDL_snprintf(path, sizeof (path), "%s/%s", backlight_path, name);
+    FILE *io = fopen(path, "w");
+    if (io) {
+        fprintf(io, "%d", value);
+        fclose(io);
+    }
+}
+
+static void set_backlight(const SDL_bool value)
+{
+    write_backlight("bl_power", value ? 0 : 1);  // yes, this looks backwards.
+}
+
+// any thread can call this.
+static void note_activity(void)
+{
+    SDL_AtomicSet(&last_activity_ticks, (int) SDL_GetTicks());
+    SDL_AtomicIncRef(&activity_serial);
+    if (SDL_AtomicGet(&idle_state) != IDLE_AWAKE) {
+        wake_main_thread();
+    }
+}
+
+static SDL_bool activity_since_idle(void)
+{
+    return (SDL_AtomicGet(&activity_serial) != idle_activity_serial) ? SDL_TRUE : SDL_FALSE;
+}
+
+// How long until the next idle step is due: 0 if it's due now, -1 if never.
+static Sint32 idle_wait_ms(void)
+{
+    Uint32 due = 0;
+    switch (SDL_AtomicGet(&idle_state)) {
+        case IDLE_AWAKE:
+            if (handle_redraw || SDL_AtomicGet(&fingers_down)) {
+                return -1;  // the keyboard is out, or someone's touching the screen.
+            }
+            due = idle_dim_ms ? idle_dim_ms : idle_blank_ms;
+            break;
+        case IDLE_DIMMED:
+            due = idle_blank_ms ? SDL_max(idle_blank_ms, idle_dim_ms) : 0;
+            break;
+        default: break;  // already as idle as it gets.
+    }
+
+    if (!due) {
+        return -1;
+    }
+    const Uint32 elapsed = SDL_GetTicks() - (Uint32) SDL_AtomicGet(&last_activity_ticks);
+    return (elapsed >= due) ? 0 : (Sint32) (due - elapsed);
+}
+
+static void enter_next_idle_state(void)
+{
+    const int state = SDL_AtomicGet(&idle_state);
+    if (state == IDLE_AWAKE) {
+        idle_activity_serial = SDL_AtomicGet(&activity_serial);
+        redraw_pending = SDL_FALSE;
+    }
+
+    if ((state == IDLE_AWAKE) && idle_dim_ms) {
+        printf("Idle: dimming the backlight\n");
+        const int brightness = read_backlight("brightness");
+        if (brightness > 0) {
+            backlight_brightness = brightness;
+            write_backlight("brightness", SDL_max((brightness * IDLE_DIM_PERCENT) / 100, 1));
+        }
+        SDL_AtomicSet(&idle_state, IDLE_DIMMED);
+    } else {
+        printf("Idle: blanking the backlight\n");
+        set_backlight(SDL_FALSE);
+        SDL_AtomicSet(&idle_state, IDLE_BLANKED);
+    }
+}
+
+static void wake_from_idle(void)
+{
+    printf("Idle: waking up\n");
+    if (SDL_AtomicGet(&idle_state) == IDLE_BLANKED) {
+        set_backlight(SDL_TRUE);
+    }
+    if (backlight_brightness > 0) {
+        write_backlight("brightness", backlight_brightness);
+        backlight_brightness = -1;
+    }
+    SDL_AtomicSet(&idle_state, IDLE_AWAKE);
+    redraw_pending = SDL_TRUE;  // nothing was drawn while we slept.
+}
+
+#if USE_DBUS
+typedef struct
+{
+    int dbusfd;
+    int quitfd;
+} dbuswatch;
+
+static int SDLCALL dbus_watch_thread(void *data)
+{
+    const dbuswatch *watch = (const dbuswatch *) data;
+    struct pollfd fds[2];
+    SDL_zero(fds);
+    fds[0].fd = watch->dbusfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = watch->quitfd;
+    fds[1].events = POLLIN;
+    while ((poll(fds, 2, -1) == -1) && (errno == EINTR)) { /* spin */ }
+    if (fds[0].revents) {
+        wake_main_thread();
+    }
+    return 0;
+}
+#endif
+
+#if USE_POSIX
+// Linux lets us ask to be woken up when memory stalls pass a threshold,
+//  instead of polling /proc/pressure/memory.
+static int SDLCALL memory_pressure_thread(void *data)
+{
+    const int fd = (int) (size_t) data;
+    struct pollfd fds[2];
+    SDL_zero(fds);
+    fds[0].fd = fd;
+    fds[0].events = POLLPRI;
+    fds[1].fd = memory_pressure_quitpipe[0];
+    fds[1].events = POLLIN;
+    while (SDL_TRUE) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        } else if (fds[1].revents || (fds[0].revents & POLLERR)) {
+            break;  // quitting, or the trigger went away.
+        } else if (fds[0].revents & POLLPRI) {
+            SDL_AtomicSet(&memory_pressure_event, 1);
+            wake_main_thread();
+        }
+    }
+    close(fd);
+    return 0;
+}
+#endif
+
+static void start_memory_pressure_watcher(void)
+{
+    #if USE_POSIX
+    const int fd = memory_pressure_path ? open(memory_pressure_path, O_RDWR | O_NONBLOCK | O_CLOEXEC) : -1;
+    if (fd == -1) {
+        return;  // no PSI here; update_quality() still polls it, if it's readable at all.
+    } else if ((write(fd, MEM_PRESSURE_TRIGGER, SDL_strlen(MEM_PRESSURE_TRIGGER) + 1) < 0) || (pipe(memory_pressure_quitpipe) != 0)) {
+        fprintf(stderr, "WARNING: Couldn't set up a memory pressure trigger on \"%s\"\n", memory_pressure_path);
+        close(fd);
+        return;
+    }
+
+    memory_pressure_watcher = SDL_CreateThread(memory_pressure_thread, "mempressure", (void *) (size_t) fd);
+    if (!memory_pressure_watcher) {
+        close(fd);
+        close(memory_pressure_quitpipe[0]);
+        close(memory_pressure_quitpipe[1]);
+        memory_pressure_quitpipe[0] = memory_pressure_quitpipe[1] = -1;
+    }
+    #endif
+}
+
+static void stop_memory_pressure_watcher(void)
+{
+    #if USE_POSIX
+    if (memory_pressure_watcher) {
+        if (write(memory_pressure_quitpipe[1], "", 1) == 1) {
+            SDL_WaitThread(memory_pressure_watcher, NULL);
+        } else {
+            SDL_DetachThread(memory_pressure_watcher);  // shouldn't happen; don't hang on it.
+        }
+        memory_pressure_watcher = NULL;
+        close(memory_pressure_quitpipe[0]);
+        close(memory_pressure_quitpipe[1]);
+        memory_pressure_quitpipe[0] = memory_pressure_quitpipe[1] = -1;
+    }
+    #endif
+}
+
+// Sleeps until an SDL event (touches, or the touch thread waking us) or D-Bus
+//  traffic shows up, with no timers running. timeout is -1 to wait forever.
+static void wait_while_idle(Sint32 timeout)
+{
+    if (activity_since_idle()) {
+        return;  // the touch thread might have missed that we went idle.
+    }
+
+    #if USE_DBUS
+    int dbusfd = -1;
+    int quitpipe[2] = { -1, -1 };
+    SDL_Thread *watcher = NULL;
+    if (dbus) {
+        if (dbus_connection_get_dispatch_status(dbus) == DBUS_DISPATCH_DATA_REMAINS) {
+            return;  // already have messages waiting.
+        } else if (dbus_connection_get_unix_fd(dbus, &dbusfd) && (pipe(quitpipe) == 0)) {
+            const dbuswatch watch = { dbusfd, quitpipe[0] };  // lives as long as the thread does.
+            watcher = SDL_CreateThread(dbus_watch_thread, "dbuswatch", (void *) &watch);
+            if (watcher) {
+                if (timeout < 0) {
+                    SDL_WaitEvent(NULL);
+                } else {
+                    SDL_WaitEventTimeout(NULL, timeout);
+                }
+                if (write(quitpipe[1], "", 1) == 1) {
+                    SDL_WaitThread(watcher, NULL);
+                } else {
+                    SDL_DetachThread(watcher);  // shouldn't happen; don't hang on it.
+                }
+            }
+        }
+
+        if (quitpipe[0] != -1) {
+            close(quitpipe[0]);
+            close(quitpipe[1]);
+        }
+
+        if (!watcher) {
+            SDL_WaitEventTimeout(NULL, ((timeout < 0) || (timeout > 100)) ? 100 : timeout);  // poll D-Bus the old way.
+        }
+        return;
+    }
+    #endif
+
+    if (timeout < 0) {
+        SDL_WaitEvent(NULL);
+    } else {
+        SDL_WaitEventTimeout(NULL, timeout);
+    }
+}
+
+// finger events go through these whether they came from SDL or the touch thread.
+static void dispatch_fingerdown(const SDL_TouchFingerEvent *e)
+{
+    PROBE3(touch_down, (Sint64) e->fingerId, (int) (e->x * screenw), (int) (e->y * screenh));
+    note_activity();
+    SDL_AtomicIncRef(&fingers_down);
+    //printf("FINGER DOWN! We now have %d fingers\n", SDL_AtomicGet(&fingers_down));
+    if (!keyboard_slide_cooldown) {
+        handle_fingerdown(e);
+    }
+}
+
+static void dispatch_fingerup(const SDL_TouchFingerEvent *e)
+{
+    PROBE3(touch_up, (Sint64) e->fingerId, (int) (e->x * screenw), (int) (e->y * screenh));
+    const SDL_bool last_finger = SDL_AtomicDecRef(&fingers_down);
+    //printf("FINGER UP! We now have %d fingers\n", SDL_AtomicGet(&fingers_down));
+    if (!keyboard_slide_cooldown) {
+        handle_fingerup(e);
+    } else if (last_finger) {
+        keyboard_slide_cooldown = SDL_FALSE;
+    }
+}
+
+static void dispatch_fingermotion(const SDL_TouchFingerEvent *e)
+{
+    if (!keyboard_slide_cooldown) {
+        handle_fingermotion(e);
+    }
+}
+
+#if USE_LIBEVDEV
+// SDL only hands us touches when iterate() gets around to pumping events,
+//  which might be after a fade or a decode. If we're told which touchscreen
+//  to use, a high-priority thread reads it directly (multitouch protocol B),
+//  and runs the mouse/keyboard handlers the moment the kernel reports a
+//  frame, so uinput events go out right away no matter what the main thread
+//  is doing. The main thread only hears about it when something needs to
+//  be drawn.
+#define MAX_TOUCH_SLOTS 10
+
+typedef struct
+{
+    int tracking_id;  // -1 when nothing is touching this slot.
+    SDL_FingerID finger;  // what the handlers know this touch as, if down.
+    SDL_bool down;
+    SDL_bool moved;
+    int x;
+    int y;
+    int lastx;
+    int lasty;
+} touchslot;
+
+typedef struct
+{
+    touchslot slots[MAX_TOUCH_SLOTS];
+    int slot;
+    int minx, rangex;
+    int miny, rangey;
+} touchstate;
+
+static void fill_finger_event(SDL_TouchFingerEvent *e, const touchstate *ts, const touchslot *s, const Uint32 type)
+{
+    SDL_zerop(e);
+    e->type = type;
+    e->timestamp = SDL_GetTicks();
+    e->fingerId = s->finger;
+    e->x = ((float) (s->x - ts->minx)) / ((float) ts->rangex);
+    e->y = ((float) (s->y - ts->miny)) / ((float) ts->rangey);
+    e->dx = ((float) (s->x - s->lastx)) / ((float) ts->rangex);
+    e->dy = ((float) (s->y - s->lasty)) / ((float) ts->rangey);
+}
+
+// a SYN_REPORT finished a frame; releases first, then new touches, then motion.
+static void process_touch_frame(touchstate *ts)
+{
+    SDL_TouchFingerEvent e;
+    lock_input();
+
+    for (int i = 0; i < MAX_TOUCH_SLOTS; i++) {
+        touchslot *s = &ts->slots[i];
+        if (s->down && (s->tracking_id != s->finger)) {  // lifted, or lifted and replaced in one frame.
+            s->lastx = s->x;
+            s->lasty = s->y;
+            fill_finger_event(&e, ts, s, SDL_FINGERUP);
+            s->down = SDL_FALSE;
+            dispatch_fingerup(&e);
+        }
+    }
+
+    for (int i = 0; i < MAX_TOUCH_SLOTS; i++) {
+        touchslot *s = &ts->slots[i];
+        if (!s->down && (s->tracking_id != -1)) {
+            s->down = SDL_TRUE;
+            s->moved = SDL_FALSE;
+            s->finger = s->tracking_id;
+            s->lastx = s->x;
+            s->lasty = s->y;
+            fill_finger_event(&e, ts, s, SDL_FINGERDOWN);
+            dispatch_fingerdown(&e);
+        }
+    }
+
+    for (int i = 0; i < MAX_TOUCH_SLOTS; i++) {
+        touchslot *s = &ts->slots[i];
+        if (s->down && s->moved) {
+            s->moved = SDL_FALSE;
+            fill_finger_event(&e, ts, s, SDL_FINGERMOTION);
+            s->lastx = s->x;
+            s->lasty = s->y;
+            dispatch_fingermotion(&e);
+        }
+    }
+
+    flush_mouse_motion();
+    unlock_input();
+}
+
+static void process_touch_event(touchstate *ts, const struct input_event *ev)
+{
+    touchslot *s = ((ts->slot >= 0) && (ts->slot < MAX_TOUCH_SLOTS)) ? &ts->slots[ts->slot] : NULL;
+    if (ev->type == EV_SYN) {
+        if (ev->code == SYN_REPORT) {
+            process_touch_frame(ts);
+        }
+    } else if (ev->type == EV_ABS) {
+        switch (ev->code) {
+            case ABS_MT_SLOT: ts->slot = ev->value; break;
+            case ABS_MT_TRACKING_ID: if (s) { s->tracking_id = ev->value; } break;
+            case ABS_MT_POSITION_X: if (s) { s->x = ev->value; s->moved = SDL_TRUE; } break;
+            case ABS_MT_POSITION_Y: if (s) { s->y = ev->value; s->moved = SDL_TRUE; } break;
+            default: break;
+        }
+    }
+}
+
+static int SDLCALL touch_input_thread(void *data)
+{
+    struct libevdev *dev = (struct libevdev *) data;
+    touchstate ts;
+
+    if (SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL) < 0) {
+        fprintf(stderr, "WARNING: Couldn't raise touch thread priority: %s\n", SDL_GetError());
+    }
+
+    SDL_zero(ts);
+    for (int i = 0; i < MAX_TOUCH_SLOTS; i++) {
+        ts.slots[i].tracking_id = -1;
+    }
+    ts.slot = libevdev_get_current_slot(dev);
+    ts.minx = libevdev_get_abs_minimum(dev, ABS_MT_POSITION_X);
+    ts.rangex = SDL_max(libevdev_get_abs_maximum(dev, ABS_MT_POSITION_X) - ts.minx, 1);
+    ts.miny = libevdev_get_abs_minimum(dev, ABS_MT_POSITION_Y);
+    ts.rangey = SDL_max(libevdev_get_abs_maximum(dev, ABS_MT_POSITION_Y) - ts.miny, 1);
+
+    struct pollfd pfd;
+    pfd.fd = libevdev_get_fd(dev);
+    pfd.events = POLLIN;
+    unsigned int flags = LIBEVDEV_READ_FLAG_NORMAL;
+    while (!SDL_AtomicGet(&touch_thread_quit)) {
+        struct input_event ev;
+        const int rc = libevdev_next_event(dev, flags, &ev);
+        if (rc == LIBEVDEV_READ_STATUS_SUCCESS) {
+            process_touch_event(&ts, &ev);
+        } else if (rc == LIBEVDEV_READ_STATUS_SYNC) {
+            flags = LIBEVDEV_READ_FLAG_SYNC;  // we fell behind; libevdev replays the current state.
+            process_touch_event(&ts, &ev);
+        } else if (rc == -EAGAIN) {
+            if (flags == LIBEVDEV_READ_FLAG_SYNC) {
+                flags = LIBEVDEV_READ_FLAG_NORMAL;
+            } else {
+                pfd.revents = 0;
+                poll(&pfd, 1, 100);  // wake up now and then to see if we should quit.
+            }
+        } else {
+            fprintf(stderr, "WARNING: Lost the touchscreen (rc=%d); no more touch input!\n", rc);
+            break;
+        }
+    }
+
+    // don't leave anything stuck down.
+    for (int i = 0; i < MAX_TOUCH_SLOTS; i++) {
+        ts.slots[i].tracking_id = -1;
+    }
+    process_touch_frame(&ts);
+
+    return 0;
+}
+
+static struct libevdev *open_touch_device(const char *path, const SDL_bool quiet)
+{
+    const int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1) {
+        if (!quiet) {
+            fprintf(stderr, "WARNING: Couldn't open touch device \"%s\": %s\n", path, strerror(errno));
+        }
+        return NULL;
+    }
+
+    struct libevdev *dev = NULL;
+    const int rc = libevdev_new_from_fd(fd, &dev);
+    if (rc < 0) {
+        if (!quiet) {
+            fprintf(stderr, "WARNING: Couldn't read touch device \"%s\" (rc=%d)\n", path, rc);
+        }
+        close(fd);
+        return NULL;
+    } else if (!libevdev_has_event_code(dev, EV_ABS, ABS_MT_SLOT) ||
+               !libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_X) ||
+               !libevdev_has_event_code(dev, EV_ABS, ABS_MT_POSITION_Y)) {
+        if (!quiet) {
+            fprintf(stderr, "WARNING: \"%s\" isn't a multitouch (protocol B) device\n", path);
+        }
+        libevdev_free(dev);
+        close(fd);
+        return NULL;
+    }
+
+    return dev;
+}
+
+static void start_touch_thread(void)
+{
+    if (!touch_device_path) {
+        return;  // SDL handles touches.
+    }
+
+    if (SDL_strcmp(touch_device_path, "auto") == 0) {
+        for (int i = 0; !evdev_touch && (i < 32); i++) {
+            char path[64];
+            SDL_snprintf(path, sizeof (path), "/dev/input/event%d", i);
+            evdev_touch = open_touch_device(path, SDL_TRUE);
+            if (evdev_touch && !libevdev_has_property(evdev_touch, INPUT_PROP_DIRECT)) {
+                close(libevdev_get_fd(evdev_touch));  // a touchpad, not a touchscreen.
+                libevdev_free(evdev_touch);
+                evdev_touch = NULL;
+            }
+        }
+        if (!evdev_touch) {
+            fprintf(stderr, "WARNING: Didn't find a multitouch touchscreen; using SDL for touch input.\n");
+        }
+    } else {
+        evdev_touch = open_touch_device(touch_device_path, SDL_FALSE);
+    }
+
+    if (!evdev_touch) {
+        return;
+    }
+
+    input_lock = SDL_CreateMutex();
+    SDL_AtomicSet(&touch_thread_quit, 0);
+    touch_thread = (input_lock && input_wake_event) ? SDL_CreateThread(touch_input_thread, "touch", evdev_touch) : NULL;
+    if (!touch_thread) {
+        fprintf(stderr, "WARNING: Couldn't start touch thread; using SDL for touch input.\n");
+        if (input_lock) {
+            SDL_DestroyMutex(input_lock);
+            input_lock = NULL;
+        }
+        close(libevdev_get_fd(evdev_touch));
+        libevdev_free(evdev_touch);
+        evdev_touch = NULL;
+        return;
+    }
+
+    printf("Reading touches from \"%s\" (%s)\n", touch_device_path, libevdev_get_name(evdev_touch));
+}
+
+static void stop_touch_thread(void)
+{
+    if (touch_thread) {
+        SDL_AtomicSet(&touch_thread_quit, 1);
+        SDL_WaitThread(touch_thread, NULL);
+        touch_thread = NULL;
+    }
+
+    if (evdev_touch) {
+        close(libevdev_get_fd(evdev_touch));
+        libevdev_free(evdev_touch);
+        evdev_touch = NULL;
+    }
+
+    if (input_lock) {
+        SDL_DestroyMutex(input_lock);
+        input_lock = NULL;
+    }
+}
+#endif
+
+
+static SDL_bool touch_input_running(void)
+{
+    #if USE_LIBEVDEV
+    return touch_thread ? SDL_TRUE : SDL_FALSE;
+    #else
+    return SDL_FALSE;
+    #endif
+}
 
 static SDL_bool iterate(void)
 {
+    const Uint64 trace_start = trace_begin();
     SDL_bool redraw = SDL_FALSE;
     SDL_bool saw_event = SDL_FALSE;
     char *newimage = NULL;
@@ -498,27 +5696,22 @@ static SDL_bool iterate(void)
     while (SDL_PollEvent(&e)) {
         saw_event = SDL_TRUE;
         switch (e.type) {
+            // the touch thread handles these itself if it's running.
             case SDL_FINGERDOWN:
-                fingers_down++;
-                //printf("FINGER DOWN! We now have %d fingers\n", fingers_down);
-                if (!keyboard_slide_cooldown) {
-                    handle_fingerdown(&e.tfinger);
+                if (!touch_input_running()) {
+                    dispatch_fingerdown(&e.tfinger);
                 }
                 break;
 
             case SDL_FINGERUP:
-                fingers_down--;
-                //printf("FINGER UP! We now have %d fingers\n", fingers_down);
-                if (!keyboard_slide_cooldown) {
-                    handle_fingerup(&e.tfinger);
-                } else if (!fingers_down) {
-                    keyboard_slide_cooldown = SDL_FALSE;
+                if (!touch_input_running()) {
+                    dispatch_fingerup(&e.tfinger);
                 }
                 break;
 
             case SDL_FINGERMOTION:
-                if (!keyboard_slide_cooldown) {
-                    handle_fingermotion(&e.tfinger);
+                if (!touch_input_running()) {
+                    dispatch_fingermotion(&e.tfinger);
                 }
                 break;
 
@@ -526,6 +5719,12 @@ static SDL_bool iterate(void)
                 printf("Got SDL_QUIT event, quitting now...\n");
                 return SDL_FALSE;
 
+            case SDL_RENDER_TARGETS_RESET:
+            case SDL_RENDER_DEVICE_RESET:
+                keyboard_overlay_serial = -1;  // its contents are gone; redraw them.
+                redraw = SDL_TRUE;
+                break;
+
             case SDL_WINDOWEVENT:
                 if ( (e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) ||
                      (e.window.event == SDL_WINDOWEVENT_EXPOSED) ) {
@@ -538,14 +5737,20 @@ static SDL_bool iterate(void)
                    is useful for testing when building on a desktop system. */
                 SDL_free(newimage);
                 newimage = e.drop.file;
+                PROBE1(show_image, newimage);
                 break;
 
-            default: break;
+            default: break;  // input_wake_event lands here; it just got us out of waiting.
         }
     }
 
+    if (!touch_input_running()) {
+        flush_mouse_motion();  // one report for all the motion SDL gave us this time.
+    }
+
     #if USE_DBUS
     if (dbus) {
+        const Uint64 trace_dbus_start = trace_begin();
         dbus_connection_read_write(dbus, 0);
         DBusMessage *msg;
         while ((msg = dbus_connection_pop_message(dbus)) != NULL) {
@@ -557,39 +5762,128 @@ static SDL_bool iterate(void)
                      char *param = NULL;
                      dbus_message_iter_get_basic(&args, &param);
                      //printf("Got D-Bus request to show image \"%s\"\n", param);
+                     PROBE1(show_image, param);
                      SDL_free(newimage);
                      newimage = SDL_strdup(param);
                 }
+            } else if (dbus_message_is_signal(msg, "org.icculus.Arcade1UpMarquee", "DumpTrace")) {
+                DBusMessageIter args;
+                char *param = NULL;  // optional path to write to.
+                if ( dbus_message_iter_init(msg, &args) &&
+                     (dbus_message_iter_get_arg_type(&args) == DBUS_TYPE_STRING) ) {
+                     dbus_message_iter_get_basic(&args, &param);
+                }
+                dump_trace((param && *param) ? param : trace_path);
+            } else if (dbus_message_is_signal(msg, "org.icculus.Arcade1UpMarquee", "ReportMemory")) {
+                report_memory();
             }
             dbus_message_unref(msg);
         }
+        trace_end("dbus", trace_dbus_start);
     }
     #endif
 
-    if (!saw_event && !fingers_down) {
-        SDL_Delay(100);
-    } else if (newimage) {
+    if (SDL_AtomicSet(&trace_dump_requested, 0)) {
+        dump_trace(trace_path);
+    }
+
+    if (SDL_AtomicSet(&memory_report_requested, 0)) {
+        report_memory();
+    }
+
+    if (SDL_AtomicSet(&memory_pressure_event, 0)) {
+        printf("Memory pressure! Letting go of caches.\n");
+        release_memory_caches();
+        quality_ticks = 0;
+        update_quality();  // so the next marquee decodes smaller, if it's still bad.
+    }
+
+    if (newimage) {
+        note_activity();  // a drop or a ShowImage.
+    }
+
+    if ((SDL_AtomicGet(&idle_state) != IDLE_AWAKE) && activity_since_idle()) {
+        wake_from_idle();
+    }
+    const SDL_bool idle = (SDL_AtomicGet(&idle_state) != IDLE_AWAKE) ? SDL_TRUE : SDL_FALSE;
+
+    const int slide = SDL_AtomicSet(&keyboard_slide_request, KEYBOARD_SLIDE_NONE);
+    if (slide != KEYBOARD_SLIDE_NONE) {
+        animate_keyboard_slide((slide == KEYBOARD_SLIDE_IN) ? SDL_TRUE : SDL_FALSE);
+    }
+
+    if (SDL_AtomicSet(&redraw_request, 0)) {
+        redraw = SDL_TRUE;
+    }
+
+    update_keyboard_load();
+
+    update_quality();
+    if ((quality == QUALITY_FULL) && current_image_degraded && current_image_fname && !newimage && !idle) {
+        current_image_degraded = SDL_FALSE;  // if it's still degraded after this, don't keep trying.
+        newimage = SDL_strdup(current_image_fname);  // things cooled off, load it properly.
+    }
+
+
+    if (!idle) {  // nothing animates or draws while we're idle.
+        if (update_animation(current_image)) {
+            redraw = SDL_TRUE;
+        }
+
+        if (update_refine(current_image)) {
+            redraw = SDL_TRUE;
+        }
+
+        if (redraw) {
+            redraw_pending = SDL_TRUE;
+        }
+    }
+
+    // wait for the full-resolution image if there's a preview up.
+    if (marquee_snapshot_pending && !newimage && current_image && !current_image->refine) {
+        save_marquee_snapshot();
+    }
+
+    if (newimage) {
+        redraw_pending = SDL_FALSE;
         set_new_image(newimage);
         SDL_free(newimage);
-    } else if (redraw) {
-        redraw_window();
+    } else if (redraw_pending) {
+        // Draw once per frame, however many touches came in, and don't block
+        //  in a vsync'd present while there might be more input to read.
+        const Uint32 waitms = frame_wait_ms();
+        if (waitms == 0) {
+            redraw_pending = SDL_FALSE;
+            redraw_window();
+        } else {
+            SDL_WaitEventTimeout(NULL, (int) waitms);
+        }
+    } else if (!saw_event && !SDL_AtomicGet(&fingers_down)) {
+        const Sint32 idlems = idle_wait_ms();
+        if (idlems == 0) {
+            enter_next_idle_state();
+        } else if (idle) {
+            wait_while_idle(idlems);
+        } else {
+            const Sint32 animms = animation_wait_ms(current_image);
+            Sint32 maxms = (current_image && current_image->refine) ? 10 : 100;  // don't sit on a finished full-res image.
+            if ((idlems > 0) && (idlems < maxms)) {
+                maxms = idlems;
+            }
+            SDL_WaitEventTimeout(NULL, ((animms < 0) || (animms > maxms)) ? maxms : animms);  // touch thread can wake us.
+        }
     }
 
+    trace_end("iterate", trace_start);
     return SDL_TRUE;
 }
 
-static void set_backlight(const SDL_bool value)
+static void deinitialize(void)
 {
-    // we don't care if any of this fails.
-    FILE *io = fopen("/sys/class/backlight/rpi_backlight/bl_power", "w");
-    if (io) {
-        fputs(value ? "0" : "1", io);  // yes, this looks backwards.
-        fclose(io);
+    if (show_frame_stats) {
+        report_frame_stats();
     }
-}
 
-static void deinitialize(void)
-{
     #if USE_DBUS
     if (dbus) {
         dbus_connection_unref(dbus);
@@ -598,6 +5892,8 @@ static void deinitialize(void)
     #endif
 
     #if USE_LIBEVDEV
+    stop_touch_thread();  // before the uinput devices it writes to go away.
+
     if (uidev_mouse) {
         libevdev_uinput_destroy(uidev_mouse);
         uidev_mouse = NULL;
@@ -619,16 +5915,31 @@ static void deinitialize(void)
     }
     #endif
 
-    if (texture) {
-        SDL_DestroyTexture(texture);
-        texture = NULL;
+    stop_memory_pressure_watcher();
+
+    if (keyboard_loader) {
+        SDL_WaitThread(keyboard_loader, NULL);
+        keyboard_loader = NULL;
+    }
+
+    if (marquee_snapshot_writer) {
+        SDL_WaitThread(marquee_snapshot_writer, NULL);  // let the last marquee make it to disk.
+        marquee_snapshot_writer = NULL;
     }
 
-    if (keyboard_texture) {
-        SDL_DestroyTexture(keyboard_texture);
-        keyboard_texture = NULL;
+    if (current_image) {
+        free_image(current_image);
+        current_image = NULL;
     }
 
+    SDL_free(current_image_fname);
+    current_image_fname = NULL;
+
+    destroy_texture_pool();
+    deinit_compositor();
+
+    free_keyboard();
+
     if (renderer) {
         SDL_DestroyRenderer(renderer);
         renderer = NULL;
@@ -641,126 +5952,493 @@ static void deinitialize(void)
 
     SDL_Quit();
 
+    if (backlight_brightness > 0) {
+        write_backlight("brightness", backlight_brightness);  // don't leave it dimmed for whoever's next.
+        backlight_brightness = -1;
+    }
     set_backlight(SDL_FALSE);
 }
 
-static SDL_Texture *build_keyboard_texture(void)
+// Keyboard layouts are text files (see keyboard-en.txt): one or more layers,
+//  each an image and the keys on it. Each layer's image gets scaled to the
+//  screen once and cached on disk, so later startups just load the pixels
+//  and hand them to a texture, and switching layers is swapping pointers.
+#define KEYBOARD_CACHE_MAGIC 0x3144424B  // "KBD1"
+
+typedef struct
 {
-    SDL_Texture *tex = load_image("/home/pi/arcade1up-lcd-marquee/keyboard-en.png", &keyboardw, &keyboardh);  // !!! FIXME: hardcoded
-    if (!tex) {
+    Uint32 magic;
+    Uint32 srcw;  // the image's width, for mapping key rects.
+    Uint32 w;
+    Uint32 h;
+} keyboardcacheheader;
+
+#define KEYNAME(x) { #x, KEY_##x }
+static const struct { const char *name; unsigned int scancode; } keyboard_keynames[] = {
+    KEYNAME(ESC), KEYNAME(1), KEYNAME(2), KEYNAME(3), KEYNAME(4), KEYNAME(5), KEYNAME(6), KEYNAME(7), KEYNAME(8), KEYNAME(9), KEYNAME(0),
+    KEYNAME(MINUS), KEYNAME(EQUAL), KEYNAME(BACKSPACE), KEYNAME(TAB), KEYNAME(Q), KEYNAME(W), KEYNAME(E), KEYNAME(R), KEYNAME(T),
+    KEYNAME(Y), KEYNAME(U), KEYNAME(I), KEYNAME(O), KEYNAME(P), KEYNAME(LEFTBRACE), KEYNAME(RIGHTBRACE), KEYNAME(ENTER),
+    KEYNAME(LEFTCTRL), KEYNAME(A), KEYNAME(S), KEYNAME(D), KEYNAME(F), KEYNAME(G), KEYNAME(H), KEYNAME(J), KEYNAME(K), KEYNAME(L),
+    KEYNAME(SEMICOLON), KEYNAME(APOSTROPHE), KEYNAME(GRAVE), KEYNAME(LEFTSHIFT), KEYNAME(BACKSLASH), KEYNAME(Z), KEYNAME(X),
+    KEYNAME(C), KEYNAME(V), KEYNAME(B), KEYNAME(N), KEYNAME(M), KEYNAME(COMMA), KEYNAME(DOT), KEYNAME(SLASH), KEYNAME(RIGHTSHIFT),
+    KEYNAME(LEFTALT), KEYNAME(SPACE), KEYNAME(CAPSLOCK), KEYNAME(F1), KEYNAME(F2), KEYNAME(F3), KEYNAME(F4), KEYNAME(F5),
+    KEYNAME(F6), KEYNAME(F7), KEYNAME(F8), KEYNAME(F9), KEYNAME(F10), KEYNAME(F11), KEYNAME(F12), KEYNAME(NUMLOCK),
+    KEYNAME(SCROLLLOCK), KEYNAME(RIGHTCTRL), KEYNAME(RIGHTALT), KEYNAME(HOME), KEYNAME(UP), KEYNAME(PAGEUP), KEYNAME(LEFT),
+    KEYNAME(RIGHT), KEYNAME(END), KEYNAME(DOWN), KEYNAME(PAGEDOWN), KEYNAME(INSERT), KEYNAME(DELETE), KEYNAME(PAUSE),
+    KEYNAME(LEFTMETA), KEYNAME(RIGHTMETA), KEYNAME(COMPOSE), KEYNAME(SYSRQ), KEYNAME(KPENTER), KEYNAME(KPPLUS), KEYNAME(KPMINUS)
+};
+#undef KEYNAME
+
+static SDL_bool parse_keyname(const char *name, unsigned int *_scancode)
+{
+    for (int i = 0; i < SDL_arraysize(keyboard_keynames); i++) {
+        if (SDL_strcmp(keyboard_keynames[i].name, name) == 0) {
+            *_scancode = keyboard_keynames[i].scancode;
+            return SDL_TRUE;
+        }
+    }
+
+    char *endp = NULL;
+    const long val = SDL_strtol(name, &endp, 0);
+    if ((endp == name) || (*endp != '\0') || (val <= 0) || (val > KEY_MAX)) {
+        return SDL_FALSE;
+    }
+    *_scancode = (unsigned int) val;
+    return SDL_TRUE;
+}
+
+static SDL_bool parse_keyboard_layout(const char *path)
+{
+    FILE *io = fopen(path, "r");
+    if (!io) {
+        fprintf(stderr, "WARNING: Couldn't open keyboard layout \"%s\"; no keyboard for you!\n", path);
+        return SDL_FALSE;
+    }
+
+    const char *slash = SDL_strrchr(path, '/');
+    const int dirlen = slash ? ((int) (slash - path)) + 1 : 0;
+    static char layerkeys[MAX_KEYBOARD_LAYERS][MAX_LAYER_KEYS][32];  // layerkey targets, resolved once we've seen every layer.
+    keyboardlayer *layer = NULL;
+    SDL_bool okay = SDL_TRUE;
+    char line[512];
+    int lineno = 0;
+
+    while (okay && fgets(line, sizeof (line), io)) {
+        char cmd[32], arg[256];
+        SDL_Rect r;
+        lineno++;
+        const int fields = sscanf(line, "%31s %255s %d %d %d %d", cmd, arg, &r.x, &r.y, &r.w, &r.h);
+        if ((fields <= 0) || (cmd[0] == '#')) {
+            continue;  // blank or comment.
+        } else if ((SDL_strcmp(cmd, "layer") == 0) && (fields >= 2)) {
+            char image[256];
+            if (num_keyboard_layers == MAX_KEYBOARD_LAYERS) {
+                fprintf(stderr, "WARNING: %s:%d: too many layers\n", path, lineno);
+                okay = SDL_FALSE;
+            } else if (sscanf(line, "%*s %31s %255s", keyboard_layers[num_keyboard_layers].name, image) != 2) {
+                fprintf(stderr, "WARNING: %s:%d: layer needs a name and an image\n", path, lineno);
+                okay = SDL_FALSE;
+            } else {
+                layer = &keyboard_layers[num_keyboard_layers++];
+                const size_t len = dirlen + SDL_strlen(image) + 1;
+                layer->image = (char *) SDL_malloc(len);
+                if (!layer->image) {
+                    okay = SDL_FALSE;
+                } else if (image[0] == '/') {
+                    SDL_strlcpy(layer->image, image, len);
+                } else {
+                    SDL_snprintf(layer->image, len, "%.*s%s", dirlen, path, image);
+                }
+            }
+        } else if (((SDL_strcmp(cmd, "key") == 0) || (SDL_strcmp(cmd, "layerkey") == 0)) && (fields == 6)) {
+            if (!layer) {
+                fprintf(stderr, "WARNING: %s:%d: key before any layer\n", path, lineno);
+                okay = SDL_FALSE;
+            } else if (layer->numkeys == MAX_LAYER_KEYS) {
+                fprintf(stderr, "WARNING: %s:%d: too many keys on this layer\n", path, lineno);
+                okay = SDL_FALSE;
+            } else {
+                virtkey *k = &layer->keys[layer->numkeys];
+                SDL_memcpy(&k->rect, &r, sizeof (SDL_Rect));
+                k->layer = -1;
+                if (cmd[0] == 'l') {
+                    SDL_strlcpy(layerkeys[num_keyboard_layers - 1][layer->numkeys], arg, sizeof (layerkeys[0][0]));
+                    k->layer = 0;  // placeholder until we can look it up.
+                } else if (!parse_keyname(arg, &k->scancode)) {
+                    fprintf(stderr, "WARNING: %s:%d: unknown key \"%s\"\n", path, lineno, arg);
+                    okay = SDL_FALSE;
+                }
+                layer->numkeys++;
+            }
+        } else {
+            fprintf(stderr, "WARNING: %s:%d: syntax error\n", path, lineno);
+            okay = SDL_FALSE;
+        }
+    }
+
+    fclose(io);
+
+    if (okay && (num_keyboard_layers == 0)) {
+        fprintf(stderr, "WARNING: %s: no layers\n", path);
+        okay = SDL_FALSE;
+    }
+
+    for (int i = 0; okay && (i < num_keyboard_layers); i++) {
+        for (int j = 0; okay && (j < keyboard_layers[i].numkeys); j++) {
+            virtkey *k = &keyboard_layers[i].keys[j];
+            if (k->layer == -1) {
+                continue;
+            }
+            k->layer = -1;
+            for (int l = 0; l < num_keyboard_layers; l++) {
+                if (SDL_strcmp(keyboard_layers[l].name, layerkeys[i][j]) == 0) {
+                    k->layer = l;
+                    break;
+                }
+            }
+            if (k->layer == -1) {
+                fprintf(stderr, "WARNING: %s: layer \"%s\" switches to unknown layer \"%s\"\n", path, keyboard_layers[i].name, layerkeys[i][j]);
+                okay = SDL_FALSE;
+            }
+        }
+    }
+
+    return okay;
+}
+
+// the cache file name covers everything that goes into the scaled pixels.
+static char *keyboard_cache_path(const char *image)
+{
+    #if USE_POSIX
+    struct stat statbuf;
+    if (stat(image, &statbuf) == -1) {
+        return NULL;
+    }
+
+    char key[512];
+    SDL_snprintf(key, sizeof (key), "%s|%lld|%lld|%d|%u", image, (long long) statbuf.st_mtime, (long long) statbuf.st_size, screenw, (unsigned int) KEYBOARD_CACHE_MAGIC);
+    Uint32 hash = 2166136261u;  // FNV-1a
+    for (const char *ptr = key; *ptr; ptr++) {
+        hash = (hash ^ (Uint8) *ptr) * 16777619u;
+    }
+
+    char *prefdir = SDL_GetPrefPath("icculus", "arcade1up-lcd-marquee");
+    if (!prefdir) {
+        return NULL;
+    }
+    const size_t len = SDL_strlen(prefdir) + 32;
+    char *retval = (char *) SDL_malloc(len);
+    if (retval) {
+        SDL_snprintf(retval, len, "%skeyboard-%08x.raw", prefdir, (unsigned int) hash);
+    }
+    SDL_free(prefdir);
+    return retval;
+    #else
+    return NULL;  // no cheap way to notice the image changed, so don't cache.
+    #endif
+}
+
+static Uint8 *load_keyboard_cache(const char *cachepath, keyboardcacheheader *header)
+{
+    SDL_RWops *rw = cachepath ? SDL_RWFromFile(cachepath, "rb") : NULL;
+    if (!rw) {
+        return NULL;
+    }
+
+    Uint8 *retval = NULL;
+    if ( (SDL_RWread(rw, header, sizeof (*header), 1) == 1) &&
+         (header->magic == KEYBOARD_CACHE_MAGIC) && (header->w == (Uint32) screenw) &&
+         (header->srcw > 0) && (header->h > 0) && (header->h <= 4096) &&
+         (SDL_RWsize(rw) == (Sint64) (sizeof (*header) + (((size_t) header->w) * header->h * 4))) ) {
+        const size_t len = ((size_t) header->w) * header->h * 4;
+        retval = (Uint8 *) mem_alloc(len, MEM_KEYBOARD);
+        if (retval && (SDL_RWread(rw, retval, len, 1) != 1)) {
+            SDL_free(retval);
+            retval = NULL;
+        }
+    }
+    SDL_RWclose(rw);
+    return retval;
+}
+
+static void save_keyboard_cache(const char *cachepath, const keyboardcacheheader *header, const Uint8 *pixels)
+{
+    SDL_RWops *rw = cachepath ? SDL_RWFromFile(cachepath, "wb") : NULL;
+    if (rw) {
+        // a short write just fails the size check next time.
+        SDL_RWwrite(rw, header, sizeof (*header), 1);
+        SDL_RWwrite(rw, pixels, ((size_t) header->w) * header->h * 4, 1);
+        SDL_RWclose(rw);
+    }
+}
+
+// The keyboard is drawn screen-wide at the image's own height, so only scale horizontally.
+static Uint8 *scale_keyboard_image(const Uint8 *src, const int srcw, const int h, const int dstw)
+{
+    Uint8 *retval = (Uint8 *) mem_alloc(((size_t) dstw) * h * 4, MEM_KEYBOARD);
+    if (!retval) {
         return NULL;
+    } else if (srcw == dstw) {
+        SDL_memcpy(retval, src, ((size_t) dstw) * h * 4);
+        return retval;
+    }
+
+    const Sint64 step = (((Sint64) srcw) << 16) / dstw;
+    for (int y = 0; y < h; y++) {
+        const Uint8 *srcrow = src + (((size_t) y) * srcw * 4);
+        Uint8 *dst = retval + (((size_t) y) * dstw * 4);
+        for (int x = 0; x < dstw; x++) {
+            const Sint64 fx = SDL_max(((x * step) + (step / 2)) - 32768, 0);  // sample at pixel centers.
+            const int x1 = SDL_min((int) (fx >> 16), srcw - 1);
+            const int x2 = SDL_min(x1 + 1, srcw - 1);
+            const int frac = (int) ((fx >> 8) & 0xFF);
+            for (int i = 0; i < 4; i++) {
+                *(dst++) = (Uint8) (((srcrow[(x1 * 4) + i] * (256 - frac)) + (srcrow[(x2 * 4) + i] * frac)) >> 8);
+            }
+        }
+    }
+    return retval;
+}
+
+static SDL_bool build_keyboard_hitgrid(keyboardlayer *layer, const int srcw)
+{
+    const float scalex = ((float) screenw) / ((float) srcw);
+
+    layer->hitgrid_h = (layer->h + (KEYBOARD_HIT_CELL - 1)) / KEYBOARD_HIT_CELL;
+    layer->hitgrid = (Uint8 *) SDL_calloc(keyboard_hitgrid_w * layer->hitgrid_h, 1);
+    if (!layer->hitgrid) {
+        return SDL_FALSE;
+    }
+
+    for (int i = 0; i < layer->numkeys; i++) {
+        virtkey *k = &layer->keys[i];
+        const int x1 = (int) ((((float) k->rect.x) * scalex) + 0.5f);
+        const int x2 = (int) ((((float) (k->rect.x + k->rect.w)) * scalex) + 0.5f);
+        k->screenrect.x = x1;
+        k->screenrect.y = k->rect.y + KEYBOARD_SCREEN_Y;
+        k->screenrect.w = x2 - x1;
+        k->screenrect.h = k->rect.h;
+
+        const int cellx1 = SDL_max(k->screenrect.x / KEYBOARD_HIT_CELL, 0);
+        const int cellx2 = SDL_min((x2 / KEYBOARD_HIT_CELL) + 1, keyboard_hitgrid_w);
+        const int celly1 = SDL_max(k->rect.y / KEYBOARD_HIT_CELL, 0);
+        const int celly2 = SDL_min(((k->rect.y + k->rect.h) / KEYBOARD_HIT_CELL) + 1, layer->hitgrid_h);
+        for (int celly = celly1; celly < celly2; celly++) {
+            for (int cellx = cellx1; cellx < cellx2; cellx++) {
+                const SDL_Point center = { (cellx * KEYBOARD_HIT_CELL) + (KEYBOARD_HIT_CELL / 2), (celly * KEYBOARD_HIT_CELL) + (KEYBOARD_HIT_CELL / 2) + KEYBOARD_SCREEN_Y };
+                if (SDL_PointInRect(&center, &k->screenrect)) {
+                    layer->hitgrid[(celly * keyboard_hitgrid_w) + cellx] = (Uint8) (i + 1);
+                }
+            }
+        }
+    }
+
+    return SDL_TRUE;
+}
+
+// this runs on the keyboard loader thread, so it can't touch the renderer.
+static SDL_bool prepare_keyboard_layer(keyboardlayer *layer)
+{
+    char *cachepath = keyboard_cache_path(layer->image);
+    keyboardcacheheader header;
+    Uint8 *pixels = load_keyboard_cache(cachepath, &header);
+
+    if (!pixels) {
+        int w, h;
+        stbi_uc *img = load_image_pixels(layer->image, &w, &h);
+        if (!img) {
+            fprintf(stderr, "WARNING: Couldn't load keyboard image \"%s\"\n", layer->image);
+            SDL_free(cachepath);
+            return SDL_FALSE;
+        }
+        pixels = scale_keyboard_image(img, w, h, screenw);
+        stbi_image_free(img);
+        header.magic = KEYBOARD_CACHE_MAGIC;
+        header.srcw = (Uint32) w;
+        header.w = (Uint32) screenw;
+        header.h = (Uint32) h;
+        if (pixels) {
+            save_keyboard_cache(cachepath, &header, pixels);
+        }
+    }
+
+    SDL_free(cachepath);
+
+    if (!pixels) {
+        return SDL_FALSE;
+    }
+
+    layer->h = (int) header.h;
+    layer->pixels = pixels;
+    return build_keyboard_hitgrid(layer, (int) header.srcw);
+}
+
+static SDL_bool upload_keyboard_layer(keyboardlayer *layer)
+{
+    layer->texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STATIC, screenw, layer->h);
+    if (layer->texture) {
+        PROBE3(texture_create, screenw, layer->h, SDL_TEXTUREACCESS_STATIC);
+        mem_count(MEM_KEYBOARD, screenw * layer->h * 4);
+        SDL_SetTextureBlendMode(layer->texture, SDL_BLENDMODE_BLEND);
+        const Uint64 trace_start = trace_begin();
+        SDL_UpdateTexture(layer->texture, NULL, layer->pixels, screenw * 4);
+        trace_end("SDL_UpdateTexture", trace_start);
+        PROBE3(texture_upload, screenw, layer->h, screenw * layer->h * 4);
+    }
+    SDL_free(layer->pixels);
+    layer->pixels = NULL;
+    return layer->texture ? SDL_TRUE : SDL_FALSE;
+}
+
+static void free_keyboard(void)
+{
+    for (int i = 0; i < num_keyboard_layers; i++) {
+        keyboardlayer *layer = &keyboard_layers[i];
+        if (layer->texture) {
+            mem_count(MEM_KEYBOARD, -texture_bytes(layer->texture));
+            SDL_DestroyTexture(layer->texture);
+        }
+        SDL_free(layer->hitgrid);
+        SDL_free(layer->pixels);
+        SDL_free(layer->image);
+    }
+    SDL_zero(keyboard_layers);
+    num_keyboard_layers = 0;
+    if (keyboard_overlay) {
+        mem_count(MEM_KEYBOARD, -texture_bytes(keyboard_overlay));
+        SDL_DestroyTexture(keyboard_overlay);
+        keyboard_overlay = NULL;
+    }
+    keyboard_texture = NULL;
+    keyinfo = NULL;
+    keyboard_hitgrid = NULL;
+}
+
+// Nobody needs the keyboard at boot, so parsing the layout and decoding the
+//  images happens in the background; the main thread only uploads the
+//  textures when it's done. Until then, keyboard_texture is NULL and the
+//  keyboard won't slide in.
+static int SDLCALL keyboard_loader_thread(void *data)
+{
+    set_decode_thread_policy();  // don't fight the boot image (or an emulator) for the CPU.
+    SDL_bool okay = parse_keyboard_layout(keyboard_layout_path);
+    for (int i = 0; okay && (i < num_keyboard_layers); i++) {
+        decode_backoff();
+        okay = prepare_keyboard_layer(&keyboard_layers[i]);
+    }
+    SDL_AtomicSet(&keyboard_loader_done, 1);
+    return okay ? 1 : 0;
+}
+
+static void finish_keyboard_load(SDL_bool okay)
+{
+    for (int i = 0; okay && (i < num_keyboard_layers); i++) {
+        okay = upload_keyboard_layer(&keyboard_layers[i]);
+    }
+
+    if (!okay) {
+        free_keyboard();  // keyboard_texture stays NULL, so no keyboard for you.
+    } else {
+        lock_input();  // the touch thread might be looking at keyboard_texture.
+        set_keyboard_layer(0);
+        unlock_input();
+        report_boot_time("keyboard ready");
+    }
+}
+
+static void load_keyboard(void)
+{
+    keyboard_hitgrid_w = (screenw + (KEYBOARD_HIT_CELL - 1)) / KEYBOARD_HIT_CELL;
+    SDL_AtomicSet(&keyboard_loader_done, 0);
+    keyboard_loader = SDL_CreateThread(keyboard_loader_thread, "keyboard", NULL);
+    if (!keyboard_loader) {
+        finish_keyboard_load(keyboard_loader_thread(NULL) ? SDL_TRUE : SDL_FALSE);  // just do it here, then.
+    }
+}
+
+// main thread only; picks up the keyboard once the loader thread is done.
+static void update_keyboard_load(void)
+{
+    if (keyboard_loader && SDL_AtomicGet(&keyboard_loader_done)) {
+        int okay = 0;
+        SDL_WaitThread(keyboard_loader, &okay);
+        keyboard_loader = NULL;
+        finish_keyboard_load(okay ? SDL_TRUE : SDL_FALSE);
+    }
+}
+
+// Get on the bus before anything else: systemd waits for our name (the
+//  service is Type=dbus), and ShowImage signals that arrive while we're
+//  still setting up the display just queue up until iterate() reads them.
+static void connect_dbus(void)
+{
+    #if USE_DBUS
+    DBusError err;
+    dbus_error_init(&err);
+    dbus = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "ERROR: Can't connect to system D-Bus: %s\n", err.message);
+        dbus_error_free(&err);
+        dbus = NULL;
+        return;
+    } else if (dbus == NULL) {
+        fprintf(stderr, "ERROR: Can't connect to system D-Bus\n");
+        return;
+    }
+
+    // match before taking the name, so nothing sent the moment we own it gets lost.
+    dbus_bus_add_match(dbus, "type='signal',interface='org.icculus.Arcade1UpMarquee'", &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "ERROR: Can't match on D-Bus interface name: %s\n", err.message);
+        dbus_error_free(&err);
+        dbus_connection_unref(dbus);
+        dbus = NULL;
+        return;
     }
 
-    int posx = 4;
-    int posy = 4;
-    int keyw = 52;
-    int keyh = 52;
-    virtkey *k = keyinfo;
-    #define ADDKEY(sc, x, y, w, h) { \
-        SDL_assert((k - keyinfo) < SDL_arraysize(keyinfo)); \
-        const SDL_Rect r = { x, y, w, h }; \
-        SDL_memcpy(&k->rect, &r, sizeof (SDL_Rect)); \
-        k->scancode = KEY_##sc; \
-        k++; \
-        posx += (w + 1); \
-    }
-
-    // !!! FIXME: hardcoded mess
-    ADDKEY(GRAVE, posx, posy, keyw, keyh);
-    ADDKEY(1, posx, posy, keyw, keyh);
-    ADDKEY(2, posx, posy, keyw, keyh);
-    ADDKEY(3, posx, posy, keyw, keyh);
-    ADDKEY(4, posx, posy, keyw, keyh);
-    ADDKEY(5, posx, posy, keyw, keyh);
-    ADDKEY(6, posx, posy, keyw, keyh);
-    ADDKEY(7, posx, posy, keyw, keyh);
-    ADDKEY(8, posx, posy, keyw, keyh);
-    ADDKEY(9, posx, posy, keyw, keyh);
-    ADDKEY(0, posx, posy, keyw, keyh);
-    ADDKEY(MINUS, posx, posy, keyw, keyh);
-    ADDKEY(EQUAL, posx, posy, keyw, keyh);
-    ADDKEY(BACKSPACE, posx, posy, 105, keyh);
-
-    posx = 4;
-    posy += (keyh + 1);
-    ADDKEY(TAB, posx, posy, 78, keyh);
-    ADDKEY(Q, posx, posy, keyw, keyh);
-    ADDKEY(W, posx, posy, keyw, keyh);
-    ADDKEY(E, posx, posy, keyw, keyh);
-    ADDKEY(R, posx, posy, keyw, keyh);
-    ADDKEY(T, posx, posy, keyw, keyh);
-    ADDKEY(Y, posx, posy, keyw, keyh);
-    ADDKEY(U, posx, posy, keyw, keyh);
-    ADDKEY(I, posx, posy, keyw, keyh);
-    ADDKEY(O, posx, posy, keyw, keyh);
-    ADDKEY(P, posx, posy, keyw, keyh);
-    ADDKEY(LEFTBRACE, posx, posy, keyw, keyh);
-    ADDKEY(RIGHTBRACE, posx, posy, keyw, keyh);
-    ADDKEY(BACKSLASH, posx, posy, 78, keyh);
-
-    posx = 4;
-    posy += (keyh + 1);
-    ADDKEY(CAPSLOCK, posx, posy, 91, keyh);
-    ADDKEY(A, posx, posy, keyw, keyh);
-    ADDKEY(S, posx, posy, keyw, keyh);
-    ADDKEY(D, posx, posy, keyw, keyh);
-    ADDKEY(F, posx, posy, keyw, keyh);
-    ADDKEY(G, posx, posy, keyw, keyh);
-    ADDKEY(H, posx, posy, keyw, keyh);
-    ADDKEY(J, posx, posy, keyw, keyh);
-    ADDKEY(K, posx, posy, keyw, keyh);
-    ADDKEY(L, posx, posy, keyw, keyh);
-    ADDKEY(SEMICOLON, posx, posy, keyw, keyh);
-    ADDKEY(APOSTROPHE, posx, posy, keyw, keyh);
-    ADDKEY(ENTER, posx, posy, 118, keyh);
-
-    posx = 4;
-    posy += (keyh + 1);
-    ADDKEY(LEFTSHIFT, posx, posy, 118, keyh);
-    ADDKEY(Z, posx, posy, keyw, keyh);
-    ADDKEY(X, posx, posy, keyw, keyh);
-    ADDKEY(C, posx, posy, keyw, keyh);
-    ADDKEY(V, posx, posy, keyw, keyh);
-    ADDKEY(B, posx, posy, keyw, keyh);
-    ADDKEY(N, posx, posy, keyw, keyh);
-    ADDKEY(M, posx, posy, keyw, keyh);
-    ADDKEY(COMMA, posx, posy, keyw, keyh);
-    ADDKEY(DOT, posx, posy, keyw, keyh);
-    ADDKEY(SLASH, posx, posy, keyw, keyh);
-    ADDKEY(RIGHTSHIFT, posx, posy, 145, keyh);
-
-    posx = 4;
-    posy += (keyh + 1);
-    ADDKEY(LEFTCTRL, posx, posy, 78, keyh);
-    ADDKEY(LEFTMETA, posx, posy, 65, keyh);
-    ADDKEY(LEFTALT, posx, posy, 65, keyh);
-    ADDKEY(SPACE, posx, posy, 304, keyh);
-    ADDKEY(RIGHTALT, posx, posy, 65, keyh);
-    ADDKEY(RIGHTMETA, posx, posy, 65, keyh);
-    ADDKEY(RIGHTCTRL, posx, posy, 78, keyh);
-
-    #undef ADDKEY
-
-    return tex;
+    const int rc = dbus_bus_request_name(dbus, "org.icculus.Arcade1UpMarquee", DBUS_NAME_FLAG_REPLACE_EXISTING, &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "ERROR: Couldn't acquire D-Bus service name: %s\n", err.message);
+        dbus_error_free(&err);
+        dbus_connection_unref(dbus);
+        dbus = NULL;
+    } else if (rc != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "ERROR: Not the primary owner of the D-Bus service name (%d)\n", rc);
+        dbus_connection_unref(dbus);
+        dbus = NULL;
+    } else {
+        dbus_connection_flush(dbus);
+        report_boot_time("D-Bus name acquired");
+    }
+    #endif
 }
 
 
 static SDL_bool initialize(const int argc, char **argv)
 {
     // make sure static vars are sane.
-    fingers_down = 0;
+    main_thread_id = SDL_ThreadID();
+    SDL_AtomicSet(&fingers_down, 0);
     motion_finger_down = SDL_FALSE;
     motion_finger = 0;
     button_finger_down = SDL_FALSE;
     button_finger = 0;
+    mouse_motion_x = mouse_motion_y = 0.0f;
     keyboard_slide_cooldown = SDL_FALSE;
     keyboard_slide_percent = 0.0f;
-    SDL_zero(keyinfo);
     SDL_zero(pressed_keys);
+    SDL_memset(key_pressed_slot, 0xFF, sizeof (key_pressed_slot));  // all -1.
+    SDL_zero(texture_pool);
     handle_fingerdown = handle_fingerdown_mouse;
     handle_fingerup = handle_fingerup_mouse;
     handle_fingermotion = handle_fingermotion_mouse;
     handle_redraw = NULL;
+    SDL_AtomicSet(&keyboard_slide_request, KEYBOARD_SLIDE_NONE);
+    SDL_AtomicSet(&redraw_request, 0);
+    SDL_AtomicSet(&idle_state, IDLE_AWAKE);
+    SDL_AtomicSet(&activity_serial, 0);
+    idle_activity_serial = 0;
+    backlight_brightness = -1;
 
     int displayidx = 1;   // presumably a good default for our use case.
     const char *initial_image = NULL;
@@ -784,6 +6462,58 @@ static SDL_bool initialize(const int argc, char **argv)
             window_flags &= ~SDL_WINDOW_FULLSCREEN_DESKTOP;
         } else if (SDL_strcmp(arg, "--fullscreen") == 0) {
             window_flags |= SDL_WINDOW_FULLSCREEN_DESKTOP;
+        } else if (SDL_strcmp(arg, "--streaming") == 0) {
+            use_streaming_textures = SDL_TRUE;
+        } else if (SDL_strcmp(arg, "--nostreaming") == 0) {
+            use_streaming_textures = SDL_FALSE;
+        } else if (SDL_strcmp(arg, "--prescale") == 0) {
+            prescale_images = SDL_TRUE;
+        } else if (SDL_strcmp(arg, "--noprescale") == 0) {
+            prescale_images = SDL_FALSE;
+        } else if (SDL_strcmp(arg, "--animbudget") == 0) {
+            anim_budget_mb = (Uint32) SDL_atoi(argv[++i]);  // megabytes, 0 to disable animation.
+        } else if (SDL_strcmp(arg, "--videothreads") == 0) {
+            video_threads = SDL_atoi(argv[++i]);
+        } else if (SDL_strcmp(arg, "--videofps") == 0) {
+            const int fps = SDL_atoi(argv[++i]);
+            video_fps = (Uint32) SDL_max(fps, 1);
+        } else if (SDL_strcmp(arg, "--fps") == 0) {
+            target_fps = SDL_atoi(argv[++i]);  // pace with a timer at this rate instead of vsync.
+        } else if (SDL_strcmp(arg, "--framestats") == 0) {
+            show_frame_stats = SDL_TRUE;
+        #if USE_LIBEVDEV
+        } else if (SDL_strcmp(arg, "--touchdevice") == 0) {
+            touch_device_path = argv[++i];  // "/dev/input/eventX", or "auto"
+        #endif
+        } else if (SDL_strcmp(arg, "--keyboard") == 0) {
+            keyboard_layout_path = argv[++i];  // layout file; see keyboard-en.txt.
+        } else if (SDL_strcmp(arg, "--decodenice") == 0) {
+            const char *val = argv[++i];
+            decode_nice = (SDL_strcmp(val, "idle") == 0) ? DECODE_NICE_IDLE : SDL_max(-20, SDL_min(SDL_atoi(val), 19));
+        } else if (SDL_strcmp(arg, "--decodecpus") == 0) {
+            parse_decode_cpus(argv[++i]);  // "2,3" or "2-3"
+        } else if (SDL_strcmp(arg, "--decodepressure") == 0) {
+            decode_pressure_limit = SDL_atoi(argv[++i]);  // percent of CPU stall time; 0 to ignore load.
+        } else if (SDL_strcmp(arg, "--thermalpath") == 0) {
+            thermal_path = argv[++i];  // millidegrees C, like /sys/class/thermal/thermal_zone0/temp
+        } else if (SDL_strcmp(arg, "--pressurepath") == 0) {
+            cpu_pressure_path = argv[++i];  // like /proc/pressure/cpu
+        } else if (SDL_strcmp(arg, "--idledim") == 0) {
+            idle_dim_ms = ((Uint32) SDL_atoi(argv[++i])) * 1000;  // seconds; 0 to never dim.
+        } else if (SDL_strcmp(arg, "--idleblank") == 0) {
+            idle_blank_ms = ((Uint32) SDL_atoi(argv[++i])) * 1000;  // seconds; 0 to never blank.
+        } else if (SDL_strcmp(arg, "--backlight") == 0) {
+            backlight_path = argv[++i];  // a /sys/class/backlight/* directory.
+        } else if (SDL_strcmp(arg, "--membudget") == 0) {
+            mem_budget_mb = (Uint32) SDL_atoi(argv[++i]);  // megabytes, heap and textures together; 0 to just keep count.
+        } else if (SDL_strcmp(arg, "--mempressurepath") == 0) {
+            memory_pressure_path = argv[++i];  // like /proc/pressure/memory
+        } else if (SDL_strcmp(arg, "--notrace") == 0) {
+            tracing = SDL_FALSE;
+        } else if (SDL_strcmp(arg, "--tracefile") == 0) {
+            trace_path = argv[++i];  // where SIGUSR1 dumps the trace.
+        } else if (SDL_strcmp(arg, "--software") == 0) {
+            force_software = SDL_TRUE;  // no GPU, composite fades ourselves.
         } else if (SDL_strcmp(arg, "--startimage") == 0) {
             initial_image = argv[++i];
         } else {
@@ -791,11 +6521,33 @@ static SDL_bool initialize(const int argc, char **argv)
         }
     }
 
+    if (tracing) {
+        trace_tls = SDL_TLSCreate();
+        tracing = trace_tls ? SDL_TRUE : SDL_FALSE;
+        #if USE_POSIX
+        signal(SIGUSR1, trace_signal_handler);  // "kill -USR1" to dump the trace.
+        #endif
+    }
+
+    #if USE_POSIX
+    signal(SIGUSR2, memory_signal_handler);  // "kill -USR2" to print memory use.
+    #endif
+
+    // if d-bus fails, we carry on, with at least a default image showing.
+    connect_dbus();
+
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         fprintf(stderr, "ERROR! SDL_Init(SDL_INIT_VIDEO) failed: %s\n", SDL_GetError());
         return SDL_FALSE;
     }
 
+    input_wake_event = SDL_RegisterEvents(1);  // other threads push this to get us out of waiting.
+    if (input_wake_event == ((Uint32) -1)) {
+        input_wake_event = 0;
+    }
+    SDL_AtomicSet(&last_activity_ticks, (int) SDL_GetTicks());
+    start_memory_pressure_watcher();
+
     const char *driver = SDL_GetCurrentVideoDriver();
     const SDL_bool isRpi = (SDL_strcasecmp(driver, "rpi") == 0);
     if (!isRpi) {
@@ -836,7 +6588,12 @@ static SDL_bool initialize(const int argc, char **argv)
 
     SDL_GetWindowSize(window, &screenw, &screenh);
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (force_software) {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE);
+    } else {
+        renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    }
+
     if (!renderer) {
         fprintf(stderr, "WARNING! SDL_CreateRenderer(accel|vsync) failed: %s\n", SDL_GetError());
         renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
@@ -851,12 +6608,16 @@ static SDL_bool initialize(const int argc, char **argv)
         }
     }
 
-    #if 0
     SDL_RendererInfo info;
     SDL_zero(info);
     SDL_GetRendererInfo(renderer, &info);
-    printf("SDL renderer target: %s\n", info.name);
-    #endif
+    //printf("SDL renderer target: %s\n", info.name);
+    max_texture_w = info.max_texture_width;  // 0 means "no limit"
+    max_texture_h = info.max_texture_height;
+    SDL_GetRendererOutputSize(renderer, &panelw, &panelh);
+
+    init_compositor();
+    init_frame_pacer(&info);
 
     SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
     SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255);
@@ -873,44 +6634,16 @@ static SDL_bool initialize(const int argc, char **argv)
             return SDL_FALSE;
     }
 
-    set_new_image(initial_image);
-    keyboard_texture = build_keyboard_texture();
-
-    // if d-bus fails, we carry on, with at least a default image showing.
-    #if USE_DBUS
-    DBusError err;
-    dbus_error_init(&err);
-    dbus = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
-    if (dbus_error_is_set(&err)) {
-        fprintf(stderr, "ERROR: Can't connect to system D-Bus: %s\n", err.message);
-        dbus_error_free(&err);
-        dbus = NULL;
-    } else if (dbus == NULL) {
-        fprintf(stderr, "ERROR: Can't connect to system D-Bus\n");
+    if (restore_marquee_snapshot()) {
+        report_boot_time("last marquee restored from snapshot");
     } else {
-        const int rc = dbus_bus_request_name(dbus, "org.icculus.Arcade1UpMarquee", DBUS_NAME_FLAG_REPLACE_EXISTING, &err);
-        if (dbus_error_is_set(&err)) {
-            fprintf(stderr, "ERROR: Couldn't acquire D-Bus service name: %s\n", err.message);
-            dbus_error_free(&err);
-            dbus_connection_unref(dbus);
-            dbus = NULL;
-        } else if (rc != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
-            fprintf(stderr, "ERROR: Not the primary owner of the D-Bus service name (%d)\n", rc);
-            dbus_connection_unref(dbus);
-            dbus = NULL;
-        }
-
-        if (dbus) {
-            dbus_bus_add_match(dbus, "type='signal',interface='org.icculus.Arcade1UpMarquee'", &err);
-            dbus_connection_flush(dbus);
-            if (dbus_error_is_set(&err)) {
-                fprintf(stderr, "ERROR: Can't match on D-Bus interface name (%d)\n", rc);
-                dbus_connection_unref(dbus);
-                dbus = NULL;
-            }
-        }
+        set_new_image(initial_image);
+        report_boot_time("start image shown");
     }
-    #endif
+
+    probe_frame_pacer();
+
+    load_keyboard();
 
     #if USE_LIBEVDEV
     int rc;
@@ -948,6 +6681,8 @@ static SDL_bool initialize(const int argc, char **argv)
         libevdev_free(evdev_keyboard);
         evdev_keyboard = NULL;
     }
+
+    start_touch_thread();
     #endif
 
     return SDL_TRUE;
@@ -955,6 +6690,9 @@ static SDL_bool initialize(const int argc, char **argv)
 
 int main(int argc, char **argv)
 {
+    boot_ticks = SDL_GetPerformanceCounter();
+    init_memory_accounting();
+
     if (!initialize(argc, argv)) {
         deinitialize();
         return 1;
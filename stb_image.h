@@ -572,6 +572,12 @@ typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
 #endif
 
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__uint64;
+#else
+typedef uint64_t stbi__uint64;
+#endif
+
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 
@@ -3848,14 +3854,30 @@ static int stbi__jpeg_info(stbi__context *s, int *x, int *y, int *comp)
 #ifndef STBI_NO_ZLIB
 
 // fast-way is faster to check than jpeg huffman, but slow way is slower
-#define STBI__ZFAST_BITS  9 // accelerate all cases in default tables
+#define STBI__ZFAST_BITS  10 // accelerate all cases in default tables, and most extra bits
 #define STBI__ZFAST_MASK  ((1 << STBI__ZFAST_BITS) - 1)
 
+// fast table entries: low 5 bits are how many bits the entry consumes, the
+// next 3 say what it is, and the top 16 are the payload. 0 means "not in
+// the fast table, take the slow path". literal/length tables get rewritten
+// so one lookup can produce two literals, or a match length with its extra
+// bits already added; distance tables get their extra bits folded in too.
+#define STBI__ZFAST_SYM     (1 << 5) // payload is a symbol
+#define STBI__ZFAST_LIT     (2 << 5) // payload is one literal
+#define STBI__ZFAST_LIT2    (3 << 5) // payload is two literals, first in the low byte
+#define STBI__ZFAST_VALUE   (4 << 5) // payload is a length or distance, extra bits included
+#define STBI__ZFAST_EXTRA   (5 << 5) // payload is a length/distance code, extra bits still to read
+#define STBI__ZFAST_EOB     (6 << 5) // end of block
+#define STBI__ZFAST_BAD     (7 << 5) // a code that's never valid in the data
+#define STBI__ZFAST_KIND(e)     ((e) & (7 << 5))
+#define STBI__ZFAST_NBITS(e)    ((int) ((e) & 31))
+#define STBI__ZFAST_PAYLOAD(e)  ((int) ((e) >> 16))
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   stbi__uint16 fast[1 << STBI__ZFAST_BITS];
+   stbi__uint32 fast[1 << STBI__ZFAST_BITS];
    stbi__uint16 firstcode[16];
    int maxcode[17];
    stbi__uint16 firstsymbol[16];
@@ -3911,7 +3933,7 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
       int s = sizelist[i];
       if (s) {
          int c = next_code[s] - z->firstcode[s] + z->firstsymbol[s];
-         stbi__uint16 fastv = (stbi__uint16) ((s << 9) | i);
+         stbi__uint32 fastv = (stbi__uint32) (((stbi__uint32) i << 16) | STBI__ZFAST_SYM | s);
          z->size [c] = (stbi_uc     ) s;
          z->value[c] = (stbi__uint16) i;
          if (s <= STBI__ZFAST_BITS) {
@@ -3927,17 +3949,90 @@ static int stbi__zbuild_huffman(stbi__zhuffman *z, const stbi_uc *sizelist, int
    return 1;
 }
 
+static const int stbi__zlength_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static const int stbi__zlength_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static const int stbi__zdist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+// rewrite a literal/length table's symbol entries into literals, literal
+// pairs, end-of-block, and lengths with their extra bits applied
+static void stbi__zbuild_fast_litlen(stbi__zhuffman *z)
+{
+   int j;
+   // a second literal is looked up at j>>s, which is always below j, so
+   // going from the top down means we only ever read unconverted entries
+   for (j=(1 << STBI__ZFAST_BITS)-1; j >= 0; --j) {
+      stbi__uint32 e = z->fast[j];
+      int s, sym;
+      if (!e) continue;
+      s = STBI__ZFAST_NBITS(e);
+      sym = STBI__ZFAST_PAYLOAD(e);
+      if (sym < 256) {
+         stbi__uint32 e2 = z->fast[j >> s];
+         if (e2 && STBI__ZFAST_PAYLOAD(e2) < 256 && s + STBI__ZFAST_NBITS(e2) <= STBI__ZFAST_BITS)
+            z->fast[j] = ((stbi__uint32) sym << 16) | ((stbi__uint32) STBI__ZFAST_PAYLOAD(e2) << 24) | STBI__ZFAST_LIT2 | (stbi__uint32) (s + STBI__ZFAST_NBITS(e2));
+         else
+            z->fast[j] = ((stbi__uint32) sym << 16) | STBI__ZFAST_LIT | (stbi__uint32) s;
+      } else if (sym == 256) {
+         z->fast[j] = STBI__ZFAST_EOB | (stbi__uint32) s;
+      } else if (sym < 286) {
+         int extra = stbi__zlength_extra[sym-257];
+         if (s + extra <= STBI__ZFAST_BITS) {
+            int len = stbi__zlength_base[sym-257] + ((j >> s) & ((1 << extra) - 1));
+            z->fast[j] = ((stbi__uint32) len << 16) | STBI__ZFAST_VALUE | (stbi__uint32) (s + extra);
+         } else {
+            z->fast[j] = ((stbi__uint32) (sym-257) << 16) | STBI__ZFAST_EXTRA | (stbi__uint32) s;
+         }
+      } else {
+         z->fast[j] = STBI__ZFAST_BAD | (stbi__uint32) s; // 286/287 can't appear in the data
+      }
+   }
+}
+
+static void stbi__zbuild_fast_dist(stbi__zhuffman *z)
+{
+   int j;
+   for (j=0; j < (1 << STBI__ZFAST_BITS); ++j) {
+      stbi__uint32 e = z->fast[j];
+      int s, sym;
+      if (!e) continue;
+      s = STBI__ZFAST_NBITS(e);
+      sym = STBI__ZFAST_PAYLOAD(e);
+      if (sym < 30) {
+         int extra = stbi__zdist_extra[sym];
+         if (s + extra <= STBI__ZFAST_BITS) {
+            int dist = stbi__zdist_base[sym] + ((j >> s) & ((1 << extra) - 1));
+            z->fast[j] = ((stbi__uint32) dist << 16) | STBI__ZFAST_VALUE | (stbi__uint32) (s + extra);
+         } else {
+            z->fast[j] = ((stbi__uint32) sym << 16) | STBI__ZFAST_EXTRA | (stbi__uint32) s;
+         }
+      } else {
+         z->fast[j] = STBI__ZFAST_BAD | (stbi__uint32) s; // 30/31 can't appear in the data
+      }
+   }
+}
+
 // zlib-from-memory implementation for PNG reading
 //    because PNG allows splitting the zlib stream arbitrarily,
 //    and it's annoying structurally to have PNG call ZLIB call PNG,
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
-typedef struct
+typedef struct stbi__zbuf
 {
    stbi_uc *zbuffer, *zbuffer_end;
    int num_bits;
-   stbi__uint32 code_buffer;
+   int zpad;  // zero bytes fed in past the end of the input
+   stbi__uint64 code_buffer;
 
    char *zout;
    char *zout_start;
@@ -3945,6 +4040,12 @@ typedef struct
    int   z_expandable;
 
    stbi__zhuffman z_length, z_distance;
+
+   // if set, called instead of growing the output buffer when it fills up,
+   // so the caller can drain the output and keep just the 32K window.
+   // it must leave room for n more bytes at z->zout.
+   int (*zflush)(struct stbi__zbuf *z, char *zout, int n);
+   void *zflush_userdata;
 } stbi__zbuf;
 
 stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
@@ -3953,20 +4054,43 @@ stbi_inline static stbi_uc stbi__zget8(stbi__zbuf *z)
    return *z->zbuffer++;
 }
 
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) || defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM) || defined(_M_ARM64)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return ((stbi__uint64) p[0]      ) | ((stbi__uint64) p[1] <<  8) | ((stbi__uint64) p[2] << 16) | ((stbi__uint64) p[3] << 24) |
+          ((stbi__uint64) p[4] << 32) | ((stbi__uint64) p[5] << 40) | ((stbi__uint64) p[6] << 48) | ((stbi__uint64) p[7] << 56);
+#endif
+}
+
+// tops up the bit buffer to at least 56 bits
 static void stbi__fill_bits(stbi__zbuf *z)
 {
-   do {
-      STBI_ASSERT(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= (unsigned int) stbi__zget8(z) << z->num_bits;
-      z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   STBI_ASSERT(z->num_bits >= 64 || z->code_buffer < (((stbi__uint64) 1) << z->num_bits));
+   if (z->zbuffer_end - z->zbuffer >= 8) {
+      // load 8 bytes at once, keep the whole bytes that fit
+      int n = (63 - z->num_bits) >> 3;
+      z->code_buffer |= stbi__zload64(z->zbuffer) << z->num_bits;
+      z->zbuffer += n;
+      z->num_bits += n << 3;
+      z->code_buffer &= ~((stbi__uint64) 0) >> (64 - z->num_bits);
+   } else {
+      do {
+         if (z->zbuffer >= z->zbuffer_end) z->zpad++;
+         z->code_buffer |= (stbi__uint64) stbi__zget8(z) << z->num_bits;
+         z->num_bits += 8;
+      } while (z->num_bits <= 56);
+   }
 }
 
 stbi_inline static unsigned int stbi__zreceive(stbi__zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) stbi__fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
@@ -3977,7 +4101,7 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    int b,s,k;
    // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = stbi__bit_reverse(a->code_buffer, 16);
+   k = stbi__bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=STBI__ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
@@ -3990,16 +4114,18 @@ static int stbi__zhuffman_decode_slowpath(stbi__zbuf *a, stbi__zhuffman *z)
    return z->value[b];
 }
 
+// only for tables that weren't rewritten by stbi__zbuild_fast_*
 stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
 {
-   int b,s;
+   stbi__uint32 b;
+   int s;
    if (a->num_bits < 16) stbi__fill_bits(a);
    b = z->fast[a->code_buffer & STBI__ZFAST_MASK];
    if (b) {
-      s = b >> 9;
+      s = STBI__ZFAST_NBITS(b);
       a->code_buffer >>= s;
       a->num_bits -= s;
-      return b & 511;
+      return STBI__ZFAST_PAYLOAD(b);
    }
    return stbi__zhuffman_decode_slowpath(a, z);
 }
@@ -4009,11 +4135,14 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    char *q;
    int cur, limit, old_limit;
    z->zout = zout;
+   if (z->zflush) return z->zflush(z, zout, n);
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
    cur   = (int) (z->zout     - z->zout_start);
    limit = old_limit = (int) (z->zout_end - z->zout_start);
-   while (cur + n > limit)
+   while (cur + n > limit) {
+      if (limit > 0x3fffffff) return stbi__err("outofmem", "Out of memory"); // corrupt data could grow forever
       limit *= 2;
+   }
    q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
@@ -4023,58 +4152,114 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
    return 1;
 }
 
-static const int stbi__zlength_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
-
-static const int stbi__zlength_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
-
-static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
-
-static const int stbi__zdist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
-
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+      stbi__uint32 e;
+      stbi_uc *p;
+      int z,len,dist;
+
+      // 48 bits covers the longest length code and distance code with all their extra bits
+      if (a->num_bits < 48) stbi__fill_bits(a);
+      // a valid stream never gets far into the padding; a truncated one could decode it forever
+      if (a->zpad * 8 > a->num_bits + 16) return stbi__err("unexpected end","Corrupt PNG");
+      e = a->z_length.fast[a->code_buffer & STBI__ZFAST_MASK];
+      if (e) {
+         a->code_buffer >>= STBI__ZFAST_NBITS(e);
+         a->num_bits -= STBI__ZFAST_NBITS(e);
+      }
+
+      if (STBI__ZFAST_KIND(e) == STBI__ZFAST_LIT) {
          if (zout >= a->zout_end) {
             if (!stbi__zexpand(a, zout, 1)) return 0;
             zout = a->zout;
          }
-         *zout++ = (char) z;
+         *zout++ = (char) STBI__ZFAST_PAYLOAD(e);
+         continue;
+      } else if (STBI__ZFAST_KIND(e) == STBI__ZFAST_LIT2) {
+         if (zout + 2 > a->zout_end) {
+            if (!stbi__zexpand(a, zout, 2)) return 0;
+            zout = a->zout;
+         }
+         *zout++ = (char) (STBI__ZFAST_PAYLOAD(e) & 255);
+         *zout++ = (char) (STBI__ZFAST_PAYLOAD(e) >> 8);
+         continue;
+      } else if (STBI__ZFAST_KIND(e) == STBI__ZFAST_EOB) {
+         a->zout = zout;
+         return 1;
+      } else if (STBI__ZFAST_KIND(e) == STBI__ZFAST_VALUE) {
+         len = STBI__ZFAST_PAYLOAD(e);
       } else {
-         stbi_uc *p;
-         int len,dist;
-         if (z == 256) {
-            a->zout = zout;
-            return 1;
+         if (STBI__ZFAST_KIND(e) == STBI__ZFAST_EXTRA) {
+            z = STBI__ZFAST_PAYLOAD(e);
+         } else if (e) {
+            return stbi__err("bad huffman code","Corrupt PNG");
+         } else {
+            z = stbi__zhuffman_decode_slowpath(a, &a->z_length);
+            if (z < 256) {
+               if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
+               if (zout >= a->zout_end) {
+                  if (!stbi__zexpand(a, zout, 1)) return 0;
+                  zout = a->zout;
+               }
+               *zout++ = (char) z;
+               continue;
+            }
+            if (z == 256) {
+               a->zout = zout;
+               return 1;
+            }
+            z -= 257;
+            if (z >= 29) return stbi__err("bad huffman code","Corrupt PNG");
          }
-         z -= 257;
          len = stbi__zlength_base[z];
          if (stbi__zlength_extra[z]) len += stbi__zreceive(a, stbi__zlength_extra[z]);
-         z = stbi__zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return stbi__err("bad huffman code","Corrupt PNG");
-         dist = stbi__zdist_base[z];
-         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
-         if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
-         if (zout + len > a->zout_end) {
-            if (!stbi__zexpand(a, zout, len)) return 0;
-            zout = a->zout;
-         }
-         p = (stbi_uc *) (zout - dist);
-         if (dist == 1) { // run of one byte; common in images.
-            stbi_uc v = *p;
-            if (len) { do *zout++ = v; while (--len); }
+      }
+
+      e = a->z_distance.fast[a->code_buffer & STBI__ZFAST_MASK];
+      if (STBI__ZFAST_KIND(e) == STBI__ZFAST_VALUE) {
+         a->code_buffer >>= STBI__ZFAST_NBITS(e);
+         a->num_bits -= STBI__ZFAST_NBITS(e);
+         dist = STBI__ZFAST_PAYLOAD(e);
+      } else {
+         if (STBI__ZFAST_KIND(e) == STBI__ZFAST_EXTRA) {
+            a->code_buffer >>= STBI__ZFAST_NBITS(e);
+            a->num_bits -= STBI__ZFAST_NBITS(e);
+            z = STBI__ZFAST_PAYLOAD(e);
+         } else if (e) {
+            return stbi__err("bad huffman code","Corrupt PNG");
          } else {
-            if (len) { do *zout++ = *p++; while (--len); }
+            z = stbi__zhuffman_decode_slowpath(a, &a->z_distance);
+            if (z < 0 || z >= 30) return stbi__err("bad huffman code","Corrupt PNG");
          }
+         dist = stbi__zdist_base[z];
+         if (stbi__zdist_extra[z]) dist += stbi__zreceive(a, stbi__zdist_extra[z]);
+      }
+
+      if (zout - a->zout_start < dist) return stbi__err("bad dist","Corrupt PNG");
+      if (zout + len > a->zout_end) {
+         if (!stbi__zexpand(a, zout, len)) return 0;
+         zout = a->zout;
+      }
+      p = (stbi_uc *) (zout - dist);
+      if (dist == 1) { // run of one byte; common in images.
+         memset(zout, *p, len);
+         zout += len;
+      } else if (dist >= 8 && zout + len + 8 <= a->zout_end) {
+         // copy a word at a time. each 8-byte chunk reads from at least 8
+         // bytes back, so it never overlaps itself. this can write up to 7
+         // bytes past the match, but they're inside the buffer and get
+         // overwritten by whatever comes next.
+         char *end = zout + len;
+         do {
+            memcpy(zout, p, 8);
+            zout += 8;
+            p += 8;
+         } while (zout < end);
+         zout = end;
+      } else {
+         if (len) { do *zout++ = *p++; while (--len); }
       }
    }
 }
@@ -4125,6 +4310,8 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   stbi__zbuild_fast_litlen(&a->z_length);
+   stbi__zbuild_fast_dist(&a->z_distance);
    return 1;
 }
 
@@ -4136,21 +4323,27 @@ static int stbi__parse_uncompressed_block(stbi__zbuf *a)
       stbi__zreceive(a, a->num_bits & 7); // discard
    // drain the bit-packed data into header
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (stbi_uc) (a->code_buffer & 255); // suppress MSVC run-time check
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   STBI_ASSERT(a->num_bits == 0);
    // now fill header the normal way
    while (k < 4)
       header[k++] = stbi__zget8(a);
    len  = header[1] * 256 + header[0];
    nlen = header[3] * 256 + header[2];
    if (nlen != (len ^ 0xffff)) return stbi__err("zlib corrupt","Corrupt PNG");
-   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    if (a->zout + len > a->zout_end)
       if (!stbi__zexpand(a, a->zout, len)) return 0;
+   // the bit buffer can still hold up to 7 bytes, which start the stored data
+   while (a->num_bits > 0 && len > 0) {
+      *a->zout++ = (char) (a->code_buffer & 255);
+      a->code_buffer >>= 8;
+      a->num_bits -= 8;
+      --len;
+   }
+   if (a->zbuffer + len > a->zbuffer_end) return stbi__err("read past buffer","Corrupt PNG");
    memcpy(a->zout, a->zbuffer, len);
    a->zbuffer += len;
    a->zout += len;
@@ -4205,6 +4398,7 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
    if (parse_header)
       if (!stbi__parse_zlib_header(a)) return 0;
    a->num_bits = 0;
+   a->zpad = 0;
    a->code_buffer = 0;
    do {
       final = stbi__zreceive(a,1);
@@ -4218,6 +4412,8 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            stbi__zbuild_fast_litlen(&a->z_length);
+            stbi__zbuild_fast_dist(&a->z_distance);
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
@@ -4233,6 +4429,7 @@ static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->zflush = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4601,6 +4798,27 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    return 1;
 }
 
+// exact size of the decompressed image data: each row is a filter byte plus
+// packed samples, and interlaced images are seven smaller images in a row
+static stbi__uint32 stbi__png_raw_len(stbi__uint32 img_x, stbi__uint32 img_y, int img_n, int depth, int interlaced)
+{
+   static const int xorig[] = { 0,4,0,2,0,1,0 };
+   static const int yorig[] = { 0,0,4,0,2,0,1 };
+   static const int xspc[]  = { 8,8,4,4,2,2,1 };
+   static const int yspc[]  = { 8,8,8,4,4,2,2 };
+   stbi__uint32 total = 0;
+   int p;
+   if (!interlaced)
+      return ((((img_n * img_x * depth) + 7) >> 3) + 1) * img_y;
+   for (p=0; p < 7; ++p) {
+      stbi__uint32 x = (img_x - xorig[p] + xspc[p]-1) / xspc[p];
+      stbi__uint32 y = (img_y - yorig[p] + yspc[p]-1) / yspc[p];
+      if (x && y)
+         total += ((((img_n * x * depth) + 7) >> 3) + 1) * y;
+   }
+   return total;
+}
+
 static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
 {
    int bytes = (depth == 16 ? 2 : 1);
@@ -4901,13 +5119,13 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
          }
 
          case STBI__PNG_TYPE('I','E','N','D'): {
-            stbi__uint32 raw_len, bpl;
+            stbi__uint32 raw_len;
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
-            // initial guess for decoded data size to avoid unnecessary reallocs
-            bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
-            raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
+            // IHDR tells us exactly how big the decoded data is, so this is
+            // allocated once and never needs to grow for a valid file
+            raw_len = stbi__png_raw_len(s->img_x, s->img_y, s->img_n, z->depth, interlace);
             z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
             if (z->expanded == NULL) return 0; // zlib should set error
             STBI_FREE(z->idata); z->idata = NULL;